@@ -0,0 +1,46 @@
+/* Memory allocated per received frame: javascript heap and ArrayBuffer
+   backing stores, measured between two collections (run with a large young
+   generation, --max-semi-space-size, so no collection happens in between) */
+var c = require("./common.js");
+var perf = require("perf_hooks");
+
+var NODES = 16;
+var PERIOD_US = 500;
+
+async function step(ctx, mode){
+	var nodes = c.open(ctx, c.ids(NODES), {sim_nodes: NODES, sim_tpdo: PERIOD_US});
+	var received = 0, collections = 0, before, after;
+	var observer = new perf.PerformanceObserver((list) => collections += list.getEntries().length);
+
+	nodes.forEach(function(node){
+		if(mode == "pdo_recv")
+			node.pdo_recv(() => ++received);
+		else
+			node.pdo_recv_batch((buffer, count) => received += count);
+		node.nmt_send(c.co.NMT_OPERATIONAL);
+	});
+	await c.wait(50);
+	global.gc();
+	observer.observe({entryTypes: ["gc"]});
+	received = 0;
+	before = process.memoryUsage();
+	await c.wait(ctx.duration);
+	after = process.memoryUsage();
+	observer.disconnect();
+	var res = {
+		mode: mode,
+		frames: received,
+		heap_bytes_per_frame: Math.round((after.heapUsed - before.heapUsed) / received),
+		array_buffer_bytes_per_frame: Math.round((after.arrayBuffers - before.arrayBuffers) / received),
+		collections: collections
+	};
+	await c.release(nodes);
+	return res;
+}
+
+module.exports = async function(ctx){
+	var steps = [];
+	for(var mode of ["pdo_recv", "pdo_recv_batch"])
+		steps.push(await step(ctx, mode));
+	return steps;
+};
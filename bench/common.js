@@ -0,0 +1,73 @@
+/* Helpers shared by the benchmarks */
+var co = require("../direct-canopen.js");
+
+function wait(ms){
+	return new Promise((resolve) => setTimeout(resolve, ms));
+}
+
+function immediate(){
+	return new Promise((resolve) => setImmediate(resolve));
+}
+
+function now_ms(){
+	return Number(process.hrtime.bigint()) / 1e6;
+}
+
+function ids(count, first){
+	return Array.from({length: count}, (_, i) => i + (first || 1));
+}
+
+/* Nodes on a new bus, with the simulated slaves configured by `sim` when the
+   transport has them (sim_nodes, sim_tpdo, sim_heartbeat, ...) */
+function open(ctx, node_ids, sim){
+	var options = Object.assign({transport: ctx.transport}, ctx.options, sim);
+	return node_ids.map((id) => co.create_node(ctx.device, id, options));
+}
+
+/* Stop the slaves and the callbacks, then free the bus so the next stage gets
+   a new one (needs --expose-gc) */
+async function release(nodes){
+	nodes.forEach(function(node){
+		node.nmt_send(co.NMT_PRE_OPERATIONAL);
+		node.stop();
+	});
+	nodes.length = 0;
+	await wait(10);
+	for(var n = 0; n < 3; ++n){
+		global.gc();
+		await immediate();
+	}
+}
+
+/* Keep `depth` requests of `request()` in flight during `ms` */
+async function saturate(depth, ms, request){
+	var end = now_ms() + ms, done = 0, errors = 0, start = now_ms();
+	async function worker(){
+		while(now_ms() < end){
+			try { await request(); ++done; } catch(e) { ++errors; }
+		}
+	}
+	await Promise.all(Array.from({length: depth}, worker));
+	return { done: done, errors: errors, elapsed_ms: now_ms() - start };
+}
+
+/* Latency summary of the native histogram, nanoseconds to microseconds */
+function latency_us(hist){
+	var res = { count: hist.count };
+	["min", "mean", "p50", "p90", "p99", "p999", "max"].forEach(function(k){
+		res[k] = Math.round(hist[k] / 100) / 10;
+	});
+	return res;
+}
+
+module.exports = {
+	"co": co,
+	"wait": wait,
+	"immediate": immediate,
+	"now_ms": now_ms,
+	"ids": ids,
+	"open": open,
+	"release": release,
+	"saturate": saturate,
+	"latency_us": latency_us
+};
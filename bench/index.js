@@ -0,0 +1,77 @@
+/* Benchmarks of direct-canopen, results as JSON on stdout
+
+   node bench [--transport loopback|socketcan_sim|socketcan] [--device name]
+              [--node id] [--duration ms] [--suite sdo,pdo,latency,alloc,nodes]
+              [--rx_batch n] [--fd]
+
+   The default transport "loopback" runs against simulated slaves in memory.
+   "socketcan_sim" runs the simulated slaves on a second socket of a SocketCAN
+   interface (vcan0), "socketcan" needs real slaves answering SDO (node ids 1
+   to 127 for the scaling) and sending TPDO for the PDO suites. */
+var child_process = require("child_process");
+var os = require("os");
+
+var SUITES = ["sdo", "pdo", "latency", "alloc", "nodes"];
+
+/* The buses are freed between stages and the allocations measured without
+   collections: needs the garbage collector and a large young generation */
+if(typeof global.gc != "function"){
+	var r = child_process.spawnSync(process.execPath,
+		["--expose-gc", "--max-semi-space-size=64", __filename].concat(process.argv.slice(2)),
+		{stdio: "inherit"});
+	process.exit(r.status === null ? 1 : r.status);
+}
+
+function parse_args(argv){
+	var ctx = {
+		transport: "loopback",
+		device: "sim0",
+		node_id: 1,
+		duration: 1000,
+		suites: SUITES,
+		options: {}
+	};
+	for(var i = 0; i < argv.length; ++i){
+		switch(argv[i]){
+			case "--transport": ctx.transport = argv[++i]; break;
+			case "--device": ctx.device = argv[++i]; break;
+			case "--node": ctx.node_id = parseInt(argv[++i]); break;
+			case "--duration": ctx.duration = parseInt(argv[++i]); break;
+			case "--suite": ctx.suites = argv[++i].split(","); break;
+			case "--rx_batch": ctx.options.rx_batch = parseInt(argv[++i]); break;
+			case "--fd": ctx.options.fd = true; break;
+			default: throw new Error("Unknown argument " + argv[i]);
+		}
+	}
+	ctx.suites.forEach(function(s){
+		if(SUITES.indexOf(s) < 0) throw new Error("Unknown suite " + s);
+	});
+	return ctx;
+}
+
+async function main(){
+	var ctx = parse_args(process.argv.slice(2));
+	var report = {
+		version: require("../package.json").version,
+		node: process.version,
+		cpu: os.cpus()[0].model,
+		date: new Date().toISOString(),
+		transport: ctx.transport,
+		device: ctx.device,
+		duration_ms: ctx.duration,
+		results: {}
+	};
+	for(var s of ctx.suites){
+		try {
+			report.results[s] = await require("./" + s + ".js")(ctx);
+		} catch(e) {
+			report.results[s] = { error: e.message };
+		}
+	}
+	console.log(JSON.stringify(report, null, 2));
+}
+
+main().then(() => process.exit(0), function(e){
+	console.error(e.message);
+	process.exit(1);
+});
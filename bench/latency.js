@@ -0,0 +1,39 @@
+/* Kernel receive to javascript callback, under a steady PDO load */
+var c = require("./common.js");
+
+var NODES = 16;
+var PERIOD_US = 1000;
+
+async function step(ctx, mode, rx_thread){
+	var nodes = c.open(ctx, c.ids(NODES),
+		{sim_nodes: NODES, sim_tpdo: PERIOD_US, rx_thread: rx_thread});
+	var received = 0;
+
+	nodes.forEach(function(node){
+		if(mode == "pdo_recv")
+			node.pdo_recv(() => ++received);
+		else
+			node.pdo_recv_batch((buffer, count) => received += count);
+		node.nmt_send(c.co.NMT_OPERATIONAL);
+	});
+	await c.wait(50);
+	nodes.forEach((node) => node.latency(true));
+	await c.wait(ctx.duration);
+	/* Every node sees the same load, the first one is representative */
+	var res = {
+		mode: mode,
+		rx_thread: rx_thread,
+		received: received,
+		latency_us: c.latency_us(nodes[0].latency().rx)
+	};
+	await c.release(nodes);
+	return res;
+}
+
+module.exports = async function(ctx){
+	var steps = [];
+	for(var mode of ["pdo_recv", "pdo_recv_batch"])
+		for(var rx_thread of [false, true])
+			steps.push(await step(ctx, mode, rx_thread));
+	return { nodes: NODES, period_us: PERIOD_US, steps: steps };
+};
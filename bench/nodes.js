@@ -0,0 +1,27 @@
+/* SDO transactions per second of the bus against the number of nodes, one
+   request in flight per node */
+var c = require("./common.js");
+
+module.exports = async function(ctx){
+	var results = [];
+	for(var count of [1, 2, 4, 8, 16, 32, 64, 127]){
+		var nodes = c.open(ctx, c.ids(count), {sim_nodes: count});
+		var done = 0, errors = 0, start = c.now_ms();
+		await Promise.all(nodes.map(async function(node){
+			var r = await c.saturate(1, ctx.duration,
+				() => node.sdo_read(0x1000, 0, c.co.SDO_UINT32));
+			done += r.done;
+			errors += r.errors;
+		}));
+		var elapsed = c.now_ms() - start;
+		results.push({
+			nodes: count,
+			transactions: done,
+			errors: errors,
+			per_second: Math.round(done * 1000 / elapsed),
+			latency_us: c.latency_us(nodes[0].latency().sdo)
+		});
+		await c.release(nodes);
+	}
+	return results;
+};
@@ -0,0 +1,46 @@
+/* Highest PDO receive rate without drops: the simulated slaves send a TPDO
+   with a 32 bits counter every period, a gap in the counter is a drop */
+var c = require("./common.js");
+
+var NODES = 127;
+var PERIODS_US = [10000, 5000, 2000, 1000, 500, 250, 100]; /* 12.7k to 1.27M frames/s */
+
+async function step(ctx, period){
+	var nodes = c.open(ctx, c.ids(NODES), {sim_nodes: NODES, sim_tpdo: period});
+	var last = [], received = 0, drops = 0, start, elapsed;
+
+	nodes.forEach(function(node, i){
+		node.pdo_recv(function(pdoid, data){
+			var counter = new DataView(data).getUint32(0, true);
+			if(last[i] !== undefined && counter != last[i] + 1)
+				drops += counter - last[i] - 1;
+			last[i] = counter;
+			++received;
+		});
+		node.nmt_send(c.co.NMT_OPERATIONAL);
+	});
+	await c.wait(50);
+	received = drops = 0;
+	start = c.now_ms();
+	await c.wait(ctx.duration);
+	elapsed = c.now_ms() - start;
+	var res = {
+		period_us: period,
+		offered_per_second: Math.round(NODES * 1e6 / period),
+		received_per_second: Math.round(received * 1000 / elapsed),
+		drops: ctx.transport == "socketcan" ? null : drops, /* Real slaves, no counter */
+		latency_us: c.latency_us(nodes[0].latency().rx)
+	};
+	await c.release(nodes);
+	return res;
+}
+
+module.exports = async function(ctx){
+	var steps = [], max = 0;
+	for(var period of PERIODS_US){
+		var s = await step(ctx, period);
+		steps.push(s);
+		if(!s.drops) max = Math.max(max, s.received_per_second);
+	}
+	return { nodes: NODES, max_per_second_without_drops: max, steps: steps };
+};
@@ -0,0 +1,26 @@
+/* SDO transactions per second against the queue depth of one node */
+var c = require("./common.js");
+
+module.exports = async function(ctx){
+	var results = [];
+	var nodes = c.open(ctx, [ctx.node_id], {sim_nodes: ctx.node_id});
+	var node = nodes[0];
+
+	/* Warm up, and fail early without a slave */
+	await node.sdo_read(0x1000, 0, c.co.SDO_UINT32);
+	for(var depth of [1, 2, 4, 8, 16, 32, 64, 128]){
+		node.latency(true);
+		var r = await c.saturate(depth, ctx.duration,
+			() => node.sdo_read(0x1000, 0, c.co.SDO_UINT32));
+		results.push({
+			depth: depth,
+			transactions: r.done,
+			errors: r.errors,
+			per_second: Math.round(r.done * 1000 / r.elapsed_ms),
+			latency_us: c.latency_us(node.latency(true).sdo)
+		});
+	}
+	node = null;
+	await c.release(nodes);
+	return results;
+};
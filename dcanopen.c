@@ -1,13 +1,25 @@
+#define _GNU_SOURCE
 #include <node_api.h>
 #include <uv.h>
 #include <linux/can.h>
 #include <linux/can/raw.h>
+#include <linux/can/error.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <malloc.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <net/if.h>
 
@@ -47,6 +59,68 @@ napi_status napi_create_error_utf8(napi_env env,
 	return status;
 }
 
+/* Read an optional property of an options object, keep the default value
+   if the object or the property is missing. */
+napi_status napi_get_named_uint32(napi_env env, napi_value object,
+		const char *name, uint32_t *result){
+	napi_status status;
+	napi_valuetype vt;
+	napi_value value;
+	bool has;
+	status = napi_typeof(env, object, &vt);
+	if (status != napi_ok || vt != napi_object) return status;
+	status = napi_has_named_property(env, object, name, &has);
+	if (status != napi_ok || !has) return status;
+	status = napi_get_named_property(env, object, name, &value);
+	if (status != napi_ok) return status;
+	return napi_get_value_uint32(env, value, result);
+}
+
+napi_status napi_get_named_bool(napi_env env, napi_value object,
+		const char *name, bool *result){
+	napi_status status;
+	napi_valuetype vt;
+	napi_value value;
+	bool has;
+	status = napi_typeof(env, object, &vt);
+	if (status != napi_ok || vt != napi_object) return status;
+	status = napi_has_named_property(env, object, name, &has);
+	if (status != napi_ok || !has) return status;
+	status = napi_get_named_property(env, object, name, &value);
+	if (status != napi_ok) return status;
+	return napi_get_value_bool(env, value, result);
+}
+
+napi_status napi_get_named_string(napi_env env, napi_value object,
+		const char *name, char *result, size_t size){
+	napi_status status;
+	napi_valuetype vt;
+	napi_value value;
+	bool has;
+	status = napi_typeof(env, object, &vt);
+	if (status != napi_ok || vt != napi_object) return status;
+	status = napi_has_named_property(env, object, name, &has);
+	if (status != napi_ok || !has) return status;
+	status = napi_get_named_property(env, object, name, &value);
+	if (status != napi_ok) return status;
+	return napi_get_value_string_utf8(env, value, result, size, NULL);
+}
+
+napi_status napi_get_named_double(napi_env env, napi_value object,
+		const char *name, double *result){
+	napi_status status;
+	napi_valuetype vt;
+	napi_value value;
+	bool has;
+	status = napi_typeof(env, object, &vt);
+	if (status != napi_ok || vt != napi_object) return status;
+	status = napi_has_named_property(env, object, name, &has);
+	if (status != napi_ok || !has) return status;
+	status = napi_get_named_property(env, object, name, &value);
+	if (status != napi_ok) return status;
+	return napi_get_value_double(env, value, result);
+}
+
 #define napi_assert(env, status) { \
 	if (status != napi_ok) { \
 		napi_throw_last_error(env); \
@@ -69,6 +143,14 @@ napi_status napi_create_error_utf8(napi_env env,
 	} \
 }
 
+/* For the receive path, the handle scope is owned by the caller */
+#define napi_assert_cb(env, status) { \
+	if (status != napi_ok) { \
+		napi_fatal_last_error(env, __FILE__, __LINE__); \
+		return; \
+	} \
+}
+
 //// CANopen structures ////////////////////////////////////////////////////////
 
 /* NMT State */
@@ -109,7 +191,9 @@ typedef enum {
 	CO_CCS_DOWNLOAD_SEGMENT=0,
 	CO_CCS_UPLOAD_INIT=2,
 	CO_CCS_UPLOAD_SEGMENT=3,
-	CO_CCS_ABORT  =4
+	CO_CCS_ABORT  =4,
+	CO_CCS_BLOCK_UPLOAD=5,
+	CO_CCS_BLOCK_DOWNLOAD=6
 } co_t_sdo_ccs;
 
 /* Server command specifier (Node to Master)  */
@@ -118,9 +202,29 @@ typedef enum {
 	CO_SCS_DOWNLOAD_SEGMENT_RESPONSE=1,
 	CO_SCS_UPLOAD_INIT_RESPONSE=2,
 	CO_SCS_UPLOAD_SEGMENT_RESPONSE=0,
-	CO_SCS_ABORT=4
+	CO_SCS_ABORT=4,
+	CO_SCS_BLOCK_DOWNLOAD=5,
+	CO_SCS_BLOCK_UPLOAD=6
 } co_t_sdo_scs;
 
+/* Block transfer sub command (client and server) */
+typedef enum {
+	CO_SDO_BLOCK_INIT=0,
+	CO_SDO_BLOCK_END=1,
+	CO_SDO_BLOCK_ACK=2,
+	CO_SDO_BLOCK_START=3
+} co_t_sdo_block_cs;
+
+/* SDO abort codes */
+#define CO_SDO_ABORT_TOGGLE   0x05030000
+#define CO_SDO_ABORT_TIMEOUT  0x05040000
+#define CO_SDO_ABORT_CS       0x05040001
+#define CO_SDO_ABORT_BLKSIZE  0x05040002
+#define CO_SDO_ABORT_SEQNO    0x05040003
+#define CO_SDO_ABORT_CRC      0x05040004
+#define CO_SDO_ABORT_MEMORY   0x05040005
+#define CO_SDO_ABORT_LENGTH   0x06070010
+
 /* SDO Object */
 typedef struct {
 	union{
@@ -138,6 +242,45 @@ typedef struct {
 	uint8_t  data[4];
 } __attribute__((packed)) co_t_sdo;
 
+/* SDO Segment Object */
+typedef struct {
+	union{
+		struct {
+			uint8_t c  : 1; /* no more segments */
+			uint8_t n  : 3; /* unused bytes length in data */
+			uint8_t t  : 1; /* toggle bit */
+			uint8_t cs : 3; /* command specifier */
+		} bits;
+		uint8_t byte;
+	} header;
+	uint8_t  data[7];
+} __attribute__((packed)) co_t_sdo_segment;
+
+/* SDO Block Object (initiate, ack and end) */
+typedef struct {
+	union{
+		struct {
+			uint8_t ss : 2; /* sub command (cs for the init: only bit 0) */
+			uint8_t n  : 3; /* unused bytes in the last segment (end) */
+			uint8_t cs : 3; /* command specifier */
+		} bits;
+		uint8_t byte;
+	} header;
+	uint8_t  data[7];
+} __attribute__((packed)) co_t_sdo_block;
+
+/* SDO Block Segment Object */
+typedef struct {
+	union{
+		struct {
+			uint8_t seqno : 7; /* sequence number (1..127) */
+			uint8_t c     : 1; /* no more segments */
+		} bits;
+		uint8_t byte;
+	} header;
+	uint8_t  data[7];
+} __attribute__((packed)) co_t_sdo_block_segment;
+
 /* PDO IDs*/
 typedef enum {
 	CO_PDO_ID0=0,
@@ -146,33 +289,142 @@ typedef enum {
 	CO_PDO_ID3=3
 } co_t_pdo_id;
 
-/* PDO Object */
+/* PDO Object, up to 64 bytes on a CAN FD bus */
 typedef struct {
-	uint8_t  data[8];
+	uint8_t  data[CANFD_MAX_DLEN];
 } __attribute__((packed)) co_t_pdo;
 
 //// SDO Queue /////////////////////////////////////////////////////////////////
 
-#define QSIZE 128
+/* SDO transfer type */
+typedef enum {
+	CO_SDO_EXPEDITED,
+	CO_SDO_SEGMENTED,
+	CO_SDO_BLOCK
+} co_t_sdo_transfer;
+
+/* How the request is completed */
+typedef enum {
+	CO_SDO_CALLBACK,
+	CO_SDO_PROMISE,
+	CO_SDO_SCRIPT
+} co_t_sdo_completion;
 
+/* Type of the value (sdo_read/sdo_write) */
+typedef enum {
+	CO_SDO_TYPE_ARRAY=0, /* Raw bytes */
+	CO_SDO_TYPE_UINT8,
+	CO_SDO_TYPE_INT8,
+	CO_SDO_TYPE_UINT16,
+	CO_SDO_TYPE_INT16,
+	CO_SDO_TYPE_UINT32,
+	CO_SDO_TYPE_INT32,
+	CO_SDO_TYPE_UINT64,
+	CO_SDO_TYPE_INT64,
+	CO_SDO_TYPE_FLOAT32,
+	CO_SDO_TYPE_FLOAT64,
+	CO_SDO_TYPE_COUNT
+} co_t_sdo_type;
+
+const uint8_t co_sdo_type_size[CO_SDO_TYPE_COUNT] = { 0, 1, 1, 2, 2, 4, 4, 8, 8, 4, 8 };
+
+/* Packed script entry (sdo_execute) */
 typedef struct {
-	napi_ref cb_ref;
-	napi_async_context cb_ctx;
-	struct can_frame cf;
+	uint16_t index;
+	uint8_t  subindex;
+	uint8_t  type;     /* CO_SDO_TYPE_UINT8 to CO_SDO_TYPE_FLOAT64 */
+	uint8_t  op;       /* CO_SDO_OP_WRITE or CO_SDO_OP_READ */
+	uint8_t  reserved[3];
+	uint8_t  value[8]; /* Write: value, little endian */
+} co_t_sdo_script_entry;
+
+/* Packed result of a script entry */
+typedef struct {
+	uint32_t status;   /* 0, SDO abort code or CO_SDO_NOT_EXECUTED */
+	uint32_t length;   /* Read: bytes received */
+	uint8_t  value[8]; /* Read: value, little endian */
+} co_t_sdo_script_result;
+
+#define CO_SDO_OP_WRITE 0
+#define CO_SDO_OP_READ 1
+#define CO_SDO_CONTINUE 1 /* Flag: go on after an error */
+#define CO_SDO_NOT_EXECUTED 0xFFFFFFFF
+
+/* Script run one entry after the other, one promise for all */
+typedef struct {
+	napi_deferred deferred;
+	napi_ref results_ref;
+	co_t_sdo_script_result *results;
+	co_t_sdo_script_entry *entries;
+	uint32_t count, next, flags;
+} co_t_sdo_script;
+
+void co_sdo_script_free(napi_env env, co_t_sdo_script *sc) {
+	if(sc->results_ref != NULL) napi_delete_reference(env, sc->results_ref);
+	free(sc->entries);
+	free(sc);
+}
+
+typedef struct {
+	co_t_sdo_completion completion;
+	napi_ref cb_ref;           /* Callback */
+	napi_async_context cb_ctx; /* Callback */
+	napi_deferred deferred;    /* Promise */
+	struct canfd_frame cf;
 	co_t_sdo_scs expected_scs;
+
+	/* Object of the request */
+	uint16_t index;
+	uint8_t subindex;
+
+	/* Segmented and block transfers */
+	co_t_sdo_transfer transfer;
+	uint8_t upload;    /* 1: node to master */
+	uint8_t toggle;    /* Segmented: next toggle bit */
+	uint8_t blksize;   /* Block: segments per sub-block */
+	uint8_t seqno;     /* Block: last sequence number */
+	uint8_t last;      /* Block: the last segment is sent/received */
+	uint8_t crc;       /* Block: CRC supported by the node */
+	napi_ref data_ref; /* Download: keep the ArrayBuffer alive */
+	uint8_t *data;     /* Download: source, upload: destination */
+	size_t size;       /* Download: data length, upload: buffer capacity */
+	size_t pos;        /* Bytes transferred */
+	size_t blkpos;     /* Block download: position of the sub-block */
+
+	/* Script */
+	co_t_sdo_script *script;
+	uint32_t step;
+
+	/* Typed values */
+	co_t_sdo_type type;
+	uint8_t borrowed;  /* Upload: data is not ours (caller buffer or value) */
+	uint8_t value[8];  /* Typed value, little endian */
 } co_t_sdo_queue_item;
 
+/* Circular queue (free running indexes), grows when full. The items may
+   move when the queue grows: do not keep a pointer across a push. */
 typedef struct {
-	co_t_sdo_queue_item items[QSIZE];
+	co_t_sdo_queue_item *items;
+	unsigned int mask; /* Capacity - 1, the capacity is a power of 2 */
 	unsigned int head, tail;
 } co_t_sdo_queue;
 
-void co_sdo_queue_reset(co_t_sdo_queue *q) {
+int co_sdo_queue_init(co_t_sdo_queue *q, unsigned int capacity) {
+	unsigned int c = 1;
+	while(c < capacity) c <<= 1;
+	q->items = (co_t_sdo_queue_item *)calloc(c, sizeof(co_t_sdo_queue_item));
+	if(q->items == NULL) return -1;
+	q->mask = c - 1;
 	q->head = q->tail = 0;
+	return 0;
+}
+
+void co_sdo_queue_free(co_t_sdo_queue *q) {
+	free(q->items);
+	q->items = NULL;
 }
 
 unsigned int co_sdo_queue_size(co_t_sdo_queue *q) {
-	//if(q->tail > q->head) printf("Queue inconsistency error!\n");
 	return q->head - q->tail;
 }
 
@@ -181,7 +433,7 @@ co_t_sdo_queue_item *co_sdo_queue_pop(co_t_sdo_queue *q) {
 	if(co_sdo_queue_size(q) == 0) return NULL;
 
 	/* POP */
-	return &q->items[q->tail++];
+	return &q->items[q->tail++ & q->mask];
 }
 
 co_t_sdo_queue_item *co_sdo_queue_get(co_t_sdo_queue *q) {
@@ -189,584 +441,6353 @@ co_t_sdo_queue_item *co_sdo_queue_get(co_t_sdo_queue *q) {
 	if(co_sdo_queue_size(q) == 0) return NULL;
 
 	/* GET (do not remove from stack) */
-	return &q->items[q->tail];
+	return &q->items[q->tail & q->mask];
 }
 
-co_t_sdo_queue_item *co_sdo_queue_push(co_t_sdo_queue *q) {
-	/* If the queue is empty, reset it directly */
-	if(co_sdo_queue_size(q) == 0) co_sdo_queue_reset(q);
+/* Double the capacity, the items are unwrapped at the start */
+int co_sdo_queue_grow(co_t_sdo_queue *q) {
+	unsigned int i, size = co_sdo_queue_size(q), capacity = (q->mask + 1) * 2;
+	co_t_sdo_queue_item *items;
+
+	items = (co_t_sdo_queue_item *)calloc(capacity, sizeof(co_t_sdo_queue_item));
+	if(items == NULL) return -1;
+	for(i = 0; i < size; ++i){
+		items[i] = q->items[(q->tail + i) & q->mask];
+		/* Typed values point into their own item */
+		if(items[i].data == q->items[(q->tail + i) & q->mask].value)
+			items[i].data = items[i].value;
+	}
+	free(q->items);
+	q->items = items;
+	q->mask = capacity - 1;
+	q->tail = 0;
+	q->head = size;
+	return 0;
+}
 
-	/* Return NULL if queue is full */
-	if(q->head >= QSIZE) return NULL;
+co_t_sdo_queue_item *co_sdo_queue_push(co_t_sdo_queue *q) {
+	/* Full: grow rather than refuse the request */
+	if(co_sdo_queue_size(q) > q->mask && co_sdo_queue_grow(q) < 0)
+		return NULL;
 
 	/* PUSH */
-	return &q->items[q->head++];
+	return &q->items[q->head++ & q->mask];
 }
 
-//// Node structure ////////////////////////////////////////////////////////////
-typedef struct {
-	/* Node.js Stuff */
-	napi_env env;
-	canid_t node_id;
-
-	/* CAN Hardware Stuff */
-	int canfd;
-	uv_poll_t can_uvp;
-
-	/* Heartbeat Stuff */
-	napi_ref hb_cb_ref;
-	napi_async_context hb_cb_ctx;
-	uv_timer_t hb_uvt;
-	unsigned int hb_wait_time;
-	uint8_t hb_last_toggle_bit;
-
-	/* SDO Stuff */
-	co_t_sdo_queue sdo_queue;
-	uv_timer_t sdo_uvt;
-	unsigned int sdo_wait_time;
-
-	/* PDO Stuff */
-	napi_ref pdo_cb_ref;
-	napi_async_context pdo_cb_ctx;
-} co_t_node;
+/* Finalizer of the uploaded ArrayBuffers */
+void co_free_arraybuffer(napi_env env, void *data, void *hint) {
+	free(data);
+}
 
-//// uvlib callback ////////////////////////////////////////////////////////////
-void co_stop_all_cb(co_t_node *con){
-	co_t_sdo_queue_item *i;
-	/* Stop heartbeat */
-	uv_timer_stop(&con->hb_uvt);
-	if(con->hb_cb_ref != NULL){
-		napi_async_destroy(con->env, con->hb_cb_ctx);
-		napi_delete_reference(con->env, con->hb_cb_ref);
-		con->hb_cb_ref = NULL;
+void co_sdo_item_release(napi_env env, co_t_sdo_queue_item *i) {
+	if(i->completion == CO_SDO_CALLBACK){
+		napi_async_destroy(env, i->cb_ctx);
+		napi_delete_reference(env, i->cb_ref);
 	}
-	/* Stop SDO */
-	uv_timer_stop(&con->sdo_uvt);
-	while((i = co_sdo_queue_pop(&con->sdo_queue)) != NULL){
-		napi_async_destroy(con->env, i->cb_ctx);
-		napi_delete_reference(con->env, i->cb_ref);
+	if(i->data_ref != NULL){
+		napi_delete_reference(env, i->data_ref);
+		i->data_ref = NULL;
 	}
-	/* Stop PDO */
-	if(con->pdo_cb_ref != NULL){
-		napi_async_destroy(con->env, con->pdo_cb_ctx);
-		napi_delete_reference(con->env, con->pdo_cb_ref);
-		con->pdo_cb_ref = NULL;
+	/* Script abandoned (node stopped) */
+	if(i->script != NULL){
+		co_sdo_script_free(env, i->script);
+		i->script = NULL;
 	}
+	/* Upload buffer not handed over to javascript */
+	if(i->upload && !i->borrowed) free(i->data);
+	i->data = NULL;
 }
 
-void co_hb_timeout_cb(uv_timer_t* handle) {
-	co_t_node *con = (co_t_node *)handle->data;
-	napi_handle_scope nhs;
-	napi_status status;
-	napi_value argv[1], global, cb;
-
-	napi_open_handle_scope(con->env, &nhs);
-
-	/* Parameter error details */
-	status = napi_create_error_utf8(con->env, "Timeout HB Response", &argv[0]);
-	napi_assert_async(con->env, status, nhs);
-
-	/* Call the callback */
-	status = napi_get_global(con->env, &global);
-	napi_assert_async(con->env, status, nhs);
-	status = napi_get_reference_value(con->env, con->hb_cb_ref, &cb);
-	napi_assert_async(con->env, status, nhs);
-	status = napi_make_callback(con->env, con->hb_cb_ctx, global, cb, 1, argv, NULL);
-	napi_assert_async(con->env, status, nhs);
-
-	napi_close_handle_scope(con->env, nhs);
+/* Javascript value of a typed SDO */
+napi_status co_sdo_decode(napi_env env, co_t_sdo_type type, const uint8_t *data,
+		size_t len, napi_value *result) {
+	union {
+		uint8_t b[8];
+		uint8_t u8; int8_t i8;
+		uint16_t u16; int16_t i16;
+		uint32_t u32; int32_t i32;
+		uint64_t u64; int64_t i64;
+		float f32; double f64;
+	} v;
+
+	/* The node may send less (or unspecified size), complete with 0 */
+	memset(&v, 0, sizeof(v));
+	memcpy(v.b, data, len < co_sdo_type_size[type] ? len : co_sdo_type_size[type]);
+	switch(type){
+	case CO_SDO_TYPE_UINT8:   return napi_create_uint32(env, v.u8, result);
+	case CO_SDO_TYPE_INT8:    return napi_create_int32(env, v.i8, result);
+	case CO_SDO_TYPE_UINT16:  return napi_create_uint32(env, v.u16, result);
+	case CO_SDO_TYPE_INT16:   return napi_create_int32(env, v.i16, result);
+	case CO_SDO_TYPE_UINT32:  return napi_create_uint32(env, v.u32, result);
+	case CO_SDO_TYPE_INT32:   return napi_create_int32(env, v.i32, result);
+	case CO_SDO_TYPE_UINT64:  return napi_create_bigint_uint64(env, v.u64, result);
+	case CO_SDO_TYPE_INT64:   return napi_create_bigint_int64(env, v.i64, result);
+	case CO_SDO_TYPE_FLOAT32: return napi_create_double(env, v.f32, result);
+	case CO_SDO_TYPE_FLOAT64: return napi_create_double(env, v.f64, result);
+	default:                  return napi_invalid_arg;
+	}
 }
 
-void co_hb_recv_cb(co_t_node *con, co_t_hb *d) {
-	napi_handle_scope nhs;
+/* Bytes of a typed SDO, from a number (or a BigInt for 64 bits) */
+napi_status co_sdo_encode(napi_env env, co_t_sdo_type type, napi_value value,
+		uint8_t *data) {
 	napi_status status;
-	napi_value argv[1], global, cb;
+	napi_valuetype vt;
+	int64_t i64;
+	uint64_t u64;
+	double f64;
+	float f32;
+	bool lossless;
+
+	switch(type){
+	case CO_SDO_TYPE_UINT64:
+	case CO_SDO_TYPE_INT64:
+		status = napi_typeof(env, value, &vt);
+		if(status != napi_ok) return status;
+		if(vt == napi_bigint){
+			if(type == CO_SDO_TYPE_UINT64)
+				status = napi_get_value_bigint_uint64(env, value, &u64, &lossless);
+			else
+				status = napi_get_value_bigint_int64(env, value, (int64_t *)&u64, &lossless);
+		}else{
+			status = napi_get_value_int64(env, value, (int64_t *)&u64);
+		}
+		memcpy(data, &u64, sizeof(u64));
+		return status;
+	case CO_SDO_TYPE_FLOAT32:
+		status = napi_get_value_double(env, value, &f64);
+		f32 = f64;
+		memcpy(data, &f32, sizeof(f32));
+		return status;
+	case CO_SDO_TYPE_FLOAT64:
+		status = napi_get_value_double(env, value, &f64);
+		memcpy(data, &f64, sizeof(f64));
+		return status;
+	default:
+		/* Little endian, keep the low bytes */
+		status = napi_get_value_int64(env, value, &i64);
+		memcpy(data, &i64, sizeof(i64));
+		return status;
+	}
+}
 
-	/* No callback, do nothing. */
-	if(con->hb_cb_ref == NULL) return;	
-	uv_timer_stop(&con->hb_uvt);
-	napi_open_handle_scope(con->env, &nhs);
+/* Expedited (up to 4 bytes) or segmented download, the data is kept by the
+   caller for the segmented transfer */
+void co_sdo_init_download(co_t_sdo_queue_item *i, const void *data, size_t len) {
+	co_t_sdo *s = (co_t_sdo *) i->cf.data;
+	uint32_t size;
+	uint8_t unused_bytes;
 
-	if(con->hb_last_toggle_bit == d->bits.toggle_bit){
-		/* Parameter error details */
-		status = napi_create_error_utf8(con->env, "Heartbeat bit has not toggle", &argv[0]);
-		napi_assert_async(con->env, status, nhs);
+	s->header.bits.cs = CO_CCS_DOWNLOAD_INIT;
+	s->header.bits.s = 1;
+	s->index = i->index;
+	s->subindex = i->subindex;
+	if(len <= 4){
+		/* Expedited */
+		unused_bytes = 4 - len;
+		s->header.bits.n = unused_bytes;
+		s->header.bits.e = 1;
+		memcpy(s->data, data, len);
+		memset(&s->data[len], 0, unused_bytes);
 	}else{
-		/* 1. Parameter is the state */
-		status = napi_create_uint32(con->env, d->bits.state, &argv[0]);
-		napi_assert_async(con->env, status, nhs);
+		/* Segmented, the init gives the size */
+		i->transfer = CO_SDO_SEGMENTED;
+		size = len;
+		memcpy(s->data, &size, sizeof(size));
 	}
-	con->hb_last_toggle_bit = d->bits.toggle_bit;
 
-	/* Call the callback */
-	status = napi_get_global(con->env, &global);
-	napi_assert_async(con->env, status, nhs);
-	status = napi_get_reference_value(con->env, con->hb_cb_ref, &cb);
-	napi_assert_async(con->env, status, nhs);
-	status = napi_make_callback(con->env, con->hb_cb_ctx, global, cb, 1, argv, NULL);
-	napi_assert_async(con->env, status, nhs);
+	/* Expected command specifier */
+	i->expected_scs = CO_SCS_DOWNLOAD_INIT_RESPONSE;
+}
 
-	napi_close_handle_scope(con->env, nhs);
+/* Expedited or segmented upload, the size is given by the node */
+void co_sdo_init_upload(co_t_sdo_queue_item *i) {
+	co_t_sdo *s = (co_t_sdo *) i->cf.data;
+
+	i->upload = 1;
+	s->header.bits.cs = CO_CCS_UPLOAD_INIT;
+	s->index = i->index;
+	s->subindex = i->subindex;
+
+	/* Expected command specifier */
+	i->expected_scs = CO_SCS_UPLOAD_INIT_RESPONSE;
 }
 
-void co_sdo_emit(co_t_node *con);
-void co_sdo_timeout_cb(uv_timer_t* handle) {
-	co_t_node *con = (co_t_node *)handle->data;
-	co_t_sdo_queue_item *i;
-	napi_handle_scope nhs;
-	napi_status status;
-	napi_value argv[1], global, cb;
+//// PDO Ring //////////////////////////////////////////////////////////////////
 
-	i = co_sdo_queue_get(&con->sdo_queue);
-	if(i == NULL) return;
-	napi_open_handle_scope(con->env, &nhs);
-	co_sdo_emit(con);
+/* Ring header, shared with javascript (free running indexes) */
+typedef struct {
+	uint32_t head;    /* Written by the node */
+	uint32_t tail;    /* Written by javascript */
+	uint32_t slots;   /* Power of 2, the indexes wrap at 2^32 */
+	uint32_t dropped; /* Frames lost because the ring was full */
+} co_t_pdo_ring;
 
-	/* Parameter error details */
-	status = napi_create_error_utf8(con->env, "Timeout SDO Response", &argv[0]);
-	napi_assert_async(con->env, status, nhs);
+/* Ring slot, one received PDO */
+typedef struct {
+	uint64_t timestamp; /* Nanoseconds */
+	uint32_t cob_id;
+	uint8_t  dlc;
+	uint8_t  pdo_id;
+	uint16_t sync_cycle; /* Low 16 bits of the SYNC cycle, 0 without SYNC */
+	uint8_t  data[CANFD_MAX_DLEN];
+} co_t_pdo_ring_slot;
 
-	/* Call the callback */
-	status = napi_get_global(con->env, &global);
-	napi_assert_async(con->env, status, nhs);
-	status = napi_get_reference_value(con->env, i->cb_ref, &cb);
-	napi_assert_async(con->env, status, nhs);
-	status = napi_make_callback(con->env, i->cb_ctx, global, cb, 1, argv, NULL);
-	napi_assert_async(con->env, status, nhs);
+//// PDO Batch /////////////////////////////////////////////////////////////////
 
-	/* Delete the callback, we will never use the callback again. */
-	status = napi_async_destroy(con->env, i->cb_ctx);
-	napi_assert_async(con->env, status, nhs);
-	status = napi_delete_reference(con->env, i->cb_ref);
-	napi_assert_async(con->env, status, nhs);
+/* Index entry of a batch, the data follows the index */
+typedef struct {
+	uint8_t  pdo_id;
+	uint8_t  length;
+	uint16_t sync_cycle; /* Low 16 bits of the SYNC cycle, 0 without SYNC */
+	uint32_t offset;  /* From the start of the buffer */
+	uint64_t timestamp; /* Nanoseconds */
+} co_t_pdo_batch_entry;
+
+/* Received PDO waiting for the end of the batch */
+typedef struct {
+	uint8_t  pdo_id;
+	uint8_t  length;
+	uint8_t  data[CANFD_MAX_DLEN];
+	uint32_t sync_cycle;
+	uint64_t ts;
+} co_t_pdo_batch_item;
 
-	napi_close_handle_scope(con->env, nhs);
+//// Process Image /////////////////////////////////////////////////////////////
 
-	/* Maybe in the javascript callback, there is an indirect call to
-	   co_sdo_queue_push (through sdo_upload or sdo_download functions).
-	   That's why we cannot pop the queue before the callback is finished.*/
-	co_sdo_queue_pop(&con->sdo_queue);
+/* Header of the process image, shared with javascript and its workers */
+typedef struct {
+	int32_t  notify;    /* Incremented once per loop, for Atomics.wait */
+	uint32_t seq;       /* Sequence lock, odd while the node writes */
+	uint32_t hb_state;  /* Last heartbeat state, CO_IMAGE_NONE before */
+	uint32_t hb_count;
+	uint64_t hb_timestamp; /* Nanoseconds */
+	uint32_t pdo_count; /* All the PDO received */
+	uint32_t reserved;
+} co_t_image;
+
+/* Latest PDO of a COB-ID, one per PDO id after the header */
+typedef struct {
+	uint64_t timestamp; /* Nanoseconds */
+	uint32_t count;
+	uint8_t  dlc;
+	uint8_t  reserved[3];
+	uint8_t  data[CANFD_MAX_DLEN];
+} co_t_image_pdo;
+
+#define CO_IMAGE_NONE 0xFFFFFFFF
+#define CO_IMAGE_SIZE (sizeof(co_t_image) + 4 * sizeof(co_t_image_pdo))
+
+/* Writers enter the sequence lock, readers retry while it is odd or changed */
+uint32_t co_image_begin(co_t_image *img) {
+	uint32_t seq = __atomic_load_n(&img->seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&img->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return seq;
 }
 
-void co_sdo_emit(co_t_node *con) {
-	struct can_frame *frame;
-	/* Return directly, if the queue is empty */
-	if(co_sdo_queue_size(&con->sdo_queue) == 0)
-		return;
-	/* Send the SDO */
-	frame = &co_sdo_queue_get(&con->sdo_queue)->cf;
-	if(write(con->canfd, frame, sizeof(struct can_frame)) < 0)
-		napi_throw_error(con->env, NULL, "Cannot write socket");
-	uv_timer_start(&con->sdo_uvt, co_sdo_timeout_cb, con->sdo_wait_time, 0);
+void co_image_end(co_t_image *img, uint32_t seq) {
+	__atomic_store_n(&img->seq, seq + 2, __ATOMIC_RELEASE);
 }
 
-void co_sdo_recv_cb(co_t_node *con, co_t_sdo *s) {
-	co_t_sdo_queue_item *i;
-	napi_handle_scope nhs;
-	napi_status status;
-	napi_value argv[1], global, cb;
-	void *jsdata;
-	size_t jslen;
+//// PDO Map ///////////////////////////////////////////////////////////////////
 
-	/* We receive a SDO: stop timer and send the next SDO */
-	i = co_sdo_queue_get(&con->sdo_queue);
-	if(i == NULL) return;
-	uv_timer_stop(&con->sdo_uvt);	
-	napi_open_handle_scope(con->env, &nhs);
+/* Direction of a mapping */
+#define CO_PDO_MAP_TX 0 /* TPDO of the node, decoded when received */
+#define CO_PDO_MAP_RX 1 /* RPDO of the node, encoded by pdo_send */
 
-	/* Check the type of SDO */
-	if(s->header.bits.cs != i->expected_scs) {
-		/* Error details */
-		status = napi_create_error_utf8(con->env, "Unexpected SDO response", &argv[0]);
-		napi_assert_async(con->env, status, nhs);
-	/* We only support SDO upload up to 4 bytes */
-	}else if(s->header.bits.cs == CO_SCS_UPLOAD_INIT_RESPONSE &&
-			(s->header.bits.e != 1 || s->header.bits.s != 1)) {
-		/* Error details */
-		status = napi_create_error_utf8(con->env, "Unimplemented SDO response (length >4)", &argv[0]);
-		napi_assert_async(con->env, status, nhs);
-	}else{
-		/* Set the data */
-		jslen = 4-s->header.bits.n;
-		status = napi_create_arraybuffer(con->env, jslen, &jsdata, &argv[0]);
-		napi_assert_async(con->env, status, nhs);
-		memcpy(jsdata, s->data, jslen);
+/* Flags of a mapped object */
+#define CO_PDO_MAP_SIGNED 1
+#define CO_PDO_MAP_FLOAT  2 /* REAL32 or REAL64 */
+#define CO_PDO_MAP_SKIP   4 /* Dummy entry, no value */
+
+#define CO_PDO_MAP_MAX 64 /* One bit per entry, at most */
+
+/* One mapped object, from 0x1600-0x17FF or 0x1A00-0x1BFF */
+typedef struct {
+	uint16_t offset; /* Bit offset in the PDO */
+	uint8_t  length; /* Bit length, 1 to 64 */
+	uint8_t  flags;
+} co_t_pdo_map_entry;
+
+/* Compiled mapping, entry n is the element n of the table */
+typedef struct {
+	napi_ref table_ref;
+	void *table;
+	napi_typedarray_type table_type;
+	uint8_t count;
+	uint8_t size; /* Bytes of the PDO */
+	co_t_pdo_map_entry entries[CO_PDO_MAP_MAX];
+} co_t_pdo_map;
+
+/* Bits of the PDO into the table */
+void co_pdo_map_decode(co_t_pdo_map *m, const uint8_t *data, size_t len) {
+	co_t_pdo_map_entry *e;
+	uint8_t pdo[CANFD_MAX_DLEN + 8] = { 0 }; /* Room for the last 64 bit read */
+	uint64_t raw;
+	unsigned int n, shift;
+	double v;
+	float f;
+
+	memcpy(pdo, data, len);
+	for(n = 0; n < m->count; ++n){
+		e = &m->entries[n];
+		if(e->flags & CO_PDO_MAP_SKIP) continue;
+		if(e->offset + e->length > len * 8) break; /* Shorter than mapped */
+		memcpy(&raw, &pdo[e->offset / 8], sizeof(raw)); /* Little endian */
+		shift = e->offset % 8;
+		raw >>= shift;
+		if(shift && e->length + shift > 64)
+			raw |= (uint64_t)pdo[e->offset / 8 + 8] << (64 - shift);
+		if(e->length < 64) raw &= ((uint64_t)1 << e->length) - 1;
+		if(e->flags & CO_PDO_MAP_FLOAT && e->length == 32){
+			uint32_t r32 = raw;
+			memcpy(&f, &r32, sizeof(f));
+			v = f;
+		}else if(e->flags & CO_PDO_MAP_FLOAT){
+			memcpy(&v, &raw, sizeof(v));
+		}else if(e->flags & CO_PDO_MAP_SIGNED && e->length < 64 &&
+				raw >> (e->length - 1)){
+			v = (int64_t)(raw | ~(((uint64_t)1 << e->length) - 1));
+		}else if(e->flags & CO_PDO_MAP_SIGNED){
+			v = (int64_t)raw;
+		}else{
+			v = raw;
+		}
+		switch(m->table_type){
+		case napi_float64_array: ((double *)m->table)[n] = v; break;
+		case napi_float32_array: ((float *)m->table)[n] = v; break;
+		case napi_int32_array:   ((int32_t *)m->table)[n] = (int64_t)v; break;
+		default:                 ((uint32_t *)m->table)[n] = (int64_t)v; break;
+		}
 	}
+}
 
-	/* Call the callback */
-	status = napi_get_global(con->env, &global);
-	napi_assert_async(con->env, status, nhs);
-	status = napi_get_reference_value(con->env, i->cb_ref, &cb);
-	napi_assert_async(con->env, status, nhs);
-	status = napi_make_callback(con->env, i->cb_ctx, global, cb, 1, argv, NULL);
-	napi_assert_async(con->env, status, nhs);
+/* Table into the bits of the PDO, returns the length */
+size_t co_pdo_map_encode(co_t_pdo_map *m, uint8_t *data) {
+	co_t_pdo_map_entry *e;
+	uint8_t pdo[CANFD_MAX_DLEN + 8] = { 0 };
+	uint64_t raw, word;
+	unsigned int n, shift;
+	double v;
+	float f;
+
+	for(n = 0; n < m->count; ++n){
+		e = &m->entries[n];
+		if(e->flags & CO_PDO_MAP_SKIP) continue;
+		switch(m->table_type){
+		case napi_float64_array: v = ((double *)m->table)[n]; break;
+		case napi_float32_array: v = ((float *)m->table)[n]; break;
+		case napi_int32_array:   v = ((int32_t *)m->table)[n]; break;
+		default:                 v = ((uint32_t *)m->table)[n]; break;
+		}
+		if(e->flags & CO_PDO_MAP_FLOAT && e->length == 32){
+			uint32_t r32;
+			f = v;
+			memcpy(&r32, &f, sizeof(r32));
+			raw = r32;
+		}else if(e->flags & CO_PDO_MAP_FLOAT){
+			memcpy(&raw, &v, sizeof(raw));
+		}else if(e->flags & CO_PDO_MAP_SIGNED || v < 0){
+			raw = (int64_t)v;
+		}else{
+			raw = (uint64_t)v;
+		}
+		if(e->length < 64) raw &= ((uint64_t)1 << e->length) - 1;
+		shift = e->offset % 8;
+		memcpy(&word, &pdo[e->offset / 8], sizeof(word));
+		word |= raw << shift;
+		memcpy(&pdo[e->offset / 8], &word, sizeof(word));
+		if(shift && e->length + shift > 64)
+			pdo[e->offset / 8 + 8] |= raw >> (64 - shift);
+	}
+	memcpy(data, pdo, m->size);
+	return m->size;
+}
 
-	/* Delete the callback, we will never use the callback again. */
-	status = napi_async_destroy(con->env, i->cb_ctx);
-	napi_assert_async(con->env, status, nhs);
-	status = napi_delete_reference(con->env, i->cb_ref);
-	napi_assert_async(con->env, status, nhs);
+//// Latency Histogram /////////////////////////////////////////////////////////
 
-	napi_close_handle_scope(con->env, nhs);
+/* Log-linear buckets (HDR style): exact below 32 ns, then 16 buckets per
+   power of 2 (about 6% precision), up to 2^41 ns */
+#define CO_HIST_MAX_MSB 40
+#define CO_HIST_BUCKETS (32 + (CO_HIST_MAX_MSB - 4) * 16)
 
-	/* Maybe in the javascript callback, there is an indirect call to
-	   co_sdo_queue_push (through sdo_upload or sdo_download functions).
-	   That's why we cannot pop the queue before the callback is finished.*/
-	co_sdo_queue_pop(&con->sdo_queue);
-	co_sdo_emit(con);
+typedef struct {
+	uint64_t count, sum, min, max; /* Nanoseconds */
+	uint32_t buckets[CO_HIST_BUCKETS];
+} co_t_hist;
+
+unsigned int co_hist_index(uint64_t v) {
+	unsigned int msb, shift;
+	if(v < 32) return v;
+	msb = 63 - __builtin_clzll(v);
+	if(msb > CO_HIST_MAX_MSB) return CO_HIST_BUCKETS - 1;
+	shift = msb - 4;
+	return 32 + (shift - 1) * 16 + ((v >> shift) - 16);
 }
 
-void co_pdo_recv_cb(co_t_node *con, co_t_pdo_id id, co_t_pdo *p, size_t len) {
-	napi_handle_scope nhs;
+/* Middle of the bucket */
+uint64_t co_hist_value(unsigned int index) {
+	unsigned int shift;
+	if(index < 32) return index;
+	shift = (index - 32) / 16 + 1;
+	return ((uint64_t)((index - 32) % 16 + 16) << shift) + ((uint64_t)1 << (shift - 1));
+}
+
+void co_hist_record(co_t_hist *h, int64_t v) {
+	if(v < 0) v = 0; /* Clock adjusted in between */
+	if(h->count == 0 || (uint64_t)v < h->min) h->min = v;
+	if((uint64_t)v > h->max) h->max = v;
+	h->count++;
+	h->sum += v;
+	h->buckets[co_hist_index(v)]++;
+}
+
+uint64_t co_hist_percentile(co_t_hist *h, double p) {
+	uint64_t rank = p * h->count, n = 0, v;
+	unsigned int i;
+	for(i = 0; i < CO_HIST_BUCKETS; ++i){
+		n += h->buckets[i];
+		if(n > rank) break;
+	}
+	v = co_hist_value(i);
+	if(v < h->min) v = h->min;
+	if(v > h->max) v = h->max;
+	return v;
+}
+
+/* Summary of the histogram, in nanoseconds */
+napi_status co_hist_summary(napi_env env, co_t_hist *h, napi_value *result) {
+	static const char *names[] = { "p50", "p90", "p99", "p999" };
+	static const double ranks[] = { 0.5, 0.9, 0.99, 0.999 };
 	napi_status status;
-	napi_value argv[2], global, cb;
-	void *jsdata;
+	napi_value value;
+	unsigned int i;
+
+	status = napi_create_object(env, result);
+	if(status != napi_ok) return status;
+	status = napi_create_int64(env, h->count, &value);
+	if(status == napi_ok)
+		status = napi_set_named_property(env, *result, "count", value);
+	if(status != napi_ok || h->count == 0) return status;
+	status = napi_create_int64(env, h->min, &value);
+	if(status == napi_ok)
+		status = napi_set_named_property(env, *result, "min", value);
+	if(status == napi_ok)
+		status = napi_create_int64(env, h->max, &value);
+	if(status == napi_ok)
+		status = napi_set_named_property(env, *result, "max", value);
+	if(status == napi_ok)
+		status = napi_create_double(env, (double)h->sum / h->count, &value);
+	if(status == napi_ok)
+		status = napi_set_named_property(env, *result, "mean", value);
+	for(i = 0; i < 4 && status == napi_ok; ++i){
+		status = napi_create_int64(env, co_hist_percentile(h, ranks[i]), &value);
+		if(status == napi_ok)
+			status = napi_set_named_property(env, *result, names[i], value);
+	}
+	return status;
+}
 
-	/* No callback, do nothing. */
-	if(con->pdo_cb_ref == NULL) return;
+/* Wall clock, same base as the kernel receive timestamps */
+uint64_t co_now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_REALTIME, &t);
+	return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
 
-	napi_open_handle_scope(con->env, &nhs);
+//// Metrics ///////////////////////////////////////////////////////////////////
 
-	/* 1. Parameter is the PDO id */
-	status = napi_create_uint32(con->env, id, &argv[0]);
-	napi_assert_async(con->env, status, nhs);
+/* Counters of a bus, shared by its nodes. The snapshot of metrics() is the
+   bus counters then the node counters, all uint64 (BigUint64Array). */
+typedef struct {
+	uint64_t rx[16];       /* Frames received per function code (COB-ID >> 7) */
+	uint64_t tx[16];       /* Frames sent per function code */
+	uint64_t rx_short;     /* Reads that were not a whole frame, ignored */
+	uint64_t tx_errors;    /* Failed write/sendmmsg */
+	uint64_t rx_overflow;  /* Dropped by the kernel, socket full (SO_RXQ_OVFL) */
+	uint64_t rx_ring_full; /* Dropped by the receive thread, ring full */
+	uint64_t error_frames; /* Error frames of the controller (CAN_ERR_FLAG) */
+	uint64_t bus_off;      /* Error frames with CAN_ERR_BUSOFF */
+} co_t_bus_metrics;
 
-	/* 2. Parameter is the data */
+typedef struct {
+	uint64_t sdo_requests;   /* Queued, with the entries of the scripts */
+	uint64_t sdo_timeouts;
+	uint64_t sdo_aborts;     /* Sent by the node */
+	uint64_t sdo_unexpected; /* Responses out of a transfer or of the wrong type */
+	uint64_t sdo_queue_high; /* High-water mark of the queue */
+	uint64_t hb_toggle;      /* Node guarding answers without toggle */
+	uint64_t hb_timeouts;    /* Node guarding without answer */
+	uint64_t emcy;
+} co_t_node_metrics;
+
+#define CO_METRICS_SIZE (sizeof(co_t_bus_metrics) + sizeof(co_t_node_metrics))
+
+/* Counters written by several threads (the senders) */
+static inline void co_metrics_add(uint64_t *counter, uint64_t n) {
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+//// RX Ring ///////////////////////////////////////////////////////////////////
+
+/* Received frame */
+typedef struct {
+	struct canfd_frame frame;
+	uint64_t ts; /* Nanoseconds */
+} co_t_rx_frame;
+
+/* Lock-free ring, single producer (RX thread), single consumer (loop) */
+typedef struct {
+	co_t_rx_frame *items;
+	uint32_t mask;    /* Size - 1, the size is a power of 2 */
+	uint32_t head;    /* Written by the producer */
+	uint32_t tail;    /* Written by the consumer */
+	uint32_t dropped; /* Frames lost because the ring was full */
+} co_t_rx_ring;
+
+int co_rx_ring_init(co_t_rx_ring *r, uint32_t size) {
+	uint32_t s = 1;
+	while(s < size) s <<= 1;
+	r->items = (co_t_rx_frame *)calloc(s, sizeof(co_t_rx_frame));
+	if(r->items == NULL) return -1;
+	r->mask = s - 1;
+	r->head = r->tail = r->dropped = 0;
+	return 0;
+}
+
+/* Producer side */
+int co_rx_ring_push(co_t_rx_ring *r, struct canfd_frame *frame, uint64_t ts) {
+	uint32_t head = r->head; /* Only written by us */
+	uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	co_t_rx_frame *item;
+	if(head - tail > r->mask){
+		__atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	item = &r->items[head & r->mask];
+	item->frame = *frame;
+	item->ts = ts;
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Consumer side, NULL if empty. Call co_rx_ring_next when done. */
+co_t_rx_frame *co_rx_ring_peek(co_t_rx_ring *r) {
+	uint32_t tail = r->tail; /* Only written by us */
+	if(__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail) return NULL;
+	return &r->items[tail & r->mask];
+}
+
+void co_rx_ring_next(co_t_rx_ring *r) {
+	__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+
+//// Trace Recorder ////////////////////////////////////////////////////////////
+
+#define CO_TRACE_MAGIC   "DCOTRACE"
+#define CO_TRACE_VERSION 1
+#define CO_TRACE_SIZE    (16 * 1024 * 1024) /* Default file size */
+
+/* Flags of a record */
+#define CO_TRACE_TX  1 /* Sent by us, received otherwise */
+#define CO_TRACE_FD  2 /* CAN FD frame */
+#define CO_TRACE_BRS 4 /* Bit rate switch */
+
+/* Start of the file, the records follow */
+typedef struct {
+	char     magic[8];
+	uint32_t version;
+	uint32_t record_size; /* 24 bytes, 80 on a CAN FD bus */
+	uint64_t capacity;    /* Records in the file */
+	uint64_t head;        /* Records written, the oldest is head - capacity */
+	char     device[IFNAMSIZ];
+	uint8_t  reserved[16];
+} co_t_trace_header;
+
+/* One frame, followed by 8 or 64 bytes of data */
+typedef struct {
+	uint64_t timestamp; /* Nanoseconds, CLOCK_REALTIME */
+	uint32_t can_id;
+	uint8_t  len;
+	uint8_t  flags;
+	uint16_t reserved;
+} co_t_trace_record;
+
+/* Recorder of a bus, written by the loop and by the SYNC, cyclic and RX threads */
+typedef struct {
+	co_t_trace_header *header; /* Mapped file, NULL when not recording */
+	size_t size;
+	uint32_t writers;          /* Threads inside co_trace_write */
+} co_t_trace;
+
+static inline co_t_trace_record *co_trace_record(co_t_trace_header *h, uint64_t n) {
+	return (co_t_trace_record *)((uint8_t *)(h + 1) + (n % h->capacity) * h->record_size);
+}
+
+/* Append a frame, overwrite the oldest one when the file is full */
+void co_trace_write(co_t_trace *t, const struct canfd_frame *frame, uint64_t ts,
+		uint8_t flags) {
+	co_t_trace_header *h;
+	co_t_trace_record *r;
+	size_t len;
+
+	/* Not recording, one load */
+	if(__atomic_load_n(&t->header, __ATOMIC_RELAXED) == NULL) return;
+
+	/* co_trace_end waits for the writers before unmapping */
+	__atomic_add_fetch(&t->writers, 1, __ATOMIC_SEQ_CST);
+	h = __atomic_load_n(&t->header, __ATOMIC_SEQ_CST);
+	if(h != NULL){
+		r = co_trace_record(h, __atomic_fetch_add(&h->head, 1, __ATOMIC_RELAXED));
+		len = frame->len;
+		if(len > h->record_size - sizeof(co_t_trace_record))
+			len = h->record_size - sizeof(co_t_trace_record);
+		r->timestamp = ts;
+		r->can_id = frame->can_id;
+		r->len = len;
+		r->flags = flags;
+		r->reserved = 0;
+		memcpy(r + 1, frame->data, len);
+	}
+	__atomic_sub_fetch(&t->writers, 1, __ATOMIC_RELEASE);
+}
+
+/* Map a new file of about size bytes, 0 or -1 (errno) */
+int co_trace_begin(co_t_trace *t, const char *path, size_t size, bool fd,
+		const char *device) {
+	co_t_trace_header *h;
+	size_t record_size = sizeof(co_t_trace_record) + (fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN);
+	uint64_t capacity = (size - sizeof(co_t_trace_header)) / record_size;
+	int file;
+
+	size = sizeof(co_t_trace_header) + capacity * record_size;
+	file = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(file < 0) return -1;
+	if(ftruncate(file, size) < 0){
+		close(file);
+		return -1;
+	}
+	/* Populated now, no page fault while recording */
+	h = (co_t_trace_header *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, file, 0);
+	close(file);
+	if(h == MAP_FAILED) return -1;
+
+	memcpy(h->magic, CO_TRACE_MAGIC, sizeof(h->magic));
+	h->version = CO_TRACE_VERSION;
+	h->record_size = record_size;
+	h->capacity = capacity;
+	h->head = 0;
+	strncpy(h->device, device, sizeof(h->device)-1);
+	t->size = size;
+	__atomic_store_n(&t->header, h, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+void co_trace_end(co_t_trace *t) {
+	co_t_trace_header *h = t->header;
+
+	if(h == NULL) return;
+	__atomic_store_n(&t->header, NULL, __ATOMIC_SEQ_CST);
+	while(__atomic_load_n(&t->writers, __ATOMIC_SEQ_CST) > 0)
+		sched_yield();
+	munmap(h, t->size); /* The page cache writes it back */
+}
+
+/* Map a recording read-only, NULL if it is not a valid trace file */
+co_t_trace_header *co_trace_open(const char *path, size_t *size) {
+	co_t_trace_header *h;
+	struct stat st;
+	int file;
+
+	file = open(path, O_RDONLY);
+	if(file < 0) return NULL;
+	if(fstat(file, &st) < 0 || (size_t)st.st_size < sizeof(co_t_trace_header)){
+		close(file);
+		return NULL;
+	}
+	h = (co_t_trace_header *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+	close(file);
+	if(h == MAP_FAILED) return NULL;
+	if(memcmp(h->magic, CO_TRACE_MAGIC, sizeof(h->magic)) != 0 ||
+			h->version != CO_TRACE_VERSION ||
+			h->record_size <= sizeof(co_t_trace_record) || h->capacity == 0 ||
+			h->record_size > sizeof(co_t_trace_record) + CANFD_MAX_DLEN ||
+			h->capacity > (st.st_size - sizeof(co_t_trace_header)) / h->record_size){
+		munmap(h, st.st_size);
+		return NULL;
+	}
+	*size = st.st_size;
+	return h;
+}
+
+//// Bus structure /////////////////////////////////////////////////////////////
+
+#define CO_MAX_NODES 128
+#define CO_TX_BATCH 64
+#define CO_MAX_SDO_ROUTES (CAN_RAW_FILTER_MAX - 8)
+
+typedef struct co_s_node co_t_node;
+typedef struct co_s_sim co_t_sim;
+typedef struct co_s_transport co_t_transport;
+
+/* Simulated slave of the loopback transport */
+typedef struct {
+	uint32_t nodes;     /* Node ids 1..nodes answer */
+	uint32_t heartbeat; /* Period of the heartbeats in ms, 0: none */
+	uint32_t tpdo;      /* Period of the TPDO1 of the operational nodes in us, 0: none */
+	uint32_t latency;   /* Delay of each SDO answer in us */
+	uint32_t loss;      /* Frames dropped, per mille */
+} co_t_sim_options;
+
+#define CO_MAX_SDO_CHANNELS 128
+
+/* SDO client channel, one request in flight */
+typedef struct {
+	co_t_node *con;
+	canid_t cob_tx; /* Master to node (0x600+id by default) */
+	canid_t cob_rx; /* Node to master (0x580+id by default) */
+	uv_timer_t uvt;
+	uint8_t busy;
+	unsigned int generation; /* Incremented for each request */
+	uint64_t tx_ts; /* Last request, 0 once answered */
+	uint64_t rx_ts; /* Last response (kernel timestamp) */
+	co_t_sdo_queue_item item;
+} co_t_sdo_channel;
+
+#define CO_MAX_CYCLIC 4     /* Cyclic PDO per node, one per RPDO */
+#define CO_SYNC_HISTORY 16 /* Cycles kept to match the received frames */
+
+/* SYNC producer, one per bus */
+typedef struct {
+	bool running;
+	pthread_t thread;
+	int timerfd, stopfd;
+	uint64_t period;      /* Nanoseconds */
+	uint64_t start;       /* CLOCK_MONOTONIC when the timer was armed */
+	uint8_t counter_max;  /* 0: no counter, else 2..240 */
+	uint8_t counter;
+	int cpu, priority;
+
+	/* Sent cycles, written by the thread */
+	uint32_t cycle;
+	uint64_t history[CO_SYNC_HISTORY]; /* Send time of the last cycles */
+
+	/* Statistics, protected by the lock */
+	pthread_mutex_t lock;
+	co_t_hist jitter;     /* Wake up time after the ideal tick */
+	uint64_t overruns;    /* Ticks missed */
+	uint64_t errors;      /* Frames not sent */
+} co_t_sync;
+
+/* Cyclic PDO, sent by the scheduler thread from a javascript buffer */
+typedef struct {
+	co_t_node *con;
+	uint8_t pdo_id;
+	canid_t cob_id;
+	uint8_t *data;   /* Read at each period, javascript keeps writing it */
+	uint8_t len;
+	napi_ref data_ref;
+	uint64_t period; /* Nanoseconds */
+	uint64_t next;   /* CLOCK_MONOTONIC deadline */
+	uint64_t sent, missed;
+} co_t_cyclic;
+
+/* Cyclic PDO scheduler, one per bus, started with the first cyclic PDO */
+typedef struct {
+	bool running;
+	pthread_t thread;
+	int timerfd, stopfd;
+	int cpu, priority;
+	pthread_mutex_t lock; /* Entries */
+	co_t_cyclic **entries;
+	unsigned int count;
+} co_t_cyclic_sched;
+
+#define CO_HB_TICK  10  /* Milliseconds per slot of the wheel */
+#define CO_HB_WHEEL 256 /* Slots, deadlines further away wrap around */
+#define CO_HB_UNKNOWN 0xFF
+
+/* Heartbeat consumer entry of a node id (0x1016 semantics) */
+typedef struct co_s_hb_entry {
+	struct co_s_hb_entry *next, **pprev; /* Slot of the wheel */
+	uint64_t deadline; /* Tick */
+	uint16_t timeout;  /* Milliseconds, 0: not watched */
+	uint8_t state;     /* Last state, CO_HB_UNKNOWN before the first */
+	bool expired;      /* Reported, until the next heartbeat */
+} co_t_hb_entry;
+
+/* Passive heartbeat consumer of the bus, one hashed timer wheel */
+typedef struct {
+	bool enabled, started;
+	uv_timer_t uvt;
+	uint64_t tick; /* Last tick processed */
+	co_t_hb_entry *slots[CO_HB_WHEEL];
+	co_t_hb_entry entries[CO_MAX_NODES];
+	napi_ref cb_ref;
+	napi_async_context cb_ctx;
+} co_t_hb_consumer;
+
+/* Rule types of the reflex engine */
+#define CO_REFLEX_PDO_BIT 1 /* TPDO bit changed: write a RPDO bit */
+#define CO_REFLEX_EMCY    2 /* EMCY received: NMT command and/or safe RPDO */
+
+/* Actions */
+#define CO_REFLEX_INVERT 0x01 /* PDO_BIT: write the inverted bit */
+#define CO_REFLEX_NMT    0x02 /* EMCY: send the NMT command */
+#define CO_REFLEX_SEND   0x04 /* EMCY: send the RPDO with the rule data */
+
+#define CO_REFLEX_MAX_RULES 1024
+#define CO_REFLEX_MAX_REPORTS 64 /* Per loop, more are counted as lost */
+
+/* Rule, packed by javascript */
+typedef struct {
+	uint8_t  type;
+	uint8_t  src_node;  /* EMCY: 0 for any node */
+	uint8_t  src_pdo;
+	uint8_t  src_bit;   /* 0..63 */
+	uint8_t  dst_node;  /* NMT: 0 for all the nodes */
+	uint8_t  dst_pdo;
+	uint8_t  dst_bit;
+	uint8_t  actions;
+	uint8_t  nmt;       /* NMT command */
+	uint8_t  len;       /* Length of the RPDO */
+	uint8_t  reserved[6];
+	uint8_t  data[8];   /* Initial (PDO_BIT) or safe state (EMCY) RPDO */
+} co_t_reflex_rule;
+
+/* Fired rule, reported to javascript at the end of the receive batch */
+typedef struct {
+	uint32_t rule;
+	uint8_t  type;
+	uint8_t  node;      /* Node of the frame */
+	uint16_t reserved;
+	uint64_t timestamp; /* Receive timestamp of the frame */
+} co_t_reflex_report;
+
+/* RPDO written by the rules */
+typedef struct {
+	uint8_t len;
+	uint8_t data[8];
+} co_t_reflex_output;
+
+/* Rules evaluated in the receive path, one table per bus */
+typedef struct {
+	co_t_reflex_rule *rules;
+	uint8_t *last;      /* Last source bit of each rule, 0xFF unknown */
+	unsigned int count;
+	co_t_reflex_output (*outputs)[4]; /* [node][RPDO] */
+	co_t_reflex_report reports[CO_REFLEX_MAX_REPORTS];
+	unsigned int nreports;
+	uint32_t lost;
+	napi_ref cb_ref;
+	napi_async_context cb_ctx;
+} co_t_reflex;
+
+/* LSS COB-IDs (CiA 305) */
+#define CO_LSS_MASTER 0x7E5
+#define CO_LSS_SLAVE  0x7E4
+
+/* LSS command specifiers */
+#define CO_LSS_SWITCH_GLOBAL    0x04
+#define CO_LSS_CONFIGURE_NODE_ID 0x11
+#define CO_LSS_STORE            0x17
+#define CO_LSS_SWITCH_VENDOR    0x40 /* Then product, revision, serial */
+#define CO_LSS_SWITCH_RESPONSE  0x44
+#define CO_LSS_IDENTIFY_SLAVE   0x4F
+#define CO_LSS_FASTSCAN         0x51
+
+#define CO_LSS_FASTSCAN_RESET   0x80 /* BitChecked of the first request */
+
+#define CO_LSS_TIMEOUT      100 /* Milliseconds, answer of a command */
+#define CO_LSS_SCAN_TIMEOUT 10  /* Milliseconds, each fastscan step */
+
+/* LSS master operation in progress, one per bus */
+typedef enum {
+	CO_LSS_IDLE=0,
+	CO_LSS_OP_FASTSCAN,
+	CO_LSS_OP_SELECTIVE,
+	CO_LSS_OP_CONFIGURE,
+	CO_LSS_OP_STORE
+} co_t_lss_op;
+
+typedef struct {
+	co_t_lss_op op;
+	uv_timer_t uvt;
+	unsigned int timeout;  /* Milliseconds per step */
+	napi_deferred deferred;
+	napi_async_context ctx;
+
+	/* Fastscan: LSS address found so far, current part and bit */
+	uint32_t id[4];
+	uint8_t known;         /* Parts given by javascript, one bit each */
+	uint8_t sub;
+	int bit;               /* CO_LSS_FASTSCAN_RESET, 31..0, -1: confirm */
+	bool answered;
+} co_t_lss;
+
+/* Bus scan: 0x1000 then 0x1018 sub 1..4 of every node id */
+#define CO_SCAN_TICK 5 /* Milliseconds between the checks of the deadlines */
+
+typedef enum {
+	CO_SCAN_IDLE=0,    /* Not probed yet */
+	CO_SCAN_PROBING,   /* Request sent */
+	CO_SCAN_ABSENT,
+	CO_SCAN_FOUND,
+	CO_SCAN_SKIPPED    /* Node object on this bus, not probed */
+} co_t_scan_state;
+
+/* Device found, packed for javascript */
+typedef struct {
+	uint8_t  node_id;
+	uint8_t  identity; /* Sub-indexes of 0x1018 read, one bit each */
+	uint16_t reserved;
+	uint32_t device_type;
+	uint32_t vendor, product, revision, serial;
+} co_t_scan_entry;
+
+typedef struct {
+	uint8_t state;
+	uint8_t step;      /* 0: 0x1000, 1..4: 0x1018 sub */
+	uint8_t tries;
+	uint64_t deadline; /* Loop time, ms */
+	co_t_scan_entry entry;
+} co_t_scan_node;
+
+typedef struct {
+	bool running;
+	uv_timer_t uvt;
+	unsigned int parallel, timeout, retries, inflight, next_id, found;
+	uint8_t nmt;       /* NMT command sent to each device found, 0: none */
+	napi_deferred deferred;
+	napi_async_context ctx;
+	co_t_scan_node nodes[CO_MAX_NODES];
+} co_t_scan;
+
+/* Replay of a recording into the receive path */
+#define CO_REPLAY_BATCH 256 /* Frames per loop iteration, at most */
+
+typedef struct {
+	bool running;
+	uv_timer_t uvt;
+	co_t_trace_header *header; /* Mapped read-only */
+	size_t size;
+	uint64_t pos, end; /* Records */
+	uint64_t first;    /* Timestamp of the first record */
+	uint64_t start;    /* Time of the replay start */
+	double speed;      /* 1: original timing, 0: as fast as possible */
+	uint32_t count;    /* Frames dispatched */
+	napi_deferred deferred;
+	napi_async_context ctx;
+} co_t_replay;
+
+/* Options of the bus, read when the first node opens it */
+typedef struct {
+	uint32_t rx_batch;    /* Frames per recvmmsg */
+	bool rx_thread;       /* Receive in a dedicated thread */
+	uint32_t rx_cpu;      /* CPU of the thread, UINT32_MAX: not pinned */
+	uint32_t rx_priority; /* SCHED_FIFO priority, 0: normal thread */
+	uint32_t rx_ring;     /* Frames between the thread and the loop */
+	uint32_t tx_cpu;      /* CPU of the cyclic PDO thread, UINT32_MAX: not pinned */
+	uint32_t tx_priority; /* SCHED_FIFO priority, 0: normal thread */
+	bool fd;              /* CAN FD frames, PDO up to 64 bytes */
+	bool brs;             /* Bit rate switch of the FD frames sent */
+	char transport[16];   /* "socketcan" (default) or "loopback" */
+	co_t_sim_options sim; /* Simulated slave of the loopback transport */
+} co_t_bus_options;
+
+/* One bus per CAN interface, shared by all the nodes on it */
+typedef struct co_s_bus {
+	struct co_s_bus *next;
+	napi_env env;
+	char device[IFNAMSIZ];
+	unsigned int refcount;
+
+	/* CAN Hardware Stuff */
+	const co_t_transport *transport;
+	int canfd;
+	uv_poll_t can_uvp;
+	bool fd;          /* CAN FD frames enabled, the PDO are sent as FD frames */
+	uint8_t fd_flags; /* Flags of the FD frames sent (CANFD_BRS) */
+
+	/* Receive batch (recvmmsg) */
+	unsigned int rx_batch;
+	struct mmsghdr *rx_msgs;
+	struct iovec *rx_iov;
+	struct canfd_frame *rx_frames;
+	uint8_t *rx_cmsg; /* Kernel timestamps */
+
+	/* Receive thread, feeds the loop through the ring */
+	bool rx_threaded;
+	pthread_t rx_thread;
+	int rx_stopfd;
+	int rx_cpu, rx_priority;
+	co_t_rx_ring rx_ring;
+	uv_async_t rx_async;
+
+	/* Node lookup table (COB-ID & 0x7F) */
+	co_t_node *nodes[CO_MAX_NODES];
+
+	/* Additional SDO channels, looked up by COB-ID */
+	co_t_sdo_channel **sdo_routes;
+	unsigned int sdo_nroutes;
+
+	/* Nodes to flush at the end of the receive batch */
+	co_t_node *flush_list;
+
+	/* SYNC producer thread */
+	co_t_sync sync;
+
+	/* Cyclic PDO thread */
+	co_t_cyclic_sched cyclic;
+
+	/* Heartbeat consumer */
+	co_t_hb_consumer hb;
+
+	/* Reflex rules */
+	co_t_reflex reflex;
+
+	/* LSS master */
+	co_t_lss lss;
+
+	/* Bus scan */
+	co_t_scan scan;
+
+	/* Trace recorder and replay */
+	co_t_trace trace;
+	co_t_replay replay;
+
+	/* Other end of the loopback transport */
+	co_t_sim *sim;
+
+	/* Counters, snapshot by metrics() */
+	co_t_bus_metrics metrics;
+
+	/* Handles not closed yet (free the bus when it reaches 0) */
+	unsigned int closing;
+} co_t_bus;
+
+/* All the open buses */
+co_t_bus *g_bus_list = NULL;
+
+//// Node structure ////////////////////////////////////////////////////////////
+struct co_s_node {
+	/* Node.js Stuff */
+	napi_env env;
+	canid_t node_id;
+
+	/* CAN Bus Stuff */
+	co_t_bus *bus;
+
+	/* Handles not closed yet (free the node when it reaches 0) */
+	unsigned int closing;
+
+	/* Heartbeat Stuff */
+	napi_ref hb_cb_ref;
+	napi_async_context hb_cb_ctx;
+	uv_timer_t hb_uvt;
+	unsigned int hb_wait_time;
+	uint8_t hb_last_toggle_bit;
+
+	/* EMCY Stuff */
+	napi_ref emcy_cb_ref;
+	napi_async_context emcy_cb_ctx;
+
+	/* SDO Stuff */
+	co_t_sdo_queue sdo_queue;
+	co_t_sdo_channel *sdo_channels[CO_MAX_SDO_CHANNELS];
+	unsigned int sdo_nchannels;
+	unsigned int sdo_wait_time;
+	uint8_t sdo_block_size;
+	napi_async_context sdo_promise_ctx; /* Shared by all the promises */
+
+	/* PDO Stuff */
+	napi_ref pdo_cb_ref;
+	napi_async_context pdo_cb_ctx;
+	co_t_pdo_map *pdo_maps[2][4]; /* [CO_PDO_MAP_TX/RX][PDO id] */
+
+	/* PDO Ring Stuff */
+	co_t_pdo_ring *ring;
+	napi_ref ring_ref;
+	napi_ref ring_cb_ref;
+	napi_async_context ring_cb_ctx;
+	uint8_t ring_signal;
+	uint32_t ring_notified; /* Head at the last signal */
+
+	/* Process Image Stuff */
+	co_t_image *image;
+	napi_ref image_ref;
+	napi_ref image_cb_ref;
+	napi_async_context image_cb_ctx;
+	uint8_t image_signal;
+
+	/* PDO Batch Stuff */
+	napi_ref batch_cb_ref;
+	napi_async_context batch_cb_ctx;
+	co_t_pdo_batch_item *batch;
+	uint32_t batch_count, batch_size;
+
+	/* Flush Stuff */
+	co_t_node *flush_next;
+	uint8_t flush_pending;
+
+	/* Latency Stuff: kernel receive to callback, SDO request to response */
+	co_t_hist rx_latency;
+	co_t_hist sdo_latency;
+
+	/* Counters, snapshot by metrics() */
+	co_t_node_metrics metrics;
+};
+
+//// Transport /////////////////////////////////////////////////////////////////
+
+/* Socket of a bus: the rest of the bus (recvmmsg, sendmmsg, poll) is the same */
+struct co_s_transport {
+	const char *name;
+	bool can_raw; /* CAN_RAW socket, the filters apply */
+	/* Returns the socket, or -1 and the error message */
+	int (*open)(co_t_bus *bus, co_t_bus_options *o, const char **error);
+	/* When the bus is freed, before its socket is closed */
+	void (*close)(co_t_bus *bus);
+};
+
+co_t_sim *co_sim_start(int fd, co_t_sim_options *o);
+void co_sim_stop(co_t_sim *sim);
+
+/* SocketCAN interface, real or vcan */
+int co_socketcan_open(co_t_bus *bus, co_t_bus_options *o, const char **error) {
+	struct ifreq ifr;
+	struct sockaddr_can addr;
+	int s, one = 1;
+
+	s = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	if(s < 0){
+		*error = "Cannot create socket";
+		return -1;
+	}
+	if(o->fd && setsockopt(s, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &one, sizeof(one)) < 0){
+		*error = "CAN FD not supported";
+		close(s);
+		return -1;
+	}
+	strcpy(ifr.ifr_name, bus->device);
+	ioctl(s, SIOCGIFINDEX, &ifr); /* ifr.ifr_ifindex gets filled */
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = ifr.ifr_ifindex;
+	if(bind(s, (struct sockaddr*)&addr, sizeof(addr)) < 0){
+		*error = "Cannot bind socket";
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+/* In-memory loopback: a socket pair, the simulated slave at the other end */
+int co_loopback_open(co_t_bus *bus, co_t_bus_options *o, const char **error) {
+	int sv[2];
+
+	if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0){
+		*error = "Cannot create socket";
+		return -1;
+	}
+	bus->sim = co_sim_start(sv[1], &o->sim);
+	if(bus->sim == NULL){
+		*error = "Cannot start the simulated slave";
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+	return sv[0];
+}
+
+/* SocketCAN interface, the simulated slave on a second socket of it (vcan) */
+int co_socketcan_sim_open(co_t_bus *bus, co_t_bus_options *o, const char **error) {
+	int s, sim_s;
+
+	s = co_socketcan_open(bus, o, error);
+	if(s < 0) return -1;
+	sim_s = co_socketcan_open(bus, o, error);
+	if(sim_s < 0){
+		close(s);
+		return -1;
+	}
+	bus->sim = co_sim_start(sim_s, &o->sim);
+	if(bus->sim == NULL){
+		*error = "Cannot start the simulated slave";
+		close(s);
+		close(sim_s);
+		return -1;
+	}
+	return s;
+}
+
+void co_loopback_close(co_t_bus *bus) {
+	co_sim_stop(bus->sim);
+	bus->sim = NULL;
+}
+
+const co_t_transport g_transports[] = {
+	{ "socketcan", true, co_socketcan_open, NULL },
+	{ "loopback", false, co_loopback_open, co_loopback_close },
+	{ "socketcan_sim", true, co_socketcan_sim_open, co_loopback_close }
+};
+
+//// Bus functions /////////////////////////////////////////////////////////////
+void co_can_recv_cb(uv_poll_t* handle, int status, int events);
+void co_rx_async_cb(uv_async_t* handle);
+int co_thread_wake(int stopfd);
+void *co_rx_thread(void *arg);
+
+#define CO_RX_CMSG_SIZE (CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(uint32_t)))
+
+/* Receive a batch of frames, without blocking */
+int co_bus_recv(co_t_bus *bus) {
+	unsigned int i;
+	for(i = 0; i < bus->rx_batch; ++i)
+		bus->rx_msgs[i].msg_hdr.msg_controllen = CO_RX_CMSG_SIZE;
+	return recvmmsg(bus->canfd, bus->rx_msgs, bus->rx_batch, MSG_DONTWAIT, NULL);
+}
+
+/* Kernel receive timestamp of a frame, in nanoseconds. The drop counter of
+   the socket comes with it (SO_RXQ_OVFL) */
+uint64_t co_bus_timestamp(co_t_bus *bus, struct msghdr *msg) {
+	struct cmsghdr *c;
+	struct timespec t;
+	uint64_t ts = 0;
+	uint32_t overflow;
+	for(c = CMSG_FIRSTHDR(msg); c != NULL; c = CMSG_NXTHDR(msg, c)){
+		if(c->cmsg_level != SOL_SOCKET) continue;
+		if(c->cmsg_type == SCM_TIMESTAMPNS){
+			memcpy(&t, CMSG_DATA(c), sizeof(t));
+			ts = (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+		}else if(c->cmsg_type == SO_RXQ_OVFL){
+			memcpy(&overflow, CMSG_DATA(c), sizeof(overflow));
+			bus->metrics.rx_overflow = overflow;
+		}
+	}
+	return ts != 0 ? ts : co_now(); /* Not supported by the driver */
+}
+
+/* Count a received message, false if it is not a whole frame */
+static inline bool co_bus_count_rx(co_t_bus *bus, struct mmsghdr *m, struct canfd_frame *frame) {
+	if(m->msg_len != CAN_MTU && m->msg_len != CANFD_MTU){
+		bus->metrics.rx_short++;
+		return false;
+	}
+	if(frame->can_id & CAN_ERR_FLAG){
+		bus->metrics.error_frames++;
+		if(frame->can_id & CAN_ERR_BUSOFF) bus->metrics.bus_off++;
+	}else{
+		bus->metrics.rx[(frame->can_id & CAN_SFF_MASK) >> 7]++;
+	}
+	return true;
+}
+
+/* Classic frame, unless marked CANFD_FDF (PDO of a FD bus) */
+static inline size_t co_frame_mtu(co_t_bus *bus, struct canfd_frame *frame) {
+	return bus->fd && (frame->flags & CANFD_FDF) ? CANFD_MTU : CAN_MTU;
+}
+
+/* Flags of the trace record of a frame */
+static inline uint8_t co_frame_trace_flags(size_t mtu, struct canfd_frame *frame) {
+	return mtu == CANFD_MTU ? CO_TRACE_FD | (frame->flags & CANFD_BRS ? CO_TRACE_BRS : 0) : 0;
+}
+
+int co_bus_send(co_t_bus *bus, struct canfd_frame *frame) {
+	size_t mtu = co_frame_mtu(bus, frame);
+	int n = write(bus->canfd, frame, mtu);
+	if(n > 0){
+		co_metrics_add(&bus->metrics.tx[(frame->can_id & CAN_SFF_MASK) >> 7], 1);
+		co_trace_write(&bus->trace, frame, co_now(),
+			CO_TRACE_TX | co_frame_trace_flags(mtu, frame));
+	}else{
+		co_metrics_add(&bus->metrics.tx_errors, 1);
+	}
+	return n;
+}
+
+/* Send several frames with a single syscall, return the number sent */
+int co_bus_send_many(co_t_bus *bus, struct canfd_frame *frames, unsigned int count) {
+	struct mmsghdr msgs[CO_TX_BATCH];
+	struct iovec iov[CO_TX_BATCH];
+	unsigned int i, sent = 0;
+	int n;
+
+	if(count > CO_TX_BATCH) count = CO_TX_BATCH;
+	memset(msgs, 0, count * sizeof(struct mmsghdr));
+	for(i = 0; i < count; ++i){
+		iov[i].iov_base = &frames[i];
+		iov[i].iov_len = co_frame_mtu(bus, &frames[i]);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	/* sendmmsg may stop before the end (socket buffer full) */
+	while(sent < count){
+		n = sendmmsg(bus->canfd, &msgs[sent], count - sent, 0);
+		if(n <= 0){
+			co_metrics_add(&bus->metrics.tx_errors, 1);
+			break;
+		}
+		sent += n;
+	}
+	for(i = 0; i < sent; ++i)
+		co_metrics_add(&bus->metrics.tx[(frames[i].can_id & CAN_SFF_MASK) >> 7], 1);
+	for(i = 0; i < sent && bus->trace.header != NULL; ++i)
+		co_trace_write(&bus->trace, &frames[i], co_now(),
+			CO_TRACE_TX | co_frame_trace_flags(iov[i].iov_len, &frames[i]));
+	return sent > 0 || count == 0 ? (int)sent : -1;
+}
+
+/* Largest PDO of the bus */
+static inline size_t co_pdo_max_len(co_t_bus *bus) {
+	return bus->fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN;
+}
+
+/* Fill a PDO frame, as a FD frame on a FD bus: the length is rounded up
+   to a valid FD length (12, 16, 20, 24, 32, 48, 64) and padded with 0 */
+void co_pdo_frame(co_t_bus *bus, struct canfd_frame *frame, canid_t cob_id,
+		const uint8_t *data, size_t len) {
+	static const uint8_t fd_len[] = { 12, 16, 20, 24, 32, 48, 64 };
+	unsigned int i;
+
+	frame->can_id = cob_id;
+	frame->flags = 0;
+	frame->__res0 = frame->__res1 = 0;
+	memcpy(frame->data, data, len);
+	frame->len = len;
+	if(!bus->fd) return;
+	frame->flags = bus->fd_flags;
+	for(i = 0; len > CAN_MAX_DLEN && fd_len[i] < len; ++i);
+	if(len > CAN_MAX_DLEN) frame->len = fd_len[i];
+	memset(&frame->data[len], 0, frame->len - len);
+}
+
+int co_bus_set_filter(co_t_bus *bus) {
+	struct can_filter *rfilter;
+	can_err_mask_t err_mask = CAN_ERR_MASK;
+	unsigned int i;
+	int err;
+
+	/* Nothing to filter on a loopback */
+	if(!bus->transport->can_raw) return 0;
+
+	rfilter = (struct can_filter *)malloc((8 + bus->sdo_nroutes) * sizeof(struct can_filter));
+	if(rfilter == NULL) return -1;
+	/* Filter by function code only (mask 0x780), the node is found later
+	   with the lookup table. Extended frames are never accepted. */
+	/* Emergency */
+	rfilter[0].can_id   = 0x080;
+	rfilter[0].can_mask = CAN_EFF_FLAG | 0x780;
+	/* PDO 0 */
+	rfilter[1].can_id   = 0x180;
+	rfilter[1].can_mask = CAN_EFF_FLAG | 0x780;
+	/* PDO 1 */
+	rfilter[2].can_id   = 0x280;
+	rfilter[2].can_mask = CAN_EFF_FLAG | 0x780;
+	/* PDO 2 */
+	rfilter[3].can_id   = 0x380;
+	rfilter[3].can_mask = CAN_EFF_FLAG | 0x780;
+	/* PDO 3 */
+	rfilter[4].can_id   = 0x480;
+	rfilter[4].can_mask = CAN_EFF_FLAG | 0x780;
+	/* SDO */
+	rfilter[5].can_id   = 0x580;
+	rfilter[5].can_mask = CAN_EFF_FLAG | 0x780;
+	/* NMT */
+	rfilter[6].can_id   = 0x700;
+	rfilter[6].can_mask = CAN_EFF_FLAG | 0x780;
+	/* LSS */
+	rfilter[7].can_id   = 0x7E4;
+	rfilter[7].can_mask = CAN_EFF_FLAG | 0x7FF;
+	/* Additional SDO channels */
+	for(i = 0; i < bus->sdo_nroutes; ++i){
+		rfilter[8+i].can_id   = bus->sdo_routes[i]->cob_rx;
+		rfilter[8+i].can_mask = CAN_EFF_FLAG | 0x7FF;
+	}
+	err = setsockopt(bus->canfd, SOL_CAN_RAW, CAN_RAW_FILTER,
+		rfilter, (8 + bus->sdo_nroutes) * sizeof(struct can_filter));
+	free(rfilter);
+	/* Error frames of the controller, counted only */
+	setsockopt(bus->canfd, SOL_CAN_RAW, CAN_RAW_ERR_FILTER, &err_mask, sizeof(err_mask));
+	return err;
+}
+
+/* Route of an additional SDO channel receiving `cob_id`, NULL if none */
+co_t_sdo_channel *co_bus_find_route(co_t_bus *bus, canid_t cob_id) {
+	unsigned int i;
+	for(i = 0; i < bus->sdo_nroutes; ++i)
+		if(bus->sdo_routes[i]->cob_rx == cob_id) return bus->sdo_routes[i];
+	return NULL;
+}
+
+/* COB-ID the bus receives for the nodes: the predefined connection set (EMCY,
+   TIME, PDO, heartbeat), LSS and the default SDO response of a node of the bus.
+   An additional SDO channel receiving it would take these frames. */
+bool co_bus_cob_reserved(co_t_bus *bus, canid_t cob_id) {
+	if(cob_id >= 0x080 && cob_id <= 0x57F) return true;
+	if(cob_id >= 0x700 && cob_id <= 0x77F) return true;
+	if(cob_id == CO_LSS_SLAVE) return true;
+	return (cob_id & 0x780) == 0x580 && bus->nodes[cob_id & 0x7F] != NULL;
+}
+
+/* Receive the responses of an additional SDO channel */
+int co_bus_add_route(co_t_bus *bus, co_t_sdo_channel *ch) {
+	co_t_sdo_channel **routes;
+
+	if(co_bus_find_route(bus, ch->cob_rx) != NULL) return -1;
+	if(bus->sdo_nroutes >= CO_MAX_SDO_ROUTES) return -1;
+	routes = (co_t_sdo_channel **)realloc(bus->sdo_routes,
+		(bus->sdo_nroutes + 1) * sizeof(co_t_sdo_channel *));
+	if(routes == NULL) return -1;
+	routes[bus->sdo_nroutes++] = ch;
+	bus->sdo_routes = routes;
+	if(co_bus_set_filter(bus) < 0){
+		bus->sdo_nroutes--;
+		return -1;
+	}
+	return 0;
+}
+
+void co_bus_remove_route(co_t_bus *bus, co_t_sdo_channel *ch) {
+	unsigned int i;
+	for(i = 0; i < bus->sdo_nroutes; ++i){
+		if(bus->sdo_routes[i] == ch){
+			bus->sdo_routes[i] = bus->sdo_routes[--bus->sdo_nroutes];
+			co_bus_set_filter(bus);
+			return;
+		}
+	}
+}
+
+void co_bus_free(co_t_bus *bus) {
+	free(bus->rx_ring.items);
+	free(bus->sdo_routes);
+	free(bus->rx_msgs);
+	free(bus->rx_iov);
+	free(bus->rx_frames);
+	free(bus->rx_cmsg);
+	pthread_mutex_destroy(&bus->sync.lock);
+	pthread_mutex_destroy(&bus->cyclic.lock);
+	free(bus->cyclic.entries);
+	free(bus);
+}
+
+void co_bus_close_cb(uv_handle_t* handle) {
+	co_t_bus *bus = (co_t_bus *)handle->data;
+	if(--bus->closing > 0) return;
+	if(bus->rx_stopfd >= 0) close(bus->rx_stopfd);
+	if(bus->transport->close != NULL) bus->transport->close(bus);
+	close(bus->canfd);
+	co_bus_free(bus);
+}
+
+co_t_bus *co_bus_open(napi_env env, const char *device, napi_value options) {
+	napi_status status;
+	uv_loop_t *loop;
+	co_t_bus *bus;
+	const char *error;
+	unsigned int i;
+	co_t_bus_options o = { 16, false, UINT32_MAX, 0, 4096, UINT32_MAX, 0, false, false,
+		"socketcan", { CO_MAX_NODES - 1, 0, 0, 0, 0 } };
+	int err, one = 1;
+
+	/* Share the bus, if the interface is already open (by this thread) */
+	for(bus = g_bus_list; bus != NULL; bus = bus->next){
+		if(bus->env == env && strcmp(bus->device, device) == 0){
+			bus->refcount++;
+			return bus;
+		}
+	}
+
+	status = napi_get_uv_event_loop(env, &loop);
+	if(status == napi_ok)
+		status = napi_get_named_uint32(env, options, "rx_batch", &o.rx_batch);
+	if(status == napi_ok)
+		status = napi_get_named_bool(env, options, "rx_thread", &o.rx_thread);
+	if(status == napi_ok)
+		status = napi_get_named_uint32(env, options, "rx_cpu", &o.rx_cpu);
+	if(status == napi_ok)
+		status = napi_get_named_uint32(env, options, "rx_priority", &o.rx_priority);
+	if(status == napi_ok)
+		status = napi_get_named_uint32(env, options, "rx_ring", &o.rx_ring);
+	if(status == napi_ok)
+		status = napi_get_named_uint32(env, options, "tx_cpu", &o.tx_cpu);
+	if(status == napi_ok)
+		status = napi_get_named_uint32(env, options, "tx_priority", &o.tx_priority);
+	if(status == napi_ok)
+		status = napi_get_named_bool(env, options, "fd", &o.fd);
+	if(status == napi_ok)
+		status = napi_get_named_bool(env, options, "brs", &o.brs);
+	if(status == napi_ok)
+		status = napi_get_named_string(env, options, "transport", o.transport, sizeof(o.transport));
+	if(status == napi_ok)
+		status = napi_get_named_uint32(env, options, "sim_nodes", &o.sim.nodes);
+	if(status == napi_ok)
+		status = napi_get_named_uint32(env, options, "sim_heartbeat", &o.sim.heartbeat);
+	if(status == napi_ok)
+		status = napi_get_named_uint32(env, options, "sim_tpdo", &o.sim.tpdo);
+	if(status == napi_ok)
+		status = napi_get_named_uint32(env, options, "sim_latency", &o.sim.latency);
+	if(status == napi_ok)
+		status = napi_get_named_uint32(env, options, "sim_loss", &o.sim.loss);
+	if(status != napi_ok){
+		napi_throw_last_error(env);
+		return NULL;
+	}
+	if(o.rx_batch < 1 || o.rx_batch > 1024){
+		napi_throw_error(env, NULL, "Invalid rx_batch");
+		return NULL;
+	}
+	if(o.rx_priority > 99){
+		napi_throw_error(env, NULL, "Invalid rx_priority");
+		return NULL;
+	}
+	if(o.tx_priority > 99){
+		napi_throw_error(env, NULL, "Invalid tx_priority");
+		return NULL;
+	}
+	if(o.rx_ring < 2 || o.rx_ring > 0x100000){
+		napi_throw_error(env, NULL, "Invalid rx_ring");
+		return NULL;
+	}
+	if(o.sim.nodes >= CO_MAX_NODES || o.sim.loss > 1000 ||
+			(o.sim.tpdo > 0 && o.sim.tpdo < 100)){
+		napi_throw_error(env, NULL, "Invalid simulated slave");
+		return NULL;
+	}
+
+	bus = (co_t_bus *)calloc(1, sizeof(co_t_bus));
+	if(bus == NULL){
+		napi_throw_error(env, NULL, "Cannot allocate bus");
+		return NULL;
+	}
+	bus->env = env;
+	strncpy(bus->device, device, sizeof(bus->device)-1);
+	bus->refcount = 1;
+	bus->rx_stopfd = -1;
+	for(i = 0; i < sizeof(g_transports) / sizeof(g_transports[0]); ++i)
+		if(strcmp(g_transports[i].name, o.transport) == 0)
+			bus->transport = &g_transports[i];
+	if(bus->transport == NULL){
+		napi_throw_error(env, NULL, "Invalid transport");
+		free(bus);
+		return NULL;
+	}
+	pthread_mutex_init(&bus->sync.lock, NULL);
+	pthread_mutex_init(&bus->cyclic.lock, NULL);
+	bus->cyclic.cpu = o.tx_cpu == UINT32_MAX ? -1 : (int)o.tx_cpu;
+	bus->cyclic.priority = o.tx_priority;
+	bus->fd = o.fd;
+	bus->fd_flags = CANFD_FDF | (o.brs ? CANFD_BRS : 0);
+
+	/* Prepare the receive batch */
+	bus->rx_batch = o.rx_batch;
+	bus->rx_msgs = (struct mmsghdr *)calloc(o.rx_batch, sizeof(struct mmsghdr));
+	bus->rx_iov = (struct iovec *)calloc(o.rx_batch, sizeof(struct iovec));
+	bus->rx_frames = (struct canfd_frame *)calloc(o.rx_batch, sizeof(struct canfd_frame));
+	bus->rx_cmsg = (uint8_t *)calloc(o.rx_batch, CO_RX_CMSG_SIZE);
+	if(bus->rx_msgs == NULL || bus->rx_iov == NULL || bus->rx_frames == NULL ||
+			bus->rx_cmsg == NULL ||
+			(o.rx_thread && co_rx_ring_init(&bus->rx_ring, o.rx_ring) < 0)){
+		napi_throw_error(env, NULL, "Cannot allocate bus");
+		co_bus_free(bus);
+		return NULL;
+	}
+	for(i = 0; i < o.rx_batch; ++i){
+		bus->rx_iov[i].iov_base = &bus->rx_frames[i];
+		bus->rx_iov[i].iov_len = o.fd ? CANFD_MTU : CAN_MTU;
+		bus->rx_msgs[i].msg_hdr.msg_iov = &bus->rx_iov[i];
+		bus->rx_msgs[i].msg_hdr.msg_iovlen = 1;
+		bus->rx_msgs[i].msg_hdr.msg_control = &bus->rx_cmsg[i * CO_RX_CMSG_SIZE];
+	}
+
+	/* Create Socket */
+	bus->canfd = bus->transport->open(bus, &o, &error);
+	if(bus->canfd < 0){
+		napi_throw_error(env, NULL, error);
+		co_bus_free(bus);
+		return NULL;
+	}
+	co_bus_set_filter(bus);
+	setsockopt(bus->canfd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+	setsockopt(bus->canfd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one));
+
+	/* Handle data for all the nodes */
+	if(o.rx_thread){
+		/* The thread drains the socket, the loop is woken up to dispatch */
+		bus->rx_threaded = true;
+		bus->rx_cpu = o.rx_cpu == UINT32_MAX ? -1 : (int)o.rx_cpu;
+		bus->rx_priority = o.rx_priority;
+		bus->rx_stopfd = eventfd(0, EFD_CLOEXEC);
+		if(bus->rx_stopfd < 0){
+			napi_throw_error(env, NULL, "Cannot create eventfd");
+			if(bus->transport->close != NULL) bus->transport->close(bus);
+			close(bus->canfd);
+			co_bus_free(bus);
+			return NULL;
+		}
+		uv_async_init(loop, &bus->rx_async, co_rx_async_cb);
+		bus->rx_async.data = bus;
+		err = pthread_create(&bus->rx_thread, NULL, co_rx_thread, bus);
+		if(err != 0){
+			napi_throw_error(env, NULL, "Cannot create receive thread");
+			bus->closing = 1;
+			uv_close((uv_handle_t *)&bus->rx_async, co_bus_close_cb);
+			return NULL;
+		}
+	}else{
+		uv_poll_init(loop, &bus->can_uvp, bus->canfd);
+		bus->can_uvp.data = bus;
+		uv_poll_start(&bus->can_uvp, UV_READABLE, co_can_recv_cb);
+	}
+
+	/* Heartbeat consumer wheel, started by hb_consumer */
+	uv_timer_init(loop, &bus->hb.uvt);
+	bus->hb.uvt.data = bus;
+
+	/* LSS master steps */
+	uv_timer_init(loop, &bus->lss.uvt);
+	bus->lss.uvt.data = bus;
+
+	/* Bus scan deadlines */
+	uv_timer_init(loop, &bus->scan.uvt);
+	bus->scan.uvt.data = bus;
+
+	/* Replay steps */
+	uv_timer_init(loop, &bus->replay.uvt);
+	bus->replay.uvt.data = bus;
+	for(i = 0; i < CO_MAX_NODES; ++i)
+		bus->hb.entries[i].state = CO_HB_UNKNOWN;
+
+	bus->next = g_bus_list;
+	g_bus_list = bus;
+	return bus;
+}
+
+void co_sync_thread_stop(co_t_bus *bus);
+void co_cyclic_thread_stop(co_t_bus *bus);
+void co_hb_consumer_release(co_t_bus *bus);
+void co_reflex_release(co_t_bus *bus);
+void co_lss_release(co_t_bus *bus);
+void co_scan_release(co_t_bus *bus);
+void co_replay_release(co_t_bus *bus);
+
+void co_bus_release(co_t_bus *bus) {
+	co_t_bus **p;
+
+	if(--bus->refcount > 0) return;
+	co_sync_thread_stop(bus);
+	co_cyclic_thread_stop(bus);
+	co_hb_consumer_release(bus);
+	co_reflex_release(bus);
+	co_lss_release(bus);
+	co_scan_release(bus);
+	co_replay_release(bus);
+	bus->closing = 5;
+	uv_close((uv_handle_t *)&bus->hb.uvt, co_bus_close_cb);
+	uv_close((uv_handle_t *)&bus->lss.uvt, co_bus_close_cb);
+	uv_close((uv_handle_t *)&bus->scan.uvt, co_bus_close_cb);
+	uv_close((uv_handle_t *)&bus->replay.uvt, co_bus_close_cb);
+
+	/* Remove from the list of open buses */
+	for(p = &g_bus_list; *p != NULL; p = &(*p)->next){
+		if(*p == bus){
+			*p = bus->next;
+			break;
+		}
+	}
+
+	if(bus->rx_threaded){
+		/* Wake up the thread and wait for it, poll is a cancellation point
+		   when the eventfd cannot be written */
+		if(co_thread_wake(bus->rx_stopfd) < 0)
+			pthread_cancel(bus->rx_thread);
+		pthread_join(bus->rx_thread, NULL);
+		co_trace_end(&bus->trace);
+		uv_close((uv_handle_t *)&bus->rx_async, co_bus_close_cb);
+		return;
+	}
+	co_trace_end(&bus->trace);
+	uv_poll_stop(&bus->can_uvp);
+	uv_close((uv_handle_t *)&bus->can_uvp, co_bus_close_cb);
+}
+
+/* Apply CPU affinity and real-time priority to the calling thread */
+void co_thread_setup(int cpu, int priority) {
+	if(cpu >= 0){
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+			fprintf(stderr, "dcanopen: cannot pin thread to CPU %d\n", cpu);
+	}
+	if(priority > 0){
+		struct sched_param sp = { .sched_priority = priority };
+		if(pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp) != 0)
+			fprintf(stderr, "dcanopen: cannot set SCHED_FIFO priority %d\n",
+				priority);
+	}
+}
+
+/* Wake up a thread polling its stop eventfd, -1 if it could not be signaled */
+int co_thread_wake(int stopfd) {
+	uint64_t one = 1;
+	ssize_t n;
+
+	do {
+		n = write(stopfd, &one, sizeof(one));
+	} while(n < 0 && (errno == EINTR || errno == EAGAIN));
+	return n == sizeof(one) ? 0 : -1;
+}
+
+/* Receive thread: drain the socket into the ring, wake up the loop */
+void *co_rx_thread(void *arg) {
+	co_t_bus *bus = (co_t_bus *)arg;
+	struct pollfd pfd[2];
+	unsigned int i, pushed;
+	uint64_t ts;
+	int n;
+
+	co_thread_setup(bus->rx_cpu, bus->rx_priority);
+	pfd[0].fd = bus->canfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = bus->rx_stopfd;
+	pfd[1].events = POLLIN;
+	for(;;){
+		if(poll(pfd, 2, -1) < 0) continue;
+		if(pfd[1].revents) break;
+		if(!(pfd[0].revents & POLLIN)) continue;
+
+		pushed = 0;
+		do {
+			n = co_bus_recv(bus);
+			if(n <= 0) break;
+
+			for(i = 0; i < (unsigned int)n; ++i){
+				if(!co_bus_count_rx(bus, &bus->rx_msgs[i], &bus->rx_frames[i]))
+					continue; /* Ignore invalid can frame */
+				ts = co_bus_timestamp(bus, &bus->rx_msgs[i].msg_hdr);
+				co_trace_write(&bus->trace, &bus->rx_frames[i], ts,
+					co_frame_trace_flags(bus->rx_msgs[i].msg_len, &bus->rx_frames[i]));
+				if(co_rx_ring_push(&bus->rx_ring, &bus->rx_frames[i], ts) == 0)
+					pushed++;
+			}
+		} while((unsigned int)n == bus->rx_batch);
+		if(pushed) uv_async_send(&bus->rx_async);
+	}
+	return NULL;
+}
+
+//// SYNC Producer /////////////////////////////////////////////////////////////
+
+uint64_t co_monotonic(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/* SYNC thread: absolute timerfd ticks, send 0x080 on each */
+void *co_sync_thread(void *arg) {
+	co_t_bus *bus = (co_t_bus *)arg;
+	co_t_sync *s = &bus->sync;
+	struct pollfd pfd[2];
+	struct canfd_frame frame;
+	uint64_t expirations, tick, now, ts;
+	uint32_t cycle;
+	int err;
+
+	co_thread_setup(s->cpu, s->priority);
+	memset(&frame, 0, sizeof(frame));
+	frame.can_id = 0x080;
+	pfd[0].fd = s->timerfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = s->stopfd;
+	pfd[1].events = POLLIN;
+	tick = s->start;
+	for(;;){
+		if(poll(pfd, 2, -1) < 0) continue;
+		if(pfd[1].revents) break;
+		if(read(s->timerfd, &expirations, sizeof(expirations)) != sizeof(expirations))
+			continue;
+		now = co_monotonic();
+
+		/* Counter, from 1 to the overflow value */
+		if(s->counter_max){
+			s->counter = s->counter >= s->counter_max ? 1 : s->counter + 1;
+			frame.data[0] = s->counter;
+			frame.len = 1;
+		}
+
+		/* Publish the cycle before the frame, the answers may come first */
+		cycle = s->cycle + 1;
+		ts = co_now();
+		s->history[cycle % CO_SYNC_HISTORY] = ts;
+		__atomic_store_n(&s->cycle, cycle, __ATOMIC_RELEASE);
+		err = co_bus_send(bus, &frame) != CAN_MTU;
+
+		/* Lateness against the ideal tick */
+		tick += expirations * s->period;
+		pthread_mutex_lock(&s->lock);
+		co_hist_record(&s->jitter, now - tick);
+		s->overruns += expirations - 1;
+		s->errors += err;
+		pthread_mutex_unlock(&s->lock);
+	}
+	return NULL;
+}
+
+/* SYNC cycle of a frame received at ts, 0 before the first SYNC */
+uint32_t co_sync_cycle(co_t_bus *bus, uint64_t ts) {
+	uint32_t cycle = __atomic_load_n(&bus->sync.cycle, __ATOMIC_ACQUIRE);
+	unsigned int n;
+	for(n = 0; n < CO_SYNC_HISTORY - 1 && n < cycle; ++n){
+		if(bus->sync.history[(cycle - n) % CO_SYNC_HISTORY] <= ts)
+			return cycle - n;
+	}
+	return cycle - n;
+}
+
+int co_sync_thread_start(co_t_bus *bus, uint64_t period, uint8_t counter_max,
+		int cpu, int priority) {
+	co_t_sync *s = &bus->sync;
+	struct itimerspec its;
+
+	s->period = period;
+	s->counter_max = counter_max;
+	s->counter = 0;
+	s->cpu = cpu;
+	s->priority = priority;
+	s->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if(s->timerfd < 0) return -1;
+	s->stopfd = eventfd(0, EFD_CLOEXEC);
+	if(s->stopfd < 0){
+		close(s->timerfd);
+		return -1;
+	}
+
+	/* Absolute ticks: first SYNC one period from now, then every period */
+	s->start = co_monotonic();
+	its.it_interval.tv_sec = period / 1000000000;
+	its.it_interval.tv_nsec = period % 1000000000;
+	its.it_value.tv_sec = (s->start + period) / 1000000000;
+	its.it_value.tv_nsec = (s->start + period) % 1000000000;
+	if(timerfd_settime(s->timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0 ||
+			pthread_create(&s->thread, NULL, co_sync_thread, bus) != 0){
+		close(s->timerfd);
+		close(s->stopfd);
+		return -1;
+	}
+	s->running = true;
+	return 0;
+}
+
+void co_sync_thread_stop(co_t_bus *bus) {
+	co_t_sync *s = &bus->sync;
+
+	if(!s->running) return;
+	if(co_thread_wake(s->stopfd) < 0)
+		pthread_cancel(s->thread);
+	pthread_join(s->thread, NULL);
+	close(s->timerfd);
+	close(s->stopfd);
+	s->running = false;
+}
+
+//// Cyclic PDO Scheduler //////////////////////////////////////////////////////
+
+/* Wake up the thread at the deadline, UINT64_MAX: nothing to send */
+void co_cyclic_arm(co_t_cyclic_sched *s, uint64_t deadline) {
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	if(deadline != UINT64_MAX){
+		its.it_value.tv_sec = deadline / 1000000000;
+		its.it_value.tv_nsec = deadline % 1000000000;
+	}
+	timerfd_settime(s->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* Cyclic PDO thread: send the entries due, sleep until the next deadline */
+void *co_cyclic_thread(void *arg) {
+	co_t_bus *bus = (co_t_bus *)arg;
+	co_t_cyclic_sched *s = &bus->cyclic;
+	struct canfd_frame frames[CO_TX_BATCH];
+	struct pollfd pfd[2];
+	co_t_cyclic *e;
+	uint64_t expirations, now, next, late;
+	unsigned int i, count;
+	int cancel;
+
+	co_thread_setup(s->cpu, s->priority);
+	pfd[0].fd = s->timerfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = s->stopfd;
+	pfd[1].events = POLLIN;
+	for(;;){
+		if(poll(pfd, 2, -1) < 0) continue;
+		if(pfd[1].revents) break;
+		if(read(s->timerfd, &expirations, sizeof(expirations)) != sizeof(expirations))
+			continue;
+
+		now = co_monotonic();
+		next = UINT64_MAX;
+		count = 0;
+		/* The sends are cancellation points, never cancel with the lock held */
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel);
+		pthread_mutex_lock(&s->lock);
+		for(i = 0; i < s->count; ++i){
+			e = s->entries[i];
+			if(e->next <= now){
+				co_pdo_frame(bus, &frames[count], e->cob_id, e->data, e->len);
+				if(++count == CO_TX_BATCH){
+					co_bus_send_many(bus, frames, count);
+					count = 0;
+				}
+				e->sent++;
+				/* Keep the phase, skip the periods already missed */
+				e->next += e->period;
+				if(e->next <= now){
+					late = (now - e->next) / e->period + 1;
+					e->missed += late;
+					e->next += late * e->period;
+				}
+			}
+			if(e->next < next) next = e->next;
+		}
+		if(count > 0) co_bus_send_many(bus, frames, count);
+		pthread_mutex_unlock(&s->lock);
+		pthread_setcancelstate(cancel, NULL);
+		co_cyclic_arm(s, next);
+	}
+	return NULL;
+}
+
+int co_cyclic_thread_start(co_t_bus *bus) {
+	co_t_cyclic_sched *s = &bus->cyclic;
+
+	if(s->running) return 0;
+	s->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if(s->timerfd < 0) return -1;
+	s->stopfd = eventfd(0, EFD_CLOEXEC);
+	if(s->stopfd < 0){
+		close(s->timerfd);
+		return -1;
+	}
+	if(pthread_create(&s->thread, NULL, co_cyclic_thread, bus) != 0){
+		close(s->timerfd);
+		close(s->stopfd);
+		return -1;
+	}
+	s->running = true;
+	return 0;
+}
+
+void co_cyclic_thread_stop(co_t_bus *bus) {
+	co_t_cyclic_sched *s = &bus->cyclic;
+
+	if(!s->running) return;
+	if(co_thread_wake(s->stopfd) < 0)
+		pthread_cancel(s->thread);
+	pthread_join(s->thread, NULL);
+	close(s->timerfd);
+	close(s->stopfd);
+	s->running = false;
+}
+
+/* Add the entry, the thread sends it right away */
+int co_cyclic_add(co_t_bus *bus, co_t_cyclic *e) {
+	co_t_cyclic_sched *s = &bus->cyclic;
+	co_t_cyclic **entries;
+
+	if(co_cyclic_thread_start(bus) < 0) return -1;
+	pthread_mutex_lock(&s->lock);
+	entries = (co_t_cyclic **)realloc(s->entries, (s->count + 1) * sizeof(co_t_cyclic *));
+	if(entries == NULL){
+		pthread_mutex_unlock(&s->lock);
+		return -1;
+	}
+	s->entries = entries;
+	e->next = co_monotonic();
+	s->entries[s->count++] = e;
+	pthread_mutex_unlock(&s->lock);
+	co_cyclic_arm(s, e->next);
+	return 0;
+}
+
+/* Remove the cyclic PDO of the node (all of them with pdo_id < 0) */
+void co_cyclic_remove(co_t_node *con, int pdo_id) {
+	co_t_cyclic_sched *s = &con->bus->cyclic;
+	co_t_cyclic *removed[CO_MAX_CYCLIC], *e;
+	unsigned int i, n = 0;
+
+	pthread_mutex_lock(&s->lock);
+	for(i = 0; i < s->count; ){
+		e = s->entries[i];
+		if(e->con == con && (pdo_id < 0 || e->pdo_id == pdo_id)){
+			removed[n++] = e;
+			s->entries[i] = s->entries[--s->count];
+		}else{
+			++i;
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	/* The thread does not see them anymore */
+	for(i = 0; i < n; ++i){
+		napi_delete_reference(con->env, removed[i]->data_ref);
+		free(removed[i]);
+	}
+}
+
+//// Simulated Slave ///////////////////////////////////////////////////////////
+
+#define CO_SIM_BLKSIZE 127 /* Segments per block, block download */
+#define CO_SIM_DELAYED 1024 /* Answers waiting for the latency, power of 2 */
+
+uint16_t co_sdo_crc(uint16_t crc, const uint8_t *data, size_t len);
+
+/* Object of the dictionary of a simulated node id */
+typedef struct {
+	uint16_t index;
+	uint8_t  subindex;
+	uint32_t size;
+	uint8_t *data;
+} co_t_sim_object;
+
+/* State of the SDO server of a node id */
+typedef enum {
+	CO_SIM_IDLE=0,
+	CO_SIM_DOWNLOAD,           /* Segments */
+	CO_SIM_UPLOAD,
+	CO_SIM_BLOCK_DOWNLOAD,     /* Sub-block segments */
+	CO_SIM_BLOCK_DOWNLOAD_END,
+	CO_SIM_BLOCK_UPLOAD        /* Initiated, waiting for the start or an ack */
+} co_t_sim_mode;
+
+/* Dictionary and SDO server of a node id */
+typedef struct {
+	co_t_sim_object *objects;
+	unsigned int count;
+	co_t_sim_mode mode;
+	co_t_sim_object *object;
+	uint8_t *buffer;  /* Download in progress */
+	uint32_t size, pos, blkpos;
+	uint8_t toggle, seqno, blksize;
+	bool crc;
+} co_t_sim_server;
+
+/* Answer sent when its latency has elapsed */
+typedef struct {
+	uint64_t due; /* co_monotonic */
+	struct canfd_frame frame;
+} co_t_sim_delayed;
+
+struct co_s_sim {
+	co_t_sim_options o;
+	pthread_t thread;
+	int fd, stopfd;
+	unsigned int seed;
+	co_t_sim_server servers[CO_MAX_NODES];
+	/* The latency is the same for all the answers: the due times are in
+	   order, a FIFO (free running indexes) is enough */
+	co_t_sim_delayed delayed[CO_SIM_DELAYED];
+	uint32_t delayed_head, delayed_tail;
+	uint8_t state[CO_MAX_NODES]; /* NMT state, as in the heartbeat */
+	uint8_t toggle[CO_MAX_NODES]; /* Node guarding answers */
+	uint32_t tpdo_count;
+};
+
+co_t_sim_object *co_sim_object(co_t_sim_server *sv, uint16_t index, uint8_t subindex,
+		bool create) {
+	co_t_sim_object *obj;
+	unsigned int i;
+
+	for(i = 0; i < sv->count; ++i)
+		if(sv->objects[i].index == index && sv->objects[i].subindex == subindex)
+			return &sv->objects[i];
+	if(!create) return NULL;
+	obj = (co_t_sim_object *)realloc(sv->objects, (sv->count + 1) * sizeof(co_t_sim_object));
+	if(obj == NULL) return NULL;
+	sv->objects = obj;
+	obj = &sv->objects[sv->count++];
+	memset(obj, 0, sizeof(co_t_sim_object));
+	obj->index = index;
+	obj->subindex = subindex;
+	return obj;
+}
+
+/* Replace the value of an object, 0 or -1 */
+int co_sim_store(co_t_sim_object *obj, const void *data, uint32_t size) {
+	uint8_t *p = (uint8_t *)realloc(obj->data, size ? size : 1);
+	if(p == NULL) return -1;
+	memcpy(p, data, size);
+	obj->data = p;
+	obj->size = size;
+	return 0;
+}
+
+int co_sim_set(co_t_sim_server *sv, uint16_t index, uint8_t subindex, const void *data,
+		uint32_t size) {
+	co_t_sim_object *obj = co_sim_object(sv, index, subindex, true);
+	return obj == NULL ? -1 : co_sim_store(obj, data, size);
+}
+
+/* Send a frame to the master, dropped when its socket is full. The answers
+   are delayed by the latency, without blocking the other node ids. */
+void co_sim_send(co_t_sim *sim, canid_t can_id, const uint8_t *data, uint8_t len,
+		bool answer) {
+	struct canfd_frame frame, *f = &frame;
+	co_t_sim_delayed *dl;
+
+	if(sim->o.loss && (uint32_t)rand_r(&sim->seed) % 1000 < sim->o.loss) return;
+	if(answer && sim->o.latency){
+		if(sim->delayed_head - sim->delayed_tail >= CO_SIM_DELAYED) return; /* Lost */
+		dl = &sim->delayed[sim->delayed_head++ & (CO_SIM_DELAYED - 1)];
+		dl->due = co_monotonic() + (uint64_t)sim->o.latency * 1000;
+		f = &dl->frame;
+	}
+	memset(f, 0, sizeof(struct canfd_frame));
+	f->can_id = can_id;
+	f->len = len;
+	memcpy(f->data, data, len);
+	if(f == &frame) send(sim->fd, f, CAN_MTU, MSG_DONTWAIT);
+}
+
+/* Send the delayed answers that are due, the next due time or UINT64_MAX */
+uint64_t co_sim_send_delayed(co_t_sim *sim, uint64_t now) {
+	co_t_sim_delayed *dl;
+
+	while(sim->delayed_tail != sim->delayed_head){
+		dl = &sim->delayed[sim->delayed_tail & (CO_SIM_DELAYED - 1)];
+		if(dl->due > now) return dl->due;
+		send(sim->fd, &dl->frame, CAN_MTU, MSG_DONTWAIT);
+		sim->delayed_tail++;
+	}
+	return UINT64_MAX;
+}
+
+void co_sim_abort(co_t_sim *sim, unsigned int id, const co_t_sdo *req, uint32_t code) {
+	co_t_sdo r;
+
+	memset(&r, 0, sizeof(r));
+	r.header.bits.cs = CO_SCS_ABORT;
+	r.index = req->index;
+	r.subindex = req->subindex;
+	memcpy(r.data, &code, sizeof(code));
+	sim->servers[id].mode = CO_SIM_IDLE;
+	co_sim_send(sim, 0x580 + id, (uint8_t *)&r, sizeof(r), true);
+}
+
+/* Grow the download buffer, 0 or -1 */
+int co_sim_reserve(co_t_sim_server *sv, uint32_t size) {
+	uint8_t *p;
+	if(size <= sv->size) return 0;
+	p = (uint8_t *)realloc(sv->buffer, size);
+	if(p == NULL) return -1;
+	sv->buffer = p;
+	sv->size = size;
+	return 0;
+}
+
+/* Next sub-block of a block upload */
+void co_sim_block_segments(co_t_sim *sim, unsigned int id) {
+	co_t_sim_server *sv = &sim->servers[id];
+	co_t_sim_object *obj = sv->object;
+	uint8_t seg[8];
+	uint32_t len;
+	uint8_t seqno = 0;
+
+	sv->blkpos = sv->pos;
+	do {
+		len = obj->size - sv->pos > 7 ? 7 : obj->size - sv->pos;
+		memset(seg, 0, sizeof(seg));
+		seg[0] = ++seqno | (sv->pos + len == obj->size ? 0x80 : 0);
+		memcpy(&seg[1], &obj->data[sv->pos], len);
+		sv->pos += len;
+		co_sim_send(sim, 0x580 + id, seg, sizeof(seg), true);
+	} while(sv->pos < obj->size && seqno < sv->blksize);
+}
+
+/* SDO server: expedited, segmented and block transfers */
+void co_sim_sdo(co_t_sim *sim, unsigned int id, const uint8_t *data) {
+	co_t_sim_server *sv = &sim->servers[id];
+	const co_t_sdo *req = (const co_t_sdo *)data;
+	const co_t_sdo_segment *seg = (const co_t_sdo_segment *)data;
+	co_t_sdo r;
+	co_t_sdo_segment *rseg = (co_t_sdo_segment *)&r;
+	uint32_t len;
+	uint16_t crc;
+
+	/* Sub-block segments have no command specifier */
+	if(sv->mode == CO_SIM_BLOCK_DOWNLOAD){
+		if((data[0] & 0x7F) == sv->seqno + 1){
+			if(co_sim_reserve(sv, sv->pos + 7) < 0){
+				co_sim_abort(sim, id, req, CO_SDO_ABORT_MEMORY);
+				return;
+			}
+			memcpy(&sv->buffer[sv->pos], &data[1], 7);
+			sv->pos += 7;
+			sv->seqno++;
+			if(data[0] & 0x80) sv->mode = CO_SIM_BLOCK_DOWNLOAD_END;
+		}
+		if(data[0] & 0x80 || (data[0] & 0x7F) >= sv->blksize){
+			uint8_t ack[8] = { CO_SCS_BLOCK_DOWNLOAD << 5 | CO_SDO_BLOCK_ACK,
+				sv->seqno, sv->blksize };
+			sv->seqno = 0;
+			co_sim_send(sim, 0x580 + id, ack, sizeof(ack), true);
+		}
+		return;
+	}
+
+	memset(&r, 0, sizeof(r));
+	r.index = req->index;
+	r.subindex = req->subindex;
+	switch(req->header.bits.cs){
+	case CO_CCS_DOWNLOAD_INIT:
+		sv->object = co_sim_object(sv, req->index, req->subindex, true);
+		if(sv->object == NULL){
+			co_sim_abort(sim, id, req, CO_SDO_ABORT_MEMORY);
+			return;
+		}
+		if(req->header.bits.e){
+			len = req->header.bits.s ? 4 - req->header.bits.n : 4;
+			if(co_sim_store(sv->object, req->data, len) < 0){
+				co_sim_abort(sim, id, req, CO_SDO_ABORT_MEMORY);
+				return;
+			}
+			sv->mode = CO_SIM_IDLE;
+		}else{
+			sv->mode = CO_SIM_DOWNLOAD;
+			sv->pos = 0;
+			sv->toggle = 0;
+		}
+		r.header.bits.cs = CO_SCS_DOWNLOAD_INIT_RESPONSE;
+		break;
+	case CO_CCS_DOWNLOAD_SEGMENT:
+		if(sv->mode != CO_SIM_DOWNLOAD){
+			co_sim_abort(sim, id, req, CO_SDO_ABORT_CS);
+			return;
+		}
+		if(seg->header.bits.t != sv->toggle){
+			co_sim_abort(sim, id, req, CO_SDO_ABORT_TOGGLE);
+			return;
+		}
+		len = 7 - seg->header.bits.n;
+		if(co_sim_reserve(sv, sv->pos + len) < 0){
+			co_sim_abort(sim, id, req, CO_SDO_ABORT_MEMORY);
+			return;
+		}
+		memcpy(&sv->buffer[sv->pos], seg->data, len);
+		sv->pos += len;
+		if(seg->header.bits.c){
+			if(co_sim_store(sv->object, sv->buffer, sv->pos) < 0){
+				co_sim_abort(sim, id, req, CO_SDO_ABORT_MEMORY);
+				return;
+			}
+			sv->mode = CO_SIM_IDLE;
+		}
+		memset(&r, 0, sizeof(r));
+		rseg->header.bits.cs = CO_SCS_DOWNLOAD_SEGMENT_RESPONSE;
+		rseg->header.bits.t = sv->toggle;
+		sv->toggle ^= 1;
+		break;
+	case CO_CCS_UPLOAD_INIT:
+		sv->object = co_sim_object(sv, req->index, req->subindex, false);
+		if(sv->object == NULL){
+			co_sim_abort(sim, id, req, 0x06020000); /* Object does not exist */
+			return;
+		}
+		r.header.bits.cs = CO_SCS_UPLOAD_INIT_RESPONSE;
+		r.header.bits.s = 1;
+		if(sv->object->size <= 4){
+			r.header.bits.e = 1;
+			r.header.bits.n = 4 - sv->object->size;
+			memcpy(r.data, sv->object->data, sv->object->size);
+			sv->mode = CO_SIM_IDLE;
+		}else{
+			memcpy(r.data, &sv->object->size, sizeof(uint32_t));
+			sv->mode = CO_SIM_UPLOAD;
+			sv->pos = 0;
+			sv->toggle = 0;
+		}
+		break;
+	case CO_CCS_UPLOAD_SEGMENT:
+		if(sv->mode != CO_SIM_UPLOAD){
+			co_sim_abort(sim, id, req, CO_SDO_ABORT_CS);
+			return;
+		}
+		if(seg->header.bits.t != sv->toggle){
+			co_sim_abort(sim, id, req, CO_SDO_ABORT_TOGGLE);
+			return;
+		}
+		len = sv->object->size - sv->pos > 7 ? 7 : sv->object->size - sv->pos;
+		memset(&r, 0, sizeof(r));
+		rseg->header.bits.cs = CO_SCS_UPLOAD_SEGMENT_RESPONSE;
+		rseg->header.bits.t = sv->toggle;
+		rseg->header.bits.n = 7 - len;
+		memcpy(rseg->data, &sv->object->data[sv->pos], len);
+		sv->pos += len;
+		if(sv->pos == sv->object->size){
+			rseg->header.bits.c = 1;
+			sv->mode = CO_SIM_IDLE;
+		}
+		sv->toggle ^= 1;
+		break;
+	case CO_CCS_ABORT:
+		sv->mode = CO_SIM_IDLE;
+		return;
+	case CO_CCS_BLOCK_DOWNLOAD:
+		r.header.bits.cs = CO_SCS_BLOCK_DOWNLOAD;
+		if((data[0] & 1) == CO_SDO_BLOCK_INIT){
+			sv->object = co_sim_object(sv, req->index, req->subindex, true);
+			if(sv->object == NULL){
+				co_sim_abort(sim, id, req, CO_SDO_ABORT_MEMORY);
+				return;
+			}
+			sv->crc = (data[0] >> 2) & 1;
+			sv->pos = 0;
+			sv->seqno = 0;
+			sv->blksize = CO_SIM_BLKSIZE;
+			sv->mode = CO_SIM_BLOCK_DOWNLOAD;
+			r.header.byte |= 1 << 2; /* CRC supported */
+			r.data[0] = sv->blksize;
+		}else if(sv->mode == CO_SIM_BLOCK_DOWNLOAD_END){
+			/* Remove the padding of the last segment */
+			len = (data[0] >> 2) & 7;
+			if(len > sv->pos){
+				co_sim_abort(sim, id, req, CO_SDO_ABORT_LENGTH);
+				return;
+			}
+			sv->pos -= len;
+			memcpy(&crc, &data[1], sizeof(crc));
+			if(sv->crc && crc != co_sdo_crc(0, sv->buffer, sv->pos)){
+				co_sim_abort(sim, id, req, CO_SDO_ABORT_CRC);
+				return;
+			}
+			if(co_sim_store(sv->object, sv->buffer, sv->pos) < 0){
+				co_sim_abort(sim, id, req, CO_SDO_ABORT_MEMORY);
+				return;
+			}
+			sv->mode = CO_SIM_IDLE;
+			memset(&r, 0, sizeof(r));
+			r.header.byte = CO_SCS_BLOCK_DOWNLOAD << 5 | CO_SDO_BLOCK_END;
+		}else{
+			co_sim_abort(sim, id, req, CO_SDO_ABORT_CS);
+			return;
+		}
+		break;
+	case CO_CCS_BLOCK_UPLOAD:
+		switch(data[0] & 3){
+		case CO_SDO_BLOCK_INIT:
+			sv->object = co_sim_object(sv, req->index, req->subindex, false);
+			if(sv->object == NULL){
+				co_sim_abort(sim, id, req, 0x06020000);
+				return;
+			}
+			if(data[4] < 1 || data[4] > 127){
+				co_sim_abort(sim, id, req, CO_SDO_ABORT_BLKSIZE);
+				return;
+			}
+			sv->crc = (data[0] >> 2) & 1;
+			sv->blksize = data[4];
+			sv->pos = 0;
+			sv->mode = CO_SIM_BLOCK_UPLOAD;
+			r.header.byte = CO_SCS_BLOCK_UPLOAD << 5 | 1 << 2 | 1 << 1; /* CRC, size */
+			memcpy(r.data, &sv->object->size, sizeof(uint32_t));
+			break;
+		case CO_SDO_BLOCK_START:
+			if(sv->mode != CO_SIM_BLOCK_UPLOAD){
+				co_sim_abort(sim, id, req, CO_SDO_ABORT_CS);
+				return;
+			}
+			co_sim_block_segments(sim, id);
+			return;
+		case CO_SDO_BLOCK_ACK:
+			if(sv->mode != CO_SIM_BLOCK_UPLOAD || data[2] < 1 || data[2] > 127){
+				co_sim_abort(sim, id, req, CO_SDO_ABORT_CS);
+				return;
+			}
+			/* Resend from the last segment received by the master */
+			sv->pos = sv->blkpos + (uint32_t)data[1] * 7;
+			if(sv->pos > sv->object->size) sv->pos = sv->object->size;
+			sv->blksize = data[2];
+			if(sv->pos < sv->object->size){
+				co_sim_block_segments(sim, id);
+				return;
+			}
+			/* Everything is received, end the transfer */
+			len = sv->object->size % 7;
+			memset(&r, 0, sizeof(r));
+			r.header.byte = CO_SCS_BLOCK_UPLOAD << 5 | CO_SDO_BLOCK_END |
+				(len ? 7 - len : (sv->object->size ? 0 : 7)) << 2;
+			crc = sv->crc ? co_sdo_crc(0, sv->object->data, sv->object->size) : 0;
+			memcpy(&r.index, &crc, sizeof(crc));
+			break;
+		default: /* End confirmed by the master */
+			sv->mode = CO_SIM_IDLE;
+			return;
+		}
+		break;
+	default:
+		co_sim_abort(sim, id, req, CO_SDO_ABORT_CS);
+		return;
+	}
+	co_sim_send(sim, 0x580 + id, (uint8_t *)&r, sizeof(r), true);
+}
+
+/* NMT command to one or all the node ids */
+void co_sim_nmt(co_t_sim *sim, const uint8_t *data) {
+	uint8_t boot = CO_HB_BOOT;
+	unsigned int id;
+
+	for(id = 1; id <= sim->o.nodes; ++id){
+		if(data[1] != 0 && data[1] != id) continue;
+		sim->toggle[id] = 0;
+		switch(data[0]){
+		case CO_NMT_OPERATIONAL:     sim->state[id] = CO_HB_OPERATIONAL; break;
+		case CO_NMT_STOP:            sim->state[id] = CO_HB_STOPPED; break;
+		case CO_NMT_PRE_OPERATIONAL: sim->state[id] = CO_HB_PRE_OPERATIONAL; break;
+		default: /* Reset */
+			co_sim_send(sim, 0x700 + id, &boot, 1, false);
+			sim->state[id] = CO_HB_PRE_OPERATIONAL;
+			break;
+		}
+	}
+}
+
+void co_sim_recv(co_t_sim *sim, struct canfd_frame *frame) {
+	unsigned int id = frame->can_id & 0x7F;
+
+	if(frame->can_id == 0x000 && frame->len >= 2){
+		co_sim_nmt(sim, frame->data);
+	}else if(frame->can_id == ((0x700 + id) | CAN_RTR_FLAG) && id >= 1 && id <= sim->o.nodes){
+		/* Node guarding */
+		uint8_t state = sim->state[id] | sim->toggle[id];
+		sim->toggle[id] ^= 0x80;
+		co_sim_send(sim, 0x700 + id, &state, 1, true);
+	}else if((frame->can_id & 0x780) == 0x600 && id >= 1 && id <= sim->o.nodes &&
+			frame->len == 8 && sim->state[id] != CO_HB_STOPPED){
+		co_sim_sdo(sim, id, frame->data);
+	}
+}
+
+/* Answer the master, produce the heartbeats and TPDO */
+void *co_sim_thread(void *arg) {
+	co_t_sim *sim = (co_t_sim *)arg;
+	struct canfd_frame frame;
+	struct pollfd pfd[2];
+	struct timespec timeout;
+	uint64_t now, next, next_hb, next_tpdo, next_delayed = UINT64_MAX;
+	unsigned int id, n;
+	uint8_t data[4];
+
+	pfd[0].fd = sim->fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = sim->stopfd;
+	pfd[1].events = POLLIN;
+	now = co_monotonic();
+	next_hb = sim->o.heartbeat ? now : UINT64_MAX;
+	next_tpdo = sim->o.tpdo ? now + (uint64_t)sim->o.tpdo * 1000 : UINT64_MAX;
+	for(;;){
+		next = next_hb < next_tpdo ? next_hb : next_tpdo;
+		if(next_delayed < next) next = next_delayed;
+		now = co_monotonic();
+		if(next != UINT64_MAX){
+			next = next > now ? next - now : 0;
+			timeout.tv_sec = next / 1000000000;
+			timeout.tv_nsec = next % 1000000000;
+		}
+		if(ppoll(pfd, 2, next == UINT64_MAX ? NULL : &timeout, NULL) < 0) continue;
+		if(pfd[1].revents || pfd[0].revents & (POLLHUP | POLLERR)) break;
+
+		/* Requests of the master */
+		for(n = 0; n < 64 && recv(sim->fd, &frame, sizeof(frame), MSG_DONTWAIT) > 0; ++n)
+			co_sim_recv(sim, &frame);
+
+		now = co_monotonic();
+		if(now >= next_hb){
+			for(id = 1; id <= sim->o.nodes; ++id)
+				co_sim_send(sim, 0x700 + id, &sim->state[id], 1, false);
+			next_hb += (uint64_t)sim->o.heartbeat * 1000000;
+			if(next_hb < now) next_hb = now; /* Late, do not burst */
+		}
+		if(now >= next_tpdo){
+			memcpy(data, &sim->tpdo_count, sizeof(data));
+			sim->tpdo_count++;
+			for(id = 1; id <= sim->o.nodes; ++id)
+				if(sim->state[id] == CO_HB_OPERATIONAL)
+					co_sim_send(sim, 0x180 + id, data, sizeof(data), false);
+			next_tpdo += (uint64_t)sim->o.tpdo * 1000;
+			if(next_tpdo < now) next_tpdo = now;
+		}
+		next_delayed = co_sim_send_delayed(sim, co_monotonic());
+	}
+	return NULL;
+}
+
+/* Dictionary of a simulated node id, writable by SDO */
+int co_sim_dictionary(co_t_sim *sim, unsigned int id) {
+	co_t_sim_server *sv = &sim->servers[id];
+	const char name[] = "dcanopen simulated slave";
+	uint32_t device_type = 0x00000191, identity[4] = { 0, 0x53494D, 1, id };
+	uint16_t heartbeat = sim->o.heartbeat;
+	uint8_t count = 4, *domain;
+	unsigned int i;
+	int err = 0;
+
+	err |= co_sim_set(sv, 0x1000, 0, &device_type, sizeof(device_type));
+	err |= co_sim_set(sv, 0x1008, 0, name, sizeof(name) - 1);
+	err |= co_sim_set(sv, 0x1017, 0, &heartbeat, sizeof(heartbeat));
+	err |= co_sim_set(sv, 0x1018, 0, &count, sizeof(count));
+	for(i = 0; i < 4; ++i)
+		err |= co_sim_set(sv, 0x1018, i + 1, &identity[i], sizeof(uint32_t));
+
+	/* Domain for the segmented and block transfers */
+	domain = (uint8_t *)malloc(4096);
+	if(domain == NULL) return -1;
+	for(i = 0; i < 4096; ++i) domain[i] = i * 7;
+	err |= co_sim_set(sv, 0x2000, 0, domain, 4096);
+	free(domain);
+	return err;
+}
+
+void co_sim_free(co_t_sim *sim) {
+	co_t_sim_server *sv;
+	unsigned int i, id;
+
+	for(id = 0; id < CO_MAX_NODES; ++id){
+		sv = &sim->servers[id];
+		for(i = 0; i < sv->count; ++i) free(sv->objects[i].data);
+		free(sv->objects);
+		free(sv->buffer);
+	}
+	if(sim->stopfd >= 0) close(sim->stopfd);
+	if(sim->fd >= 0) close(sim->fd);
+	free(sim);
+}
+
+/* Serve the socket of the slaves, NULL on error (the socket is not closed) */
+co_t_sim *co_sim_start(int fd, co_t_sim_options *o) {
+	co_t_sim *sim = (co_t_sim *)calloc(1, sizeof(co_t_sim));
+	unsigned int id;
+	uint8_t boot = CO_HB_BOOT;
+
+	if(sim == NULL) return NULL;
+	sim->o = *o;
+	sim->fd = fd;
+	sim->seed = 1;
+	sim->stopfd = eventfd(0, EFD_CLOEXEC);
+	for(id = 1; id <= sim->o.nodes && sim->stopfd >= 0; ++id){
+		if(co_sim_dictionary(sim, id) < 0) break;
+	}
+	if(sim->stopfd < 0 || id <= sim->o.nodes){
+		sim->fd = -1;
+		co_sim_free(sim);
+		return NULL;
+	}
+
+	/* Boot-up, then pre-operational */
+	for(id = 1; id <= sim->o.nodes; ++id){
+		sim->state[id] = CO_HB_PRE_OPERATIONAL;
+		if(sim->o.heartbeat) co_sim_send(sim, 0x700 + id, &boot, 1, false);
+	}
+	if(pthread_create(&sim->thread, NULL, co_sim_thread, sim) != 0){
+		sim->fd = -1;
+		co_sim_free(sim);
+		return NULL;
+	}
+	return sim;
+}
+
+void co_sim_stop(co_t_sim *sim) {
+	if(sim == NULL) return;
+	if(co_thread_wake(sim->stopfd) < 0)
+		pthread_cancel(sim->thread);
+	pthread_join(sim->thread, NULL);
+	co_sim_free(sim);
+}
+
+//// uvlib callback ////////////////////////////////////////////////////////////
+/* Stop writing into the ring, javascript may still hold the ArrayBuffer */
+void co_pdo_ring_release(co_t_node *con){
+	if(con->ring == NULL) return;
+	napi_delete_reference(con->env, con->ring_ref);
+	if(con->ring_cb_ref != NULL){
+		napi_async_destroy(con->env, con->ring_cb_ctx);
+		napi_delete_reference(con->env, con->ring_cb_ref);
+		con->ring_cb_ref = NULL;
+	}
+	con->ring = NULL;
+}
+
+/* Stop writing into the process image, workers may still hold it */
+void co_image_release(co_t_node *con){
+	if(con->image == NULL) return;
+	napi_delete_reference(con->env, con->image_ref);
+	if(con->image_cb_ref != NULL){
+		napi_async_destroy(con->env, con->image_cb_ctx);
+		napi_delete_reference(con->env, con->image_cb_ref);
+		con->image_cb_ref = NULL;
+	}
+	con->image = NULL;
+	con->image_signal = 0;
+}
+
+void co_pdo_map_release(co_t_node *con, unsigned int dir, unsigned int id){
+	co_t_pdo_map *m = con->pdo_maps[dir][id];
+	if(m == NULL) return;
+	napi_delete_reference(con->env, m->table_ref);
+	free(m);
+	con->pdo_maps[dir][id] = NULL;
+}
+
+void co_stop_all_cb(co_t_node *con){
+	co_t_sdo_queue_item *i;
+	co_t_sdo_channel *ch;
+	unsigned int c;
+	/* Stop heartbeat */
+	uv_timer_stop(&con->hb_uvt);
+	if(con->hb_cb_ref != NULL){
+		napi_async_destroy(con->env, con->hb_cb_ctx);
+		napi_delete_reference(con->env, con->hb_cb_ref);
+		con->hb_cb_ref = NULL;
+	}
+	/* Stop EMCY */
+	if(con->emcy_cb_ref != NULL){
+		napi_async_destroy(con->env, con->emcy_cb_ctx);
+		napi_delete_reference(con->env, con->emcy_cb_ref);
+		con->emcy_cb_ref = NULL;
+	}
+	/* Stop SDO */
+	for(c = 0; c < con->sdo_nchannels; ++c){
+		ch = con->sdo_channels[c];
+		uv_timer_stop(&ch->uvt);
+		if(ch->busy){
+			co_sdo_item_release(con->env, &ch->item);
+			ch->busy = 0;
+		}
+	}
+	while((i = co_sdo_queue_pop(&con->sdo_queue)) != NULL)
+		co_sdo_item_release(con->env, i);
+	/* Stop PDO */
+	if(con->pdo_cb_ref != NULL){
+		napi_async_destroy(con->env, con->pdo_cb_ctx);
+		napi_delete_reference(con->env, con->pdo_cb_ref);
+		con->pdo_cb_ref = NULL;
+	}
+	co_pdo_ring_release(con);
+	co_image_release(con);
+	co_cyclic_remove(con, -1);
+	if(con->batch_cb_ref != NULL){
+		napi_async_destroy(con->env, con->batch_cb_ctx);
+		napi_delete_reference(con->env, con->batch_cb_ref);
+		con->batch_cb_ref = NULL;
+	}
+	con->batch_count = 0;
+	for(c = 0; c < 4; ++c){
+		co_pdo_map_release(con, CO_PDO_MAP_TX, c);
+		co_pdo_map_release(con, CO_PDO_MAP_RX, c);
+	}
+}
+
+void co_hb_timeout_cb(uv_timer_t* handle) {
+	co_t_node *con = (co_t_node *)handle->data;
+	napi_handle_scope nhs;
+	napi_status status;
+	napi_value argv[1], global, cb;
+
+	con->metrics.hb_timeouts++;
+	napi_open_handle_scope(con->env, &nhs);
+
+	/* Parameter error details */
+	status = napi_create_error_utf8(con->env, "Timeout HB Response", &argv[0]);
+	napi_assert_async(con->env, status, nhs);
+
+	/* Call the callback */
+	status = napi_get_global(con->env, &global);
+	napi_assert_async(con->env, status, nhs);
+	status = napi_get_reference_value(con->env, con->hb_cb_ref, &cb);
+	napi_assert_async(con->env, status, nhs);
+	status = napi_make_callback(con->env, con->hb_cb_ctx, global, cb, 1, argv, NULL);
+	napi_assert_async(con->env, status, nhs);
+
+	napi_close_handle_scope(con->env, nhs);
+}
+
+void co_image_hb_write(co_t_node *con, co_t_hb *d, uint64_t ts);
+
+void co_hb_recv_cb(co_t_node *con, co_t_hb *d, uint64_t ts) {
+	napi_status status;
+	napi_value argv[2], global, cb;
+
+	if(con->image != NULL) co_image_hb_write(con, d, ts);
+
+	/* No callback, do nothing. */
+	if(con->hb_cb_ref == NULL) return;	
+	uv_timer_stop(&con->hb_uvt);
+
+	if(con->hb_last_toggle_bit == d->bits.toggle_bit){
+		con->metrics.hb_toggle++;
+		/* Parameter error details */
+		status = napi_create_error_utf8(con->env, "Heartbeat bit has not toggle", &argv[0]);
+		napi_assert_cb(con->env, status);
+	}else{
+		/* 1. Parameter is the state */
+		status = napi_create_uint32(con->env, d->bits.state, &argv[0]);
+		napi_assert_cb(con->env, status);
+	}
+	con->hb_last_toggle_bit = d->bits.toggle_bit;
+
+	/* 2. Parameter is the receive timestamp */
+	status = napi_create_bigint_uint64(con->env, ts, &argv[1]);
+	napi_assert_cb(con->env, status);
+
+	/* Call the callback */
+	co_hist_record(&con->rx_latency, co_now() - ts);
+	status = napi_get_global(con->env, &global);
+	napi_assert_cb(con->env, status);
+	status = napi_get_reference_value(con->env, con->hb_cb_ref, &cb);
+	napi_assert_cb(con->env, status);
+	status = napi_make_callback(con->env, con->hb_cb_ctx, global, cb, 2, argv, NULL);
+	napi_assert_cb(con->env, status);
+}
+
+/* Remove the entry from its slot */
+void co_hb_unlink(co_t_hb_entry *e) {
+	if(e->pprev == NULL) return;
+	*e->pprev = e->next;
+	if(e->next != NULL) e->next->pprev = e->pprev;
+	e->next = NULL;
+	e->pprev = NULL;
+}
+
+/* Arm the deadline of the entry, one consumer time from now */
+void co_hb_schedule(co_t_bus *bus, co_t_hb_entry *e) {
+	co_t_hb_entry **slot;
+
+	co_hb_unlink(e);
+	if(e->timeout == 0 || !bus->hb.enabled) return;
+	/* From the loop time, the wheel may be late. Never early: round up */
+	e->deadline = uv_now(bus->hb.uvt.loop) / CO_HB_TICK +
+		(e->timeout + CO_HB_TICK - 1) / CO_HB_TICK + 1;
+	slot = &bus->hb.slots[e->deadline % CO_HB_WHEEL];
+	e->next = *slot;
+	if(e->next != NULL) e->next->pprev = &e->next;
+	e->pprev = slot;
+	*slot = e;
+}
+
+/* Callback of the consumer: node id, state or Error, timestamp */
+void co_hb_consumer_notify(co_t_bus *bus, unsigned int id, napi_value state,
+		uint64_t ts) {
+	napi_status status;
+	napi_value argv[3], global, cb;
+
+	/* 1. Parameter is the node id */
+	status = napi_create_uint32(bus->env, id, &argv[0]);
+	napi_assert_cb(bus->env, status);
+
+	/* 2. Parameter is the state, or the error */
+	argv[1] = state;
+
+	/* 3. Parameter is the timestamp */
+	status = napi_create_bigint_uint64(bus->env, ts, &argv[2]);
+	napi_assert_cb(bus->env, status);
+
+	/* Call the callback */
+	status = napi_get_global(bus->env, &global);
+	napi_assert_cb(bus->env, status);
+	status = napi_get_reference_value(bus->env, bus->hb.cb_ref, &cb);
+	napi_assert_cb(bus->env, status);
+	status = napi_make_callback(bus->env, bus->hb.cb_ctx, global, cb, 3, argv, NULL);
+	napi_assert_cb(bus->env, status);
+}
+
+/* Heartbeat of any node, javascript only sees the changes */
+void co_hb_consume(co_t_bus *bus, unsigned int id, co_t_hb *d, uint64_t ts) {
+	co_t_hb_entry *e = &bus->hb.entries[id];
+	napi_status status;
+	napi_value state;
+	bool changed;
+
+	if(!bus->hb.enabled) return;
+	changed = e->expired || e->state != d->bits.state;
+	e->state = d->bits.state;
+	e->expired = false;
+	co_hb_schedule(bus, e);
+	if(!changed) return;
+
+	status = napi_create_uint32(bus->env, e->state, &state);
+	napi_assert_cb(bus->env, status);
+	co_hb_consumer_notify(bus, id, state, ts);
+}
+
+/* One tick of the wheel, report the missed deadlines */
+void co_hb_tick_cb(uv_timer_t* handle) {
+	co_t_bus *bus = (co_t_bus *)handle->data;
+	co_t_hb_entry *e, *next;
+	napi_handle_scope nhs;
+	napi_status status;
+	napi_value err;
+	uint64_t now = uv_now(handle->loop) / CO_HB_TICK;
+	unsigned int n;
+
+	napi_open_handle_scope(bus->env, &nhs);
+	/* Catch up, at most one turn of the wheel */
+	if(now - bus->hb.tick > CO_HB_WHEEL) bus->hb.tick = now - CO_HB_WHEEL;
+	while(bus->hb.tick < now && bus->hb.enabled){
+		bus->hb.tick++;
+		for(e = bus->hb.slots[bus->hb.tick % CO_HB_WHEEL]; e != NULL; e = next){
+			next = e->next;
+			if(e->deadline > bus->hb.tick) continue; /* Next turn */
+			co_hb_unlink(e);
+			e->expired = true;
+			n = e - bus->hb.entries;
+			status = napi_create_error_utf8(bus->env, "Heartbeat timeout", &err);
+			napi_assert_async(bus->env, status, nhs);
+			co_hb_consumer_notify(bus, n, err, co_now());
+		}
+	}
+	napi_close_handle_scope(bus->env, nhs);
+}
+
+/* Stop consuming, forget the deadlines */
+void co_hb_consumer_release(co_t_bus *bus) {
+	unsigned int i;
+
+	if(!bus->hb.enabled) return;
+	uv_timer_stop(&bus->hb.uvt);
+	for(i = 0; i < CO_MAX_NODES; ++i){
+		co_hb_unlink(&bus->hb.entries[i]);
+		bus->hb.entries[i].state = CO_HB_UNKNOWN;
+		bus->hb.entries[i].expired = false;
+	}
+	napi_async_destroy(bus->env, bus->hb.cb_ctx);
+	napi_delete_reference(bus->env, bus->hb.cb_ref);
+	bus->hb.enabled = false;
+}
+
+void co_sdo_dispatch(co_t_node *con);
+
+/* Get a free queue item with the common CANopen data, NULL if out of memory */
+co_t_sdo_queue_item *co_sdo_push(co_t_node *con, uint32_t index, uint32_t subindex) {
+	co_t_sdo_queue_item *i = co_sdo_queue_push(&con->sdo_queue);
+	if(i == NULL) return NULL;
+	con->metrics.sdo_requests++;
+	if(co_sdo_queue_size(&con->sdo_queue) > con->metrics.sdo_queue_high)
+		con->metrics.sdo_queue_high = co_sdo_queue_size(&con->sdo_queue);
+	memset(i, 0, sizeof(co_t_sdo_queue_item));
+	i->cf.can_id = 0x600+con->node_id;
+	i->cf.len = sizeof(co_t_sdo);
+	i->index = index;
+	i->subindex = subindex;
+	return i;
+}
+
+/* Queue the next entry of the script, -1 if out of memory */
+int co_sdo_script_push(co_t_node *con, co_t_sdo_script *sc) {
+	co_t_sdo_script_entry *e = &sc->entries[sc->next];
+	co_t_sdo_queue_item *i;
+
+	i = co_sdo_push(con, e->index, e->subindex);
+	if(i == NULL) return -1;
+	i->completion = CO_SDO_SCRIPT;
+	i->script = sc;
+	i->step = sc->next++;
+	i->type = e->type;
+	if(e->op == CO_SDO_OP_READ){
+		i->data = i->value;
+		i->size = sizeof(i->value);
+		i->borrowed = 1;
+		co_sdo_init_upload(i);
+	}else{
+		memcpy(i->value, e->value, sizeof(i->value));
+		co_sdo_init_download(i, i->value, co_sdo_type_size[e->type]);
+		if(i->transfer == CO_SDO_SEGMENTED){
+			i->data = i->value;
+			i->size = co_sdo_type_size[e->type];
+		}
+	}
+	return 0;
+}
+
+/* Settle a promise, the continuations run when the scope closes */
+napi_status co_promise_settle(napi_env env, napi_async_context ctx,
+		napi_deferred deferred, napi_value value, bool reject) {
+	napi_status status;
+	napi_callback_scope scope;
+	napi_value global;
+
+	status = napi_get_global(env, &global);
+	if(status != napi_ok) return status;
+	status = napi_open_callback_scope(env, global, ctx, &scope);
+	if(status != napi_ok) return status;
+	if(reject)
+		status = napi_reject_deferred(env, deferred, value);
+	else
+		status = napi_resolve_deferred(env, deferred, value);
+	napi_close_callback_scope(env, scope);
+	return status;
+}
+
+napi_status co_sdo_settle(co_t_node *con, napi_deferred deferred,
+		napi_value value, bool reject) {
+	return co_promise_settle(con->env, con->sdo_promise_ctx, deferred, value, reject);
+}
+
+/* Release the item of the channel and hand the channel to the next request */
+void co_sdo_finish(co_t_sdo_channel *ch) {
+	co_sdo_item_release(ch->con->env, &ch->item);
+	ch->busy = 0;
+	co_sdo_dispatch(ch->con);
+}
+
+/* Store the result of the script entry, then queue the next one */
+void co_sdo_script_done(co_t_sdo_channel *ch, uint32_t code) {
+	co_t_node *con = ch->con;
+	co_t_sdo_queue_item *i = &ch->item;
+	co_t_sdo_script *sc = i->script;
+	co_t_sdo_script_result *r = &sc->results[i->step];
+	napi_status status;
+	napi_value result;
+
+	r->status = code;
+	if(code == 0 && i->upload){
+		r->length = i->pos;
+		memcpy(r->value, i->value, sizeof(r->value));
+	}
+	i->script = NULL;
+
+	/* Next entry, unless an error stops the script */
+	if(sc->next < sc->count && (code == 0 || (sc->flags & CO_SDO_CONTINUE)) &&
+			co_sdo_script_push(con, sc) == 0){
+		co_sdo_finish(ch);
+		return;
+	}
+	co_sdo_finish(ch);
+
+	/* End of the script, the entries not executed keep their status */
+	status = napi_get_reference_value(con->env, sc->results_ref, &result);
+	if(status == napi_ok)
+		status = co_sdo_settle(con, sc->deferred, result, false);
+	co_sdo_script_free(con->env, sc);
+	napi_assert_cb(con->env, status);
+}
+
+/* CRC-16-CCITT (polynomial 0x1021) used by the block transfers */
+uint16_t co_sdo_crc(uint16_t crc, const uint8_t *data, size_t len) {
+	unsigned int b;
+	while(len--){
+		crc ^= (uint16_t)(*data++) << 8;
+		for(b = 0; b < 8; ++b)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
+/* Send an abort to the node (the transfer is over for the master) */
+void co_sdo_send_abort(co_t_sdo_channel *ch, uint32_t code) {
+	co_t_sdo_queue_item *i = &ch->item;
+	struct canfd_frame frame;
+	co_t_sdo *s = (co_t_sdo *)frame.data;
+
+	frame.can_id = i->cf.can_id;
+	frame.flags = 0;
+	s->header.byte = 0;
+	s->header.bits.cs = CO_CCS_ABORT;
+	s->index = i->index;
+	s->subindex = i->subindex;
+	memcpy(s->data, &code, sizeof(code));
+	frame.len = sizeof(co_t_sdo);
+	co_bus_send(ch->con->bus, &frame);
+}
+
+/* Grow the upload buffer */
+int co_sdo_reserve(co_t_sdo_queue_item *i, size_t size) {
+	uint8_t *p;
+	if(size <= i->size) return 0;
+	if(i->borrowed) return -1; /* Caller buffer too small */
+	p = (uint8_t *)realloc(i->data, size);
+	if(p == NULL) return -1;
+	i->data = p;
+	i->size = size;
+	return 0;
+}
+
+/* Append received bytes to the upload buffer */
+int co_sdo_append(co_t_sdo_queue_item *i, const uint8_t *data, size_t len) {
+	size_t size;
+	if(i->pos + len > i->size){
+		size = i->size ? i->size : 64;
+		while(size < i->pos + len) size *= 2;
+		if(co_sdo_reserve(i, size) < 0) return -1;
+	}
+	memcpy(&i->data[i->pos], data, len);
+	i->pos += len;
+	return 0;
+}
+
+/* Call the callback of the current SDO, then send the next one */
+void co_sdo_done(co_t_sdo_channel *ch, napi_value result) {
+	co_t_node *con = ch->con;
+	co_t_sdo_queue_item *i = &ch->item;
+	unsigned int generation = ch->generation;
+	napi_status status;
+	napi_value argv[2], global, cb;
+	napi_deferred deferred;
+	size_t argc = 1;
+	bool is_error;
+
+	if(ch->rx_ts != 0)
+		co_hist_record(&con->rx_latency, co_now() - ch->rx_ts);
+
+	if(i->completion == CO_SDO_PROMISE){
+		/* The continuations may stop the node, do not cancel it twice */
+		deferred = i->deferred;
+		i->deferred = NULL;
+		status = napi_is_error(con->env, result, &is_error);
+		if(status == napi_ok)
+			status = co_sdo_settle(con, deferred, result, is_error);
+		napi_assert_cb(con->env, status);
+	}else{
+		/* 1. Parameter is the result */
+		argv[0] = result;
+
+		/* 2. Parameter is the timestamp of the last response (none on timeout) */
+		if(ch->rx_ts != 0){
+			status = napi_create_bigint_uint64(con->env, ch->rx_ts, &argv[argc++]);
+			napi_assert_cb(con->env, status);
+		}
+
+		/* Call the callback */
+		status = napi_get_global(con->env, &global);
+		napi_assert_cb(con->env, status);
+		status = napi_get_reference_value(con->env, i->cb_ref, &cb);
+		napi_assert_cb(con->env, status);
+		status = napi_make_callback(con->env, i->cb_ctx, global, cb, argc, argv, NULL);
+		napi_assert_cb(con->env, status);
+	}
+
+	/* The callback may have stopped the node (and released the channel) */
+	if(!ch->busy || ch->generation != generation) return;
+
+	/* Delete the callback, we will never use the callback again.
+	   Maybe in the javascript callback, there is an indirect call to
+	   co_sdo_queue_push (through sdo_upload or sdo_download functions).
+	   That's why we cannot free the channel before the callback is finished.*/
+	co_sdo_finish(ch);
+}
+
+/* Finish the current SDO with an error (abort code for the scripts) */
+void co_sdo_error(co_t_sdo_channel *ch, uint32_t code, const char *msg) {
+	co_t_node *con = ch->con;
+	napi_status status;
+	napi_value error;
+	if(ch->item.completion == CO_SDO_SCRIPT){
+		co_sdo_script_done(ch, code);
+		return;
+	}
+	status = napi_create_error_utf8(con->env, msg, &error);
+	napi_assert_cb(con->env, status);
+	co_sdo_done(ch, error);
+}
+
+/* Abort the current SDO on both sides */
+void co_sdo_abort(co_t_sdo_channel *ch, uint32_t code) {
+	char msg[32];
+	co_sdo_send_abort(ch, code);
+	snprintf(msg, sizeof(msg), "SDO abort 0x%08X", code);
+	co_sdo_error(ch, code, msg);
+}
+
+/* Finish the current SDO successfully */
+void co_sdo_success(co_t_sdo_channel *ch) {
+	co_t_node *con = ch->con;
+	co_t_sdo_queue_item *i = &ch->item;
+	napi_status status;
+	napi_value result;
+	void *jsdata;
+
+	if(i->completion == CO_SDO_SCRIPT){
+		co_sdo_script_done(ch, 0);
+		return;
+	}
+	if(i->upload && i->type != CO_SDO_TYPE_ARRAY){
+		status = co_sdo_decode(con->env, i->type, i->data, i->pos, &result);
+	}else if(i->upload && i->borrowed){
+		/* In the buffer of the caller */
+		status = napi_create_uint32(con->env, i->pos, &result);
+	}else if(i->upload){
+		/* Hand the buffer over to javascript, no copy */
+		if(i->pos == 0){
+			status = napi_create_arraybuffer(con->env, 0, &jsdata, &result);
+		}else{
+			status = napi_create_external_arraybuffer(con->env, i->data, i->pos,
+				co_free_arraybuffer, NULL, &result);
+			if(status == napi_ok) i->data = NULL;
+		}
+	}else if(i->completion == CO_SDO_PROMISE){
+		status = napi_get_undefined(con->env, &result);
+	}else{
+		status = napi_create_uint32(con->env, i->pos, &result);
+	}
+	napi_assert_cb(con->env, status);
+	co_sdo_done(ch, result);
+}
+
+void co_sdo_timeout_cb(uv_timer_t* handle) {
+	co_t_sdo_channel *ch = (co_t_sdo_channel *)handle->data;
+	co_t_node *con = ch->con;
+	napi_handle_scope nhs;
+
+	if(!ch->busy) return;
+	napi_open_handle_scope(con->env, &nhs);
+
+	/* Tell the node, if it was in the middle of a transfer */
+	if(ch->item.transfer != CO_SDO_EXPEDITED)
+		co_sdo_send_abort(ch, CO_SDO_ABORT_TIMEOUT);
+	con->metrics.sdo_timeouts++;
+	co_sdo_error(ch, CO_SDO_ABORT_TIMEOUT, "Timeout SDO Response");
+
+	napi_close_handle_scope(con->env, nhs);
+}
+
+/* Send the current frame of the channel and wait for the response */
+void co_sdo_emit(co_t_sdo_channel *ch) {
+	co_t_node *con = ch->con;
+	ch->tx_ts = co_now();
+	if(co_bus_send(con->bus, &ch->item.cf) < 0)
+		napi_throw_error(con->env, NULL, "Cannot write socket");
+	uv_timer_start(&ch->uvt, co_sdo_timeout_cb, con->sdo_wait_time, 0);
+}
+
+/* Hand the queued requests over to the free channels */
+void co_sdo_dispatch(co_t_node *con) {
+	co_t_sdo_channel *ch;
+	co_t_sdo_queue_item *i;
+	unsigned int c;
+
+	for(c = 0; c < con->sdo_nchannels; ++c){
+		ch = con->sdo_channels[c];
+		if(ch->busy) continue;
+		i = co_sdo_queue_pop(&con->sdo_queue);
+		if(i == NULL) return;
+		ch->item = *i;
+		if(i->data == i->value) ch->item.data = ch->item.value;
+		ch->item.cf.can_id = ch->cob_tx;
+		ch->busy = 1;
+		ch->generation++;
+		ch->rx_ts = 0;
+		co_sdo_emit(ch);
+	}
+}
+
+/* Next segment of a segmented transfer */
+void co_sdo_emit_segment(co_t_sdo_channel *ch) {
+	co_t_sdo_queue_item *i = &ch->item;
+	co_t_sdo_segment *seg = (co_t_sdo_segment *)i->cf.data;
+	size_t len;
+
+	seg->header.byte = 0;
+	seg->header.bits.t = i->toggle;
+	if(i->upload){
+		seg->header.bits.cs = CO_CCS_UPLOAD_SEGMENT;
+		memset(seg->data, 0, sizeof(seg->data));
+		i->expected_scs = CO_SCS_UPLOAD_SEGMENT_RESPONSE;
+	}else{
+		len = i->size - i->pos;
+		if(len > sizeof(seg->data)) len = sizeof(seg->data);
+		seg->header.bits.cs = CO_CCS_DOWNLOAD_SEGMENT;
+		seg->header.bits.n = sizeof(seg->data) - len;
+		seg->header.bits.c = (i->pos + len == i->size);
+		memcpy(seg->data, &i->data[i->pos], len);
+		memset(&seg->data[len], 0, sizeof(seg->data) - len);
+		i->expected_scs = CO_SCS_DOWNLOAD_SEGMENT_RESPONSE;
+	}
+	i->cf.len = 8;
+	co_sdo_emit(ch);
+}
+
+/* Send a whole sub-block of a block download */
+void co_sdo_emit_block(co_t_sdo_channel *ch) {
+	co_t_node *con = ch->con;
+	co_t_sdo_queue_item *i = &ch->item;
+	struct canfd_frame frames[CO_TX_BATCH];
+	co_t_sdo_block_segment *seg;
+	unsigned int count = 0;
+	size_t len;
+
+	i->blkpos = i->pos;
+	i->seqno = 0;
+	do {
+		seg = (co_t_sdo_block_segment *)frames[count].data;
+		len = i->size - i->pos;
+		if(len > sizeof(seg->data)) len = sizeof(seg->data);
+		frames[count].can_id = i->cf.can_id;
+		frames[count].flags = 0;
+		frames[count].len = 8;
+		seg->header.bits.seqno = ++i->seqno;
+		seg->header.bits.c = (i->pos + len == i->size);
+		memcpy(seg->data, &i->data[i->pos], len);
+		memset(&seg->data[len], 0, sizeof(seg->data) - len);
+		i->pos += len;
+		i->last = seg->header.bits.c;
+
+		/* Flush, if the batch is full */
+		if(++count == CO_TX_BATCH){
+			co_bus_send_many(con->bus, frames, count);
+			count = 0;
+		}
+	} while(!i->last && i->seqno < i->blksize);
+	ch->tx_ts = co_now();
+	if(count > 0) co_bus_send_many(con->bus, frames, count);
+
+	/* Wait for the acknowledge */
+	i->expected_scs = CO_SCS_BLOCK_DOWNLOAD;
+	uv_timer_start(&ch->uvt, co_sdo_timeout_cb, con->sdo_wait_time, 0);
+}
+
+/* Block upload: a segment of the sub-block (no command specifier) */
+void co_sdo_block_upload_segment(co_t_sdo_channel *ch,
+		co_t_sdo_block_segment *seg) {
+	co_t_node *con = ch->con;
+	co_t_sdo_queue_item *i = &ch->item;
+	co_t_sdo_block *b = (co_t_sdo_block *)i->cf.data;
+
+	/* Keep only the segments in sequence */
+	if(seg->header.bits.seqno == i->seqno+1){
+		if(co_sdo_append(i, seg->data, sizeof(seg->data)) < 0){
+			co_sdo_abort(ch, CO_SDO_ABORT_MEMORY);
+			return;
+		}
+		i->seqno++;
+		i->last = seg->header.bits.c;
+	}
+
+	/* End of the sub-block, acknowledge it */
+	if(seg->header.bits.c || seg->header.bits.seqno >= i->blksize){
+		b->header.byte = 0;
+		b->header.bits.cs = CO_CCS_BLOCK_UPLOAD;
+		b->header.bits.ss = CO_SDO_BLOCK_ACK;
+		memset(b->data, 0, sizeof(b->data));
+		b->data[0] = i->seqno;
+		b->data[1] = i->blksize;
+		i->seqno = 0;
+		if(i->last) i->expected_scs = CO_SCS_BLOCK_UPLOAD;
+		co_sdo_emit(ch);
+	}else{
+		uv_timer_start(&ch->uvt, co_sdo_timeout_cb, con->sdo_wait_time, 0);
+	}
+}
+
+void co_sdo_recv_cb(co_t_sdo_channel *ch, co_t_sdo *s, uint64_t ts) {
+	co_t_node *con = ch->con;
+	co_t_sdo_queue_item *i = &ch->item;
+	co_t_sdo_segment *seg = (co_t_sdo_segment *)s;
+	co_t_sdo_block *b = (co_t_sdo_block *)s;
+	co_t_sdo_block *req;
+	napi_status status;
+	napi_value result;
+	void *jsdata;
+	size_t jslen;
+	uint32_t size, code;
+	uint16_t crc;
+
+	/* We receive a SDO: stop timer and send the next SDO */
+	if(!ch->busy){
+		con->metrics.sdo_unexpected++;
+		return;
+	}
+	uv_timer_stop(&ch->uvt);
+	ch->rx_ts = ts;
+	if(ch->tx_ts != 0){
+		co_hist_record(&con->sdo_latency, ts - ch->tx_ts);
+		ch->tx_ts = 0;
+	}
+
+	/* Block upload: segments have no command specifier */
+	if(i->transfer == CO_SDO_BLOCK && i->upload &&
+			i->expected_scs == CO_SCS_UPLOAD_SEGMENT_RESPONSE &&
+			s->header.byte != (CO_SCS_ABORT << 5)){
+		co_sdo_block_upload_segment(ch, (co_t_sdo_block_segment *)s);
+		return;
+	}
+
+	/* The node aborts the transfer */
+	if(s->header.bits.cs == CO_SCS_ABORT){
+		char msg[32];
+		memcpy(&code, s->data, sizeof(code));
+		snprintf(msg, sizeof(msg), "SDO abort 0x%08X", code);
+		con->metrics.sdo_aborts++;
+		co_sdo_error(ch, code, msg);
+		return;
+	}
+
+	/* Check the type of SDO */
+	if(s->header.bits.cs != i->expected_scs) {
+		con->metrics.sdo_unexpected++;
+		if(i->transfer != CO_SDO_EXPEDITED)
+			co_sdo_send_abort(ch, CO_SDO_ABORT_CS);
+		co_sdo_error(ch, CO_SDO_ABORT_CS, "Unexpected SDO response");
+		return;
+	}
+
+	switch(s->header.bits.cs){
+	/* Expedited or segmented download */
+	case CO_SCS_DOWNLOAD_INIT_RESPONSE:
+		if(i->transfer == CO_SDO_SEGMENTED){
+			co_sdo_emit_segment(ch);
+			return;
+		}
+		if(i->completion != CO_SDO_CALLBACK){
+			co_sdo_success(ch);
+			return;
+		}
+		/* Set the data */
+		jslen = 4-s->header.bits.n;
+		status = napi_create_arraybuffer(con->env, jslen, &jsdata, &result);
+		napi_assert_cb(con->env, status);
+		memcpy(jsdata, s->data, jslen);
+		co_sdo_done(ch, result);
+		return;
+
+	case CO_SCS_DOWNLOAD_SEGMENT_RESPONSE:
+		if(seg->header.bits.t != i->toggle){
+			co_sdo_abort(ch, CO_SDO_ABORT_TOGGLE);
+			return;
+		}
+		jslen = i->size - i->pos;
+		i->pos += jslen > sizeof(seg->data) ? sizeof(seg->data) : jslen;
+		if(i->pos == i->size){
+			co_sdo_success(ch);
+			return;
+		}
+		i->toggle ^= 1;
+		co_sdo_emit_segment(ch);
+		return;
+
+	/* Expedited or segmented upload */
+	case CO_SCS_UPLOAD_INIT_RESPONSE:
+		if(s->header.bits.e == 1){
+			/* Expedited, size may be unspecified */
+			jslen = s->header.bits.s ? 4-s->header.bits.n : 4;
+			if(i->borrowed){
+				/* Typed value or buffer of the caller */
+				if(jslen > i->size){
+					co_sdo_error(ch, CO_SDO_ABORT_MEMORY, "SDO buffer too small");
+					return;
+				}
+				memcpy(i->data, s->data, jslen);
+				i->pos = jslen;
+				co_sdo_success(ch);
+				return;
+			}
+			status = napi_create_arraybuffer(con->env, jslen, &jsdata, &result);
+			napi_assert_cb(con->env, status);
+			memcpy(jsdata, s->data, jslen);
+			co_sdo_done(ch, result);
+			return;
+		}
+		/* Segmented, preallocate the buffer if the size is known */
+		if(s->header.bits.s == 1){
+			memcpy(&size, s->data, sizeof(size));
+			if(co_sdo_reserve(i, size) < 0){
+				co_sdo_abort(ch, CO_SDO_ABORT_MEMORY);
+				return;
+			}
+		}
+		i->transfer = CO_SDO_SEGMENTED;
+		i->toggle = 0;
+		co_sdo_emit_segment(ch);
+		return;
+
+	case CO_SCS_UPLOAD_SEGMENT_RESPONSE:
+		if(seg->header.bits.t != i->toggle){
+			co_sdo_abort(ch, CO_SDO_ABORT_TOGGLE);
+			return;
+		}
+		if(co_sdo_append(i, seg->data, sizeof(seg->data) - seg->header.bits.n) < 0){
+			co_sdo_abort(ch, CO_SDO_ABORT_MEMORY);
+			return;
+		}
+		if(seg->header.bits.c){
+			co_sdo_success(ch);
+			return;
+		}
+		i->toggle ^= 1;
+		co_sdo_emit_segment(ch);
+		return;
+
+	/* Block download */
+	case CO_SCS_BLOCK_DOWNLOAD:
+		if(b->header.bits.ss == CO_SDO_BLOCK_INIT){
+			i->crc = (b->header.byte >> 2) & 1;
+			i->blksize = b->data[3];
+			if(i->blksize < 1 || i->blksize > 127){
+				co_sdo_abort(ch, CO_SDO_ABORT_BLKSIZE);
+				return;
+			}
+			i->pos = 0;
+			co_sdo_emit_block(ch);
+		}else if(b->header.bits.ss == CO_SDO_BLOCK_ACK){
+			/* Resend from the last segment received by the node */
+			if(b->data[0] > i->seqno){
+				co_sdo_abort(ch, CO_SDO_ABORT_SEQNO);
+				return;
+			}
+			if(b->data[0] < i->seqno){
+				i->pos = i->blkpos + (size_t)b->data[0] * 7;
+				i->last = 0;
+			}
+			i->blksize = b->data[1];
+			if(i->blksize < 1 || i->blksize > 127){
+				co_sdo_abort(ch, CO_SDO_ABORT_BLKSIZE);
+				return;
+			}
+			if(!i->last){
+				co_sdo_emit_block(ch);
+				return;
+			}
+			/* Everything is sent, end the transfer */
+			req = (co_t_sdo_block *)i->cf.data;
+			req->header.byte = 0;
+			req->header.bits.cs = CO_CCS_BLOCK_DOWNLOAD;
+			req->header.bits.ss = CO_SDO_BLOCK_END;
+			req->header.bits.n = i->size % 7 ? 7 - i->size % 7 : (i->size ? 0 : 7);
+			memset(req->data, 0, sizeof(req->data));
+			crc = i->crc ? co_sdo_crc(0, i->data, i->size) : 0;
+			memcpy(req->data, &crc, sizeof(crc));
+			co_sdo_emit(ch);
+		}else if(b->header.bits.ss == CO_SDO_BLOCK_END){
+			co_sdo_success(ch);
+		}else{
+			co_sdo_abort(ch, CO_SDO_ABORT_CS);
+		}
+		return;
+
+	/* Block upload */
+	case CO_SCS_BLOCK_UPLOAD:
+		req = (co_t_sdo_block *)i->cf.data;
+		if((b->header.byte & 1) == CO_SDO_BLOCK_INIT && !i->last){
+			i->crc = (b->header.byte >> 2) & 1;
+			/* Preallocate the buffer if the size is known */
+			if(b->header.byte & 2){
+				memcpy(&size, &b->data[3], sizeof(size));
+				if(co_sdo_reserve(i, (size_t)size + 7) < 0){
+					co_sdo_abort(ch, CO_SDO_ABORT_MEMORY);
+					return;
+				}
+			}
+			/* Start the transfer */
+			req->header.byte = 0;
+			req->header.bits.cs = CO_CCS_BLOCK_UPLOAD;
+			req->header.bits.ss = CO_SDO_BLOCK_START;
+			memset(req->data, 0, sizeof(req->data));
+			i->seqno = 0;
+			i->expected_scs = CO_SCS_UPLOAD_SEGMENT_RESPONSE;
+			ch->tx_ts = co_now();
+			co_bus_send(con->bus, &i->cf);
+			uv_timer_start(&ch->uvt, co_sdo_timeout_cb, con->sdo_wait_time, 0);
+		}else if((b->header.byte & 3) == CO_SDO_BLOCK_END && i->last){
+			/* Remove the padding of the last segment */
+			if(b->header.bits.n > i->pos){
+				co_sdo_abort(ch, CO_SDO_ABORT_LENGTH);
+				return;
+			}
+			i->pos -= b->header.bits.n;
+			memcpy(&crc, b->data, sizeof(crc));
+			if(i->crc && crc != co_sdo_crc(0, i->data, i->pos)){
+				co_sdo_abort(ch, CO_SDO_ABORT_CRC);
+				return;
+			}
+			/* Confirm the end, the node does not answer */
+			req->header.byte = 0;
+			req->header.bits.cs = CO_CCS_BLOCK_UPLOAD;
+			req->header.bits.ss = CO_SDO_BLOCK_END;
+			memset(req->data, 0, sizeof(req->data));
+			co_bus_send(con->bus, &i->cf);
+			co_sdo_success(ch);
+		}else{
+			co_sdo_abort(ch, CO_SDO_ABORT_CS);
+		}
+		return;
+	}
+}
+
+/* Call co_bus_flush for this node at the end of the receive batch */
+void co_bus_defer(co_t_bus *bus, co_t_node *con) {
+	if(con->flush_pending) return;
+	con->flush_pending = 1;
+	con->flush_next = bus->flush_list;
+	bus->flush_list = con;
+}
+
+/* Write the PDO into the ring, javascript is signaled later */
+void co_pdo_ring_write(co_t_node *con, co_t_pdo_id id, co_t_pdo *p, size_t len,
+		uint64_t ts, uint32_t cycle) {
+	co_t_pdo_ring *r = con->ring;
+	co_t_pdo_ring_slot *slot;
+
+	if(r->head - r->tail >= r->slots){
+		r->dropped++;
+		return;
+	}
+	slot = &((co_t_pdo_ring_slot *)(r + 1))[r->head & (r->slots - 1)];
+	slot->timestamp = ts;
+	slot->cob_id = (0x180+0x100*id) | con->node_id;
+	slot->dlc = len;
+	slot->pdo_id = id;
+	slot->sync_cycle = cycle;
+	memcpy(slot->data, p->data, len);
+	memset(&slot->data[len], 0, sizeof(slot->data) - len);
+	r->head++;
+
+	con->ring_signal = 1;
+	co_bus_defer(con->bus, con);
+}
+
+void co_pdo_ring_notify(co_t_node *con) {
+	napi_status status;
+	napi_value argv[1], global, cb;
+
+	co_t_pdo_ring_slot *slots;
+	uint32_t s;
+
+	con->ring_signal = 0;
+	if(con->ring == NULL || con->ring_cb_ref == NULL) return;
+
+	/* Latency of the frames written since the last signal */
+	slots = (co_t_pdo_ring_slot *)(con->ring + 1);
+	if(con->ring->head - con->ring_notified > con->ring->slots)
+		con->ring_notified = con->ring->head - con->ring->slots; /* Header moved by javascript */
+	for(s = con->ring_notified; s != con->ring->head; ++s)
+		co_hist_record(&con->rx_latency, co_now() - slots[s & (con->ring->slots - 1)].timestamp);
+	con->ring_notified = con->ring->head;
+
+	/* 1. Parameter is the number of slots to read */
+	status = napi_create_uint32(con->env, con->ring->head - con->ring->tail, &argv[0]);
+	napi_assert_cb(con->env, status);
+
+	/* Call the callback */
+	status = napi_get_global(con->env, &global);
+	napi_assert_cb(con->env, status);
+	status = napi_get_reference_value(con->env, con->ring_cb_ref, &cb);
+	napi_assert_cb(con->env, status);
+	status = napi_make_callback(con->env, con->ring_cb_ctx, global, cb, 1, argv, NULL);
+	napi_assert_cb(con->env, status);
+}
+
+/* Update the process image in place, workers are signaled later */
+void co_image_pdo_write(co_t_node *con, co_t_pdo_id id, co_t_pdo *p, size_t len,
+		uint64_t ts) {
+	co_t_image *img = con->image;
+	co_t_image_pdo *slot = &((co_t_image_pdo *)(img + 1))[id];
+	uint32_t seq = co_image_begin(img);
+
+	slot->timestamp = ts;
+	slot->count++;
+	slot->dlc = len;
+	memcpy(slot->data, p->data, len);
+	memset(&slot->data[len], 0, sizeof(slot->data) - len);
+	img->pdo_count++;
+	co_image_end(img, seq);
+
+	con->image_signal = 1;
+	co_bus_defer(con->bus, con);
+}
+
+void co_image_hb_write(co_t_node *con, co_t_hb *d, uint64_t ts) {
+	co_t_image *img = con->image;
+	uint32_t seq = co_image_begin(img);
+
+	img->hb_state = d->bits.state;
+	img->hb_count++;
+	img->hb_timestamp = ts;
+	co_image_end(img, seq);
+
+	con->image_signal = 1;
+	co_bus_defer(con->bus, con);
+}
+
+void co_image_notify(co_t_node *con) {
+	napi_status status;
+	napi_value argv[1], global, cb;
+	int32_t notify;
+
+	con->image_signal = 0;
+	if(con->image == NULL) return;
+	notify = __atomic_add_fetch(&con->image->notify, 1, __ATOMIC_SEQ_CST);
+	if(con->image_cb_ref == NULL) return;
+
+	/* 1. Parameter is the notify word */
+	status = napi_create_int32(con->env, notify, &argv[0]);
+	napi_assert_cb(con->env, status);
+
+	/* Call the callback, it wakes up the workers with Atomics.notify */
+	status = napi_get_global(con->env, &global);
+	napi_assert_cb(con->env, status);
+	status = napi_get_reference_value(con->env, con->image_cb_ref, &cb);
+	napi_assert_cb(con->env, status);
+	status = napi_make_callback(con->env, con->image_cb_ctx, global, cb, 1, argv, NULL);
+	napi_assert_cb(con->env, status);
+}
+
+/* Keep the PDO until the end of the receive batch */
+void co_pdo_batch_write(co_t_node *con, co_t_pdo_id id, co_t_pdo *p, size_t len,
+		uint64_t ts, uint32_t cycle) {
+	co_t_pdo_batch_item *b;
+	uint32_t size;
+
+	if(con->batch_count == con->batch_size){
+		size = con->batch_size ? con->batch_size * 2 : 64;
+		b = (co_t_pdo_batch_item *)realloc(con->batch, size * sizeof(co_t_pdo_batch_item));
+		if(b == NULL) return;
+		con->batch = b;
+		con->batch_size = size;
+	}
+	b = &con->batch[con->batch_count++];
+	b->pdo_id = id;
+	b->length = len;
+	b->ts = ts;
+	b->sync_cycle = cycle;
+	memcpy(b->data, p->data, len);
+
+	co_bus_defer(con->bus, con);
+}
+
+void co_pdo_batch_notify(co_t_node *con) {
+	napi_status status;
+	napi_value argv[2], global, cb;
+	co_t_pdo_batch_entry *e;
+	uint8_t *jsdata;
+	uint32_t i, count = con->batch_count;
+	size_t offset, size;
+	uint64_t now = co_now();
+
+	con->batch_count = 0;
+	if(count == 0 || con->batch_cb_ref == NULL) return;
+
+	/* Compute the size of the packed buffer */
+	size = count * sizeof(co_t_pdo_batch_entry);
+	for(i = 0; i < count; ++i) size += con->batch[i].length;
+
+	/* 1. Parameter is the packed buffer: index then data */
+	status = napi_create_arraybuffer(con->env, size, (void **)&jsdata, &argv[0]);
+	napi_assert_cb(con->env, status);
+	e = (co_t_pdo_batch_entry *)jsdata;
+	offset = count * sizeof(co_t_pdo_batch_entry);
+	for(i = 0; i < count; ++i){
+		e[i].pdo_id = con->batch[i].pdo_id;
+		e[i].length = con->batch[i].length;
+		e[i].sync_cycle = con->batch[i].sync_cycle;
+		e[i].offset = offset;
+		e[i].timestamp = con->batch[i].ts;
+		co_hist_record(&con->rx_latency, now - con->batch[i].ts);
+		memcpy(&jsdata[offset], con->batch[i].data, e[i].length);
+		offset += e[i].length;
+	}
+
+	/* 2. Parameter is the number of PDO */
+	status = napi_create_uint32(con->env, count, &argv[1]);
+	napi_assert_cb(con->env, status);
+
+	/* Call the callback */
+	status = napi_get_global(con->env, &global);
+	napi_assert_cb(con->env, status);
+	status = napi_get_reference_value(con->env, con->batch_cb_ref, &cb);
+	napi_assert_cb(con->env, status);
+	status = napi_make_callback(con->env, con->batch_cb_ctx, global, cb, 2, argv, NULL);
+	napi_assert_cb(con->env, status);
+}
+
+/* Fired rule, javascript is told at the end of the batch */
+void co_reflex_report(co_t_bus *bus, unsigned int rule, unsigned int node,
+		uint64_t ts) {
+	co_t_reflex_report *r;
+	if(bus->reflex.nreports == CO_REFLEX_MAX_REPORTS){
+		bus->reflex.lost++;
+		return;
+	}
+	r = &bus->reflex.reports[bus->reflex.nreports++];
+	r->rule = rule;
+	r->type = bus->reflex.rules[rule].type;
+	r->node = node;
+	r->reserved = 0;
+	r->timestamp = ts;
+}
+
+/* Write the bit of a rule into its RPDO and build the frame from it. The
+   buffer of a cyclic RPDO on the same COB-ID holds the RPDO when there is one,
+   so the next period keeps the bit, else the copy of the rules. */
+void co_reflex_write_bit(co_t_bus *bus, co_t_reflex_rule *r, uint8_t bit,
+		struct canfd_frame *frame) {
+	co_t_cyclic_sched *s = &bus->cyclic;
+	co_t_reflex_output *o = &bus->reflex.outputs[r->dst_node][r->dst_pdo];
+	canid_t cob_id = ((0x100*r->dst_pdo)+0x200) | r->dst_node;
+	uint8_t *data = o->data, len = o->len, mask = 1 << (r->dst_bit % 8);
+	unsigned int i;
+
+	if(r->actions & CO_REFLEX_INVERT) bit ^= 1;
+	pthread_mutex_lock(&s->lock);
+	for(i = 0; i < s->count; ++i){
+		if(s->entries[i]->cob_id == cob_id && s->entries[i]->len * 8 > r->dst_bit){
+			data = s->entries[i]->data;
+			len = s->entries[i]->len;
+			break;
+		}
+	}
+	data[r->dst_bit / 8] = (data[r->dst_bit / 8] & ~mask) | (bit ? mask : 0);
+	co_pdo_frame(bus, frame, cob_id, data, len);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* Evaluate the rules on a TPDO or an EMCY, before any javascript */
+void co_reflex_eval(co_t_bus *bus, unsigned int type, unsigned int node,
+		unsigned int pdo, struct canfd_frame *frame, uint64_t ts) {
+	co_t_reflex *x = &bus->reflex;
+	struct canfd_frame frames[CO_TX_BATCH];
+	co_t_reflex_rule *r;
+	unsigned int i, f, count = 0;
+	canid_t cob_id;
+	uint8_t bit;
+
+	for(i = 0; i < x->count; ++i){
+		r = &x->rules[i];
+		if(r->type != type) continue;
+		/* Room for the frames of this rule, send the batch when full */
+		if(count + 2 > CO_TX_BATCH){
+			co_bus_send_many(bus, frames, count);
+			count = 0;
+		}
+		if(type == CO_REFLEX_PDO_BIT){
+			if(r->src_node != node || r->src_pdo != pdo ||
+					r->src_bit >= frame->len * 8)
+				continue;
+			bit = (frame->data[r->src_bit / 8] >> (r->src_bit % 8)) & 1;
+			if(bit == x->last[i]) continue; /* Only the changes */
+			if(x->last[i] == 0xFF){
+				/* First sample since the load: a state, not an edge */
+				x->last[i] = bit;
+				continue;
+			}
+			x->last[i] = bit;
+			/* One frame per RPDO, even when several rules write it */
+			cob_id = ((0x100*r->dst_pdo)+0x200) | r->dst_node;
+			for(f = 0; f < count && frames[f].can_id != cob_id; ++f);
+			if(f == count) count++;
+			co_reflex_write_bit(bus, r, bit, &frames[f]);
+		}else{
+			if(r->src_node != 0 && r->src_node != node) continue;
+			/* Error reset (code 0) is not an error */
+			if(frame->len < 2 || (frame->data[0] | frame->data[1]) == 0) continue;
+			if(r->actions & CO_REFLEX_NMT){
+				memset(&frames[count], 0, sizeof(struct canfd_frame));
+				frames[count].can_id = 0x000;
+				frames[count].len = sizeof(co_t_nmt);
+				frames[count].data[0] = r->nmt;
+				frames[count].data[1] = r->dst_node;
+				count++;
+			}
+			if(r->actions & CO_REFLEX_SEND){
+				co_pdo_frame(bus, &frames[count],
+					((0x100*r->dst_pdo)+0x200) | r->dst_node, r->data, r->len);
+				count++;
+			}
+		}
+		co_reflex_report(bus, i, node, ts);
+	}
+	if(count > 0) co_bus_send_many(bus, frames, count);
+}
+
+/* Fired rules since the last batch: packed reports and the number lost */
+void co_reflex_notify(co_t_bus *bus) {
+	napi_status status;
+	napi_value argv[2], global, cb;
+	void *jsdata;
+	unsigned int n = bus->reflex.nreports;
+
+	bus->reflex.nreports = 0;
+	if(bus->reflex.cb_ref == NULL) return;
+
+	/* 1. Parameter is the reports */
+	status = napi_create_arraybuffer(bus->env, n * sizeof(co_t_reflex_report), &jsdata, &argv[0]);
+	napi_assert_cb(bus->env, status);
+	memcpy(jsdata, bus->reflex.reports, n * sizeof(co_t_reflex_report));
+
+	/* 2. Parameter is the number of reports lost */
+	status = napi_create_uint32(bus->env, bus->reflex.lost, &argv[1]);
+	napi_assert_cb(bus->env, status);
+	bus->reflex.lost = 0;
+
+	/* Call the callback */
+	status = napi_get_global(bus->env, &global);
+	napi_assert_cb(bus->env, status);
+	status = napi_get_reference_value(bus->env, bus->reflex.cb_ref, &cb);
+	napi_assert_cb(bus->env, status);
+	status = napi_make_callback(bus->env, bus->reflex.cb_ctx, global, cb, 2, argv, NULL);
+	napi_assert_cb(bus->env, status);
+}
+
+/* Stop evaluating, forget the rules */
+void co_reflex_release(co_t_bus *bus) {
+	co_t_reflex *x = &bus->reflex;
+	free(x->rules);
+	free(x->last);
+	free(x->outputs);
+	x->rules = NULL;
+	x->last = NULL;
+	x->outputs = NULL;
+	x->count = 0;
+	x->nreports = 0;
+	x->lost = 0;
+	if(x->cb_ref != NULL){
+		napi_async_destroy(bus->env, x->cb_ctx);
+		napi_delete_reference(bus->env, x->cb_ref);
+		x->cb_ref = NULL;
+	}
+}
+
+/* End of the receive batch, signal the nodes once */
+void co_bus_flush(co_t_bus *bus) {
+	co_t_node *con;
+	if(bus->reflex.nreports || bus->reflex.lost) co_reflex_notify(bus);
+	while((con = bus->flush_list) != NULL){
+		bus->flush_list = con->flush_next;
+		con->flush_pending = 0;
+		if(con->ring_signal) co_pdo_ring_notify(con);
+		if(con->image_signal) co_image_notify(con);
+		if(con->batch_count) co_pdo_batch_notify(con);
+	}
+}
+
+void co_pdo_recv_cb(co_t_node *con, co_t_pdo_id id, co_t_pdo *p, size_t len,
+		uint64_t ts) {
+	napi_status status;
+	napi_value argv[4], global, cb;
+	uint32_t cycle = co_sync_cycle(con->bus, ts);
+	void *jsdata;
+
+	/* Mapped, decode into the table first */
+	if(con->pdo_maps[CO_PDO_MAP_TX][id] != NULL)
+		co_pdo_map_decode(con->pdo_maps[CO_PDO_MAP_TX][id], p->data, len);
+
+	/* Process image, in addition to the delivery */
+	if(con->image != NULL)
+		co_image_pdo_write(con, id, p, len, ts);
+
+	/* Ring mode, no callback per frame */
+	if(con->ring != NULL){
+		co_pdo_ring_write(con, id, p, len, ts, cycle);
+		return;
+	}
+
+	/* Batch mode, one callback per loop */
+	if(con->batch_cb_ref != NULL){
+		co_pdo_batch_write(con, id, p, len, ts, cycle);
+		return;
+	}
+
+	/* No callback, do nothing. */
+	if(con->pdo_cb_ref == NULL) return;
+
+	/* 1. Parameter is the PDO id */
+	status = napi_create_uint32(con->env, id, &argv[0]);
+	napi_assert_cb(con->env, status);
+
+	/* 2. Parameter is the data */
 	status = napi_create_arraybuffer(con->env, len, &jsdata, &argv[1]);
-	napi_assert_async(con->env, status, nhs);
+	napi_assert_cb(con->env, status);
 	memcpy(jsdata, p->data, len);
 
-	/* Call the callback */
-	status = napi_get_global(con->env, &global);
-	napi_assert_async(con->env, status, nhs);
-	status = napi_get_reference_value(con->env, con->pdo_cb_ref, &cb);
-	napi_assert_async(con->env, status, nhs);
-	status = napi_make_callback(con->env, con->pdo_cb_ctx, global, cb, 2, argv, NULL);
-	napi_assert_async(con->env, status, nhs);
+	/* 3. Parameter is the receive timestamp */
+	status = napi_create_bigint_uint64(con->env, ts, &argv[2]);
+	napi_assert_cb(con->env, status);
+
+	/* 4. Parameter is the SYNC cycle, 0 without SYNC */
+	status = napi_create_uint32(con->env, cycle, &argv[3]);
+	napi_assert_cb(con->env, status);
+
+	/* Call the callback */
+	co_hist_record(&con->rx_latency, co_now() - ts);
+	status = napi_get_global(con->env, &global);
+	napi_assert_cb(con->env, status);
+	status = napi_get_reference_value(con->env, con->pdo_cb_ref, &cb);
+	napi_assert_cb(con->env, status);
+	status = napi_make_callback(con->env, con->pdo_cb_ctx, global, cb, 4, argv, NULL);
+	napi_assert_cb(con->env, status);
+}
+
+/* Send a LSS request, the data is cleared first */
+int co_lss_send(co_t_bus *bus, uint8_t cs, const uint8_t *data, size_t len) {
+	struct canfd_frame frame;
+	memset(&frame, 0, sizeof(frame));
+	frame.can_id = CO_LSS_MASTER;
+	frame.len = 8;
+	frame.data[0] = cs;
+	memcpy(&frame.data[1], data, len);
+	return co_bus_send(bus, &frame);
+}
+
+/* End of the LSS operation, resolve or reject with an Error */
+void co_lss_done(co_t_bus *bus, napi_value value, const char *error) {
+	napi_deferred deferred = bus->lss.deferred;
+	napi_status status;
+
+	uv_timer_stop(&bus->lss.uvt);
+	bus->lss.op = CO_LSS_IDLE;
+	bus->lss.deferred = NULL;
+	if(error != NULL){
+		status = napi_create_error_utf8(bus->env, error, &value);
+		napi_assert_cb(bus->env, status);
+	}
+	status = co_promise_settle(bus->env, bus->lss.ctx, deferred, value, error != NULL);
+	napi_assert_cb(bus->env, status);
+}
+
+void co_lss_timeout_cb(uv_timer_t* handle);
+
+/* Next fastscan request: IDNumber, BitChecked, LSSSub, LSSNext */
+void co_lss_fastscan_step(co_t_bus *bus) {
+	co_t_lss *l = &bus->lss;
+	uint8_t data[7];
+
+	memcpy(data, &l->id[l->sub], 4);
+	data[4] = l->bit < 0 ? 0 : l->bit;
+	data[5] = l->sub;
+	data[6] = l->bit < 0 ? (l->sub + 1) % 4 : l->sub;
+	if(l->bit == CO_LSS_FASTSCAN_RESET) memset(data, 0, 4);
+	l->answered = false;
+	co_lss_send(bus, CO_LSS_FASTSCAN, data, sizeof(data));
+	uv_update_time(l->uvt.loop); /* Short steps, the loop time may be old */
+	uv_timer_start(&l->uvt, co_lss_timeout_cb, l->timeout, 0);
+}
+
+/* Fastscan found the 4 parts, the slave is in configuration state */
+void co_lss_fastscan_found(co_t_bus *bus) {
+	static const char *names[] = { "vendor", "product", "revision", "serial" };
+	napi_status status;
+	napi_value result, tmp;
+	unsigned int i;
+
+	status = napi_create_object(bus->env, &result);
+	napi_assert_cb(bus->env, status);
+	for(i = 0; i < 4; ++i){
+		status = napi_create_uint32(bus->env, bus->lss.id[i], &tmp);
+		napi_assert_cb(bus->env, status);
+		status = napi_set_named_property(bus->env, result, names[i], tmp);
+		napi_assert_cb(bus->env, status);
+	}
+	co_lss_done(bus, result, NULL);
+}
+
+/* Each fastscan step waits the whole timeout: several slaves may answer */
+void co_lss_timeout_cb(uv_timer_t* handle) {
+	co_t_bus *bus = (co_t_bus *)handle->data;
+	co_t_lss *l = &bus->lss;
+	napi_handle_scope nhs;
+	napi_value null;
+
+	napi_open_handle_scope(bus->env, &nhs);
+	if(l->op != CO_LSS_OP_FASTSCAN){
+		co_lss_done(bus, NULL, "LSS timeout");
+	}else if(l->bit == CO_LSS_FASTSCAN_RESET && !l->answered){
+		/* No unconfigured slave */
+		napi_get_null(bus->env, &null);
+		co_lss_done(bus, null, NULL);
+	}else if(l->bit == CO_LSS_FASTSCAN_RESET || l->bit >= 0){
+		/* Silence: the bit of the slave is 1 */
+		if(l->bit != CO_LSS_FASTSCAN_RESET && !l->answered)
+			l->id[l->sub] |= (uint32_t)1 << l->bit;
+		l->bit = l->bit == CO_LSS_FASTSCAN_RESET ? 31 : l->bit - 1;
+		if(l->known & (1 << l->sub)) l->bit = -1;
+		co_lss_fastscan_step(bus);
+	}else if(!l->answered){
+		co_lss_done(bus, NULL, "LSS fastscan lost the slave");
+	}else if(++l->sub == 4){
+		co_lss_fastscan_found(bus);
+	}else{
+		l->bit = l->known & (1 << l->sub) ? -1 : 31;
+		co_lss_fastscan_step(bus);
+	}
+	napi_close_handle_scope(bus->env, nhs);
+}
+
+/* Response of a slave (0x7E4) */
+void co_lss_recv_cb(co_t_bus *bus, struct canfd_frame *frame) {
+	co_t_lss *l = &bus->lss;
+	napi_value value;
+	napi_status status;
+	uint8_t cs = frame->data[0];
+
+	if(frame->len < 1) return;
+	switch(l->op){
+	case CO_LSS_OP_FASTSCAN:
+		if(cs == CO_LSS_IDENTIFY_SLAVE) l->answered = true;
+		break;
+	case CO_LSS_OP_SELECTIVE:
+		if(cs != CO_LSS_SWITCH_RESPONSE) break;
+		status = napi_get_boolean(bus->env, true, &value);
+		napi_assert_cb(bus->env, status);
+		co_lss_done(bus, value, NULL);
+		break;
+	case CO_LSS_OP_CONFIGURE:
+	case CO_LSS_OP_STORE:
+		if(cs != (l->op == CO_LSS_OP_CONFIGURE ? CO_LSS_CONFIGURE_NODE_ID : CO_LSS_STORE))
+			break;
+		if(frame->data[1] != 0){
+			co_lss_done(bus, NULL, l->op == CO_LSS_OP_CONFIGURE ?
+				"LSS node id refused" : "LSS store refused");
+			break;
+		}
+		status = napi_get_boolean(bus->env, true, &value);
+		napi_assert_cb(bus->env, status);
+		co_lss_done(bus, value, NULL);
+		break;
+	default:
+		break;
+	}
+}
+
+/* Abandon the operation, the bus is closing */
+void co_lss_release(co_t_bus *bus) {
+	uv_timer_stop(&bus->lss.uvt);
+	bus->lss.op = CO_LSS_IDLE;
+	bus->lss.deferred = NULL; /* Never settled, like the SDO of a stopped node */
+	if(bus->lss.ctx != NULL){
+		napi_async_destroy(bus->env, bus->lss.ctx);
+		bus->lss.ctx = NULL;
+	}
+}
+
+/* Upload request of the current step of the node */
+void co_scan_request(co_t_bus *bus, unsigned int id, struct canfd_frame *frame) {
+	co_t_scan_node *n = &bus->scan.nodes[id];
+	co_t_sdo *s = (co_t_sdo *)frame->data;
+
+	memset(frame, 0, sizeof(*frame));
+	frame->can_id = 0x600 + id;
+	frame->len = 8;
+	s->header.bits.cs = CO_CCS_UPLOAD_INIT;
+	s->index = n->step == 0 ? 0x1000 : 0x1018;
+	s->subindex = n->step;
+	n->state = CO_SCAN_PROBING;
+	n->deadline = uv_now(bus->scan.uvt.loop) + bus->scan.timeout;
+}
+
+/* Start the next node ids, up to the parallelism */
+void co_scan_fill(co_t_bus *bus) {
+	co_t_scan *sc = &bus->scan;
+	struct canfd_frame frames[CO_TX_BATCH];
+	unsigned int count = 0;
+
+	while(sc->inflight < sc->parallel && sc->next_id < CO_MAX_NODES && count < CO_TX_BATCH){
+		if(bus->nodes[sc->next_id] != NULL){
+			/* Its SDO channel belongs to the node object */
+			sc->nodes[sc->next_id++].state = CO_SCAN_SKIPPED;
+			continue;
+		}
+		co_scan_request(bus, sc->next_id++, &frames[count++]);
+		sc->inflight++;
+	}
+	if(count > 0) co_bus_send_many(bus, frames, count);
+}
+
+/* All the ids answered or timed out: resolve the packed devices */
+void co_scan_done(co_t_bus *bus) {
+	co_t_scan *sc = &bus->scan;
+	co_t_scan_entry *e;
+	napi_status status;
+	napi_value result;
+	unsigned int id;
+	void *jsdata;
+
+	uv_timer_stop(&sc->uvt);
+	sc->running = false;
+	status = napi_create_arraybuffer(bus->env, sc->found * sizeof(co_t_scan_entry), &jsdata, &result);
+	napi_assert_cb(bus->env, status);
+	e = (co_t_scan_entry *)jsdata;
+	for(id = 1; id < CO_MAX_NODES; ++id)
+		if(sc->nodes[id].state == CO_SCAN_FOUND) *e++ = sc->nodes[id].entry;
+	status = co_promise_settle(bus->env, sc->ctx, sc->deferred, result, false);
+	napi_assert_cb(bus->env, status);
+}
+
+/* The step of the node is over (value read, abort or timeout) */
+void co_scan_next(co_t_bus *bus, unsigned int id, bool ok, uint32_t value) {
+	co_t_scan *sc = &bus->scan;
+	co_t_scan_node *n = &sc->nodes[id];
+	struct canfd_frame frame;
+	uint32_t *identity = &n->entry.vendor;
+
+	if(n->step == 0){
+		if(!ok){
+			n->state = CO_SCAN_ABSENT;
+			sc->inflight--;
+			co_scan_fill(bus);
+			if(sc->inflight == 0) co_scan_done(bus);
+			return;
+		}
+		n->entry.node_id = id;
+		n->entry.device_type = value;
+	}else if(ok){
+		identity[n->step - 1] = value;
+		n->entry.identity |= 1 << (n->step - 1);
+	}
+
+	/* Next sub-index of the identity, 0x1018 may be shorter */
+	if(++n->step <= 4){
+		n->tries = 0;
+		co_scan_request(bus, id, &frame);
+		co_bus_send(bus, &frame);
+		return;
+	}
+
+	/* Device complete, boot it */
+	n->state = CO_SCAN_FOUND;
+	sc->found++;
+	if(sc->nmt){
+		memset(&frame, 0, sizeof(frame));
+		frame.can_id = 0x000;
+		frame.len = sizeof(co_t_nmt);
+		frame.data[0] = sc->nmt;
+		frame.data[1] = id;
+		co_bus_send(bus, &frame);
+	}
+	sc->inflight--;
+	co_scan_fill(bus);
+	if(sc->inflight == 0) co_scan_done(bus);
+}
+
+/* SDO response to a probe */
+void co_scan_recv_cb(co_t_bus *bus, unsigned int id, struct canfd_frame *frame) {
+	co_t_sdo *s = (co_t_sdo *)frame->data;
+	uint32_t value = 0;
+
+	if(s->header.bits.cs == CO_SCS_UPLOAD_INIT_RESPONSE && s->header.bits.e){
+		memcpy(&value, s->data, s->header.bits.s ? 4 - s->header.bits.n : 4);
+		co_scan_next(bus, id, true, value);
+	}else{
+		co_scan_next(bus, id, false, 0); /* Abort or not expedited */
+	}
+}
+
+void co_scan_timer_cb(uv_timer_t* handle) {
+	co_t_bus *bus = (co_t_bus *)handle->data;
+	co_t_scan *sc = &bus->scan;
+	struct canfd_frame frame;
+	napi_handle_scope nhs;
+	uint64_t now = uv_now(handle->loop);
+	unsigned int id;
+
+	napi_open_handle_scope(bus->env, &nhs);
+	for(id = 1; id < CO_MAX_NODES && sc->running; ++id){
+		if(sc->nodes[id].state != CO_SCAN_PROBING || sc->nodes[id].deadline > now)
+			continue;
+		if(sc->nodes[id].tries++ < sc->retries){
+			co_scan_request(bus, id, &frame);
+			co_bus_send(bus, &frame);
+		}else{
+			co_scan_next(bus, id, false, 0);
+		}
+	}
+	napi_close_handle_scope(bus->env, nhs);
+}
+
+/* Abandon the scan, the bus is closing */
+void co_scan_release(co_t_bus *bus) {
+	uv_timer_stop(&bus->scan.uvt);
+	bus->scan.running = false;
+	if(bus->scan.ctx != NULL){
+		napi_async_destroy(bus->env, bus->scan.ctx);
+		bus->scan.ctx = NULL;
+	}
+}
+
+void co_emcy_recv_cb(co_t_node *con, struct canfd_frame *frame, uint64_t ts) {
+	napi_status status;
+	napi_value argv[4], global, cb;
+	uint8_t data[8] = { 0 };
+	void *jsdata;
+
+	con->metrics.emcy++;
+
+	/* No callback, do nothing. */
+	if(con->emcy_cb_ref == NULL) return;
+	memcpy(data, frame->data, frame->len < sizeof(data) ? frame->len : sizeof(data));
+
+	/* 1. Parameter is the error code (0: error reset) */
+	status = napi_create_uint32(con->env, data[0] | data[1] << 8, &argv[0]);
+	napi_assert_cb(con->env, status);
+
+	/* 2. Parameter is the error register (0x1001) */
+	status = napi_create_uint32(con->env, data[2], &argv[1]);
+	napi_assert_cb(con->env, status);
+
+	/* 3. Parameter is the manufacturer specific error field */
+	status = napi_create_arraybuffer(con->env, 5, &jsdata, &argv[2]);
+	napi_assert_cb(con->env, status);
+	memcpy(jsdata, &data[3], 5);
+
+	/* 4. Parameter is the receive timestamp */
+	status = napi_create_bigint_uint64(con->env, ts, &argv[3]);
+	napi_assert_cb(con->env, status);
+
+	/* Call the callback */
+	co_hist_record(&con->rx_latency, co_now() - ts);
+	status = napi_get_global(con->env, &global);
+	napi_assert_cb(con->env, status);
+	status = napi_get_reference_value(con->env, con->emcy_cb_ref, &cb);
+	napi_assert_cb(con->env, status);
+	status = napi_make_callback(con->env, con->emcy_cb_ctx, global, cb, 4, argv, NULL);
+	napi_assert_cb(con->env, status);
+}
+
+void co_bus_dispatch(co_t_bus *bus, struct canfd_frame *frame, uint64_t ts) {
+	co_t_node *con;
+	canid_t fc;
+	unsigned int i, id;
+
+	/* Ignore extended, remote and error frames */
+	if(frame->can_id & (CAN_EFF_FLAG | CAN_RTR_FLAG | CAN_ERR_FLAG))
+		return;
+
+	/* Additional SDO channels have their own COB-ID */
+	for(i = 0; i < bus->sdo_nroutes; ++i){
+		if(bus->sdo_routes[i]->cob_rx == frame->can_id){
+			co_sdo_recv_cb(bus->sdo_routes[i], (co_t_sdo *)frame->data, ts);
+			return;
+		}
+	}
+
+	/* SDO response to the bus scan */
+	if((frame->can_id & 0x780) == 0x580 && bus->scan.running &&
+			bus->scan.nodes[frame->can_id & 0x7F].state == CO_SCAN_PROBING){
+		co_scan_recv_cb(bus, frame->can_id & 0x7F, frame);
+		return;
+	}
+
+	/* LSS slave response */
+	if(frame->can_id == CO_LSS_SLAVE){
+		co_lss_recv_cb(bus, frame);
+		return;
+	}
+
+	/* The node ID is encoded on the low 7 bits */
+	fc = frame->can_id >> 7;
+	id = frame->can_id & 0x7F;
+	if(fc == 0xE && frame->len >= 1)
+		co_hb_consume(bus, id, (co_t_hb *)frame->data, ts);
+
+	/* Reflex rules first, the outputs leave before any callback */
+	if(bus->reflex.count > 0){
+		if(fc == 0x3 || fc == 0x5 || fc == 0x7 || fc == 0x9)
+			co_reflex_eval(bus, CO_REFLEX_PDO_BIT, id, (fc - 3) / 2, frame, ts);
+		else if(fc == 0x1 && id != 0)
+			co_reflex_eval(bus, CO_REFLEX_EMCY, id, 0, frame, ts);
+	}
+
+	con = bus->nodes[id];
+	if(con == NULL)
+		return; /* Not a node we are talking with */
+
+	/* Receive an SDO */
+	if(fc == 0xB)
+		co_sdo_recv_cb(con->sdo_channels[0], (co_t_sdo *)frame->data, ts);
+	/* PDO 0-3 */
+	else if(fc == 0x3)
+		co_pdo_recv_cb(con, CO_PDO_ID0, (co_t_pdo *)frame->data, frame->len, ts);
+	else if(fc == 0x5)
+		co_pdo_recv_cb(con, CO_PDO_ID1, (co_t_pdo *)frame->data, frame->len, ts);
+	else if(fc == 0x7)
+		co_pdo_recv_cb(con, CO_PDO_ID2, (co_t_pdo *)frame->data, frame->len, ts);
+	else if(fc == 0x9)
+		co_pdo_recv_cb(con, CO_PDO_ID3, (co_t_pdo *)frame->data, frame->len, ts);
+	/* Heartbeat */
+	else if(fc == 0xE)
+		co_hb_recv_cb(con, (co_t_hb *)frame->data, ts);
+	/* Emergency */
+	else if(fc == 0x1)
+		co_emcy_recv_cb(con, frame, ts);
+}
+
+void co_can_recv_cb(uv_poll_t* handle, int status, int events) {
+	co_t_bus *bus = (co_t_bus *)handle->data;
+	napi_handle_scope nhs;
+	unsigned int i;
+	uint64_t ts;
+	int n;
+
+	/* One handle scope for the whole drain */
+	napi_open_handle_scope(bus->env, &nhs);
+	do {
+		/* Drain the socket by batch, until it would block */
+		n = co_bus_recv(bus);
+		if(n <= 0) break;
+
+		for(i = 0; i < (unsigned int)n; ++i){
+			if(!co_bus_count_rx(bus, &bus->rx_msgs[i], &bus->rx_frames[i]))
+				continue; /* Ignore invalid can frame */
+			ts = co_bus_timestamp(bus, &bus->rx_msgs[i].msg_hdr);
+			co_trace_write(&bus->trace, &bus->rx_frames[i], ts,
+				co_frame_trace_flags(bus->rx_msgs[i].msg_len, &bus->rx_frames[i]));
+			co_bus_dispatch(bus, &bus->rx_frames[i], ts);
+		}
+	} while((unsigned int)n == bus->rx_batch);
+	co_bus_flush(bus);
+	napi_close_handle_scope(bus->env, nhs);
+}
+
+void co_rx_async_cb(uv_async_t* handle) {
+	co_t_bus *bus = (co_t_bus *)handle->data;
+	napi_handle_scope nhs;
+	co_t_rx_frame *f;
+	uint32_t n = bus->rx_ring.mask + 1;
+
+	/* Dispatch at most one ring worth, do not starve the loop */
+	napi_open_handle_scope(bus->env, &nhs);
+	while(n-- > 0 && (f = co_rx_ring_peek(&bus->rx_ring)) != NULL){
+		co_bus_dispatch(bus, &f->frame, f->ts);
+		co_rx_ring_next(&bus->rx_ring);
+	}
+	co_bus_flush(bus);
+	napi_close_handle_scope(bus->env, nhs);
+	if(co_rx_ring_peek(&bus->rx_ring) != NULL) uv_async_send(handle);
+}
+
+/* Unmap the recording, the promise is not settled */
+void co_replay_release(co_t_bus *bus) {
+	co_t_replay *rp = &bus->replay;
+
+	uv_timer_stop(&rp->uvt);
+	rp->running = false;
+	if(rp->header != NULL){
+		munmap(rp->header, rp->size);
+		rp->header = NULL;
+	}
+	if(rp->ctx != NULL){
+		napi_async_destroy(bus->env, rp->ctx);
+		rp->ctx = NULL;
+	}
+}
+
+/* Dispatch the received frames that are due, then wait for the next one */
+void co_replay_timer_cb(uv_timer_t* handle) {
+	co_t_bus *bus = (co_t_bus *)handle->data;
+	co_t_replay *rp = &bus->replay;
+	co_t_trace_record *r;
+	struct canfd_frame frame;
+	napi_handle_scope nhs;
+	napi_status status;
+	napi_value result;
+	uint64_t now = co_now(), due = now;
+	int64_t offset;
+	unsigned int n;
+
+	napi_open_handle_scope(bus->env, &nhs);
+	memset(&frame, 0, sizeof(frame));
+	for(n = 0; rp->pos < rp->end && n < CO_REPLAY_BATCH; ++rp->pos, ++n){
+		r = co_trace_record(rp->header, rp->pos);
+		if(r->flags & CO_TRACE_TX) continue; /* Our frames, not received */
+		if(rp->speed > 0){
+			/* Signed, a record older than the first is due now */
+			offset = (int64_t)(r->timestamp - rp->first);
+			due = rp->start + (offset > 0 ? (uint64_t)(offset / rp->speed) : 0);
+		}
+		if(due > now) break;
+		frame.can_id = r->can_id;
+		frame.len = r->len;
+		frame.flags = r->flags & CO_TRACE_BRS ? CANFD_BRS : 0;
+		memcpy(frame.data, r + 1, r->len);
+		co_bus_dispatch(bus, &frame, due);
+		rp->count++;
+	}
+	co_bus_flush(bus);
+
+	if(rp->pos < rp->end){
+		uv_update_time(handle->loop);
+		uv_timer_start(&rp->uvt, co_replay_timer_cb, due > now ? (due - now) / 1000000 : 0, 0);
+	}else{
+		/* Resolve the number of frames dispatched */
+		munmap(rp->header, rp->size);
+		rp->header = NULL;
+		rp->running = false;
+		status = napi_create_uint32(bus->env, rp->count, &result);
+		if(status == napi_ok)
+			status = co_promise_settle(bus->env, rp->ctx, rp->deferred, result, false);
+		if(status != napi_ok) napi_fatal_last_error(bus->env, __FILE__, __LINE__);
+	}
+	napi_close_handle_scope(bus->env, nhs);
+}
+
+//// NMT Functions /////////////////////////////////////////////////////////////
+napi_value co_nmt_send(napi_env env, napi_callback_info info) {
+	napi_status status;
+	size_t argc = 1;
+	napi_value argv[1];
+	co_t_node *con;
+	uint32_t state; /* Use uint32_t and not enum co_e_nmt_state */
+	struct canfd_frame frame;
+	co_t_nmt *n = (co_t_nmt *)frame.data;
+
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
+	napi_assert(env, status);
+
+	/* 1. Parameter is the state to send */
+	status = napi_get_value_uint32(env, argv[0], &state);
+	napi_assert(env, status);
+
+	/* Send the NMT command */
+	frame.can_id = 0x000;
+	frame.flags = 0;
+	n->state = state;
+	n->node_id = con->node_id;
+	frame.len = sizeof(co_t_nmt);
+	if(co_bus_send(con->bus, &frame) < 0)
+		napi_throw_error(con->env, NULL, "Cannot write socket");
+
+	return g_napi_null;
+}
+
+//// Heartbeat Functions ///////////////////////////////////////////////////////
+napi_value co_heartbeat(napi_env env, napi_callback_info info) {
+	napi_status status;
+	size_t argc = 1;
+	napi_value argv[1], tmp;
+	napi_valuetype vt;
+	co_t_node *con;
+	struct canfd_frame frame;
+	co_t_hb *d = (co_t_hb *)frame.data;
+
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
+	napi_assert(env, status);
+
+	/* 1. Parameter is the callback, mandatory only the first time */
+	if(argc >= 1 || con->hb_cb_ref == NULL) {
+		status = napi_typeof(env, argv[0], &vt);
+		napi_assert(env, status);
+		napi_assert_other(env, vt != napi_function, "Invalid callback");
+		status = napi_create_string_utf8(env, "HB Callback Context", NAPI_AUTO_LENGTH, &tmp);
+		napi_assert(env, status);
+		/* Delete the previous callback, if there is already one. */
+		if(con->hb_cb_ref != NULL){
+			status = napi_async_destroy(con->env, con->hb_cb_ctx);
+			napi_assert(env, status);
+			status = napi_delete_reference(con->env, con->hb_cb_ref);
+			napi_assert(env, status);
+		}
+		status = napi_async_init(env, NULL, tmp, &con->hb_cb_ctx);
+		napi_assert(env, status);
+		status = napi_create_reference(env, argv[0], 1, &con->hb_cb_ref);
+		napi_assert(env, status);
+	}
+
+	/* Send a heartbeat */
+	frame.can_id = (0x700+con->node_id) | CAN_RTR_FLAG;
+	frame.flags = 0;
+	d->byte = 0;
+	frame.len = sizeof(co_t_hb);
+	if(co_bus_send(con->bus, &frame) < 0)
+		napi_throw_error(con->env, NULL, "Cannot write socket");
+	uv_update_time(con->hb_uvt.loop);
+	uv_timer_start(&con->hb_uvt, co_hb_timeout_cb, con->hb_wait_time, 0);
+
+	return g_napi_null;
+}
+
+//// SDO Functions /////////////////////////////////////////////////////////////
+
+/* Get a free queue item, NULL if an error is thrown */
+co_t_sdo_queue_item *co_sdo_request_item(napi_env env, co_t_node *con,
+		uint32_t index, uint32_t subindex) {
+	co_t_sdo_queue_item *i = co_sdo_push(con, index, subindex);
+	if(i == NULL) napi_throw_error(env, NULL, "Cannot allocate SDO queue");
+	return i;
+}
+
+/* Give back the item just queued after an error, and throw the error. It is
+   the last item of the queue and was not dispatched yet. */
+void co_sdo_request_drop(napi_env env, co_t_node *con, co_t_sdo_queue_item *i) {
+	const napi_extended_error_info *r;
+	const char *msg = "Cannot queue SDO request";
+	napi_value undefined;
+
+	if(napi_get_last_error_info(env, &r) == napi_ok && r->error_message != NULL)
+		msg = r->error_message;
+	/* The promise was not returned, nobody waits for it */
+	if(i->completion == CO_SDO_PROMISE && i->deferred != NULL &&
+			napi_get_undefined(env, &undefined) == napi_ok)
+		napi_resolve_deferred(env, i->deferred, undefined);
+	co_sdo_item_release(env, i);
+	con->sdo_queue.head--;
+	con->metrics.sdo_requests--;
+	napi_throw_error(env, NULL, msg);
+}
+
+/* Get a free queue item and save the callback, NULL if an error is thrown */
+co_t_sdo_queue_item *co_sdo_request(napi_env env, co_t_node *con,
+		napi_value jscb, uint32_t index, uint32_t subindex) {
+	napi_status status;
+	napi_valuetype vt;
+	napi_value tmp;
+	co_t_sdo_queue_item *i;
+
+	/* Check the callback */
+	status = napi_typeof(env, jscb, &vt);
+	if(status != napi_ok){
+		napi_throw_last_error(env);
+		return NULL;
+	}
+	if(vt != napi_function){
+		napi_throw_error(env, NULL, "Invalid callback");
+		return NULL;
+	}
+
+	/* Get a free queue item */
+	i = co_sdo_request_item(env, con, index, subindex);
+	if(i == NULL) return NULL;
+
+	/* Save the callback */
+	i->completion = CO_SDO_CALLBACK;
+	status = napi_create_string_utf8(env, "SDO Callback Context", NAPI_AUTO_LENGTH, &tmp);
+	if(status == napi_ok)
+		status = napi_async_init(env, NULL, tmp, &i->cb_ctx);
+	if(status == napi_ok)
+		status = napi_create_reference(env, jscb, 1, &i->cb_ref);
+	if(status != napi_ok){
+		co_sdo_request_drop(env, con, i);
+		return NULL;
+	}
+	return i;
+}
+
+/* Get a free queue item completed by a promise, NULL if an error is thrown */
+co_t_sdo_queue_item *co_sdo_request_promise(napi_env env, co_t_node *con,
+		uint32_t index, uint32_t subindex, napi_value *promise) {
+	napi_status status;
+	co_t_sdo_queue_item *i;
+
+	i = co_sdo_request_item(env, con, index, subindex);
+	if(i == NULL) return NULL;
+	i->completion = CO_SDO_PROMISE;
+	status = napi_create_promise(env, &i->deferred, promise);
+	if(status != napi_ok){
+		co_sdo_request_drop(env, con, i);
+		return NULL;
+	}
+	return i;
+}
+
+void co_sdo_cancel_item(co_t_node *con, co_t_sdo_queue_item *i) {
+	napi_deferred *deferred;
+	napi_value error;
+
+	if(i->completion == CO_SDO_PROMISE) deferred = &i->deferred;
+	else if(i->completion == CO_SDO_SCRIPT) deferred = &i->script->deferred;
+	else return;
+	if(*deferred == NULL) return;
+	if(napi_create_error_utf8(con->env, "SDO request cancelled", &error) == napi_ok)
+		napi_reject_deferred(con->env, *deferred, error);
+	*deferred = NULL;
+}
+
+/* Reject the promises still pending, the javascript callbacks are dropped */
+void co_sdo_cancel(co_t_node *con) {
+	unsigned int c, n;
+
+	for(c = 0; c < con->sdo_nchannels; ++c){
+		if(con->sdo_channels[c]->busy)
+			co_sdo_cancel_item(con, &con->sdo_channels[c]->item);
+	}
+	for(n = con->sdo_queue.tail; n != con->sdo_queue.head; ++n)
+		co_sdo_cancel_item(con, &con->sdo_queue.items[n & con->sdo_queue.mask]);
+}
+
+/* Data of an ArrayBuffer or a TypedArray */
+napi_status co_get_buffer_info(napi_env env, napi_value value, void **data,
+		size_t *length) {
+	napi_status status;
+	napi_typedarray_type type;
+	napi_value arraybuffer;
+	size_t offset, count;
+	bool is_typedarray;
+
+	status = napi_is_typedarray(env, value, &is_typedarray);
+	if(status != napi_ok || !is_typedarray)
+		return napi_get_arraybuffer_info(env, value, data, length);
+	status = napi_get_typedarray_info(env, value, &type, &count, data,
+		&arraybuffer, &offset);
+	if(status != napi_ok) return status;
+	switch(type){
+	case napi_int8_array: case napi_uint8_array: case napi_uint8_clamped_array:
+		*length = count; break;
+	case napi_int16_array: case napi_uint16_array:
+		*length = count * 2; break;
+	case napi_int32_array: case napi_uint32_array: case napi_float32_array:
+		*length = count * 4; break;
+	default:
+		*length = count * 8; break;
+	}
+	return napi_ok;
+}
+
+/* Keep the ArrayBuffer to download alive until the end of the transfer */
+napi_status co_sdo_request_data(napi_env env, co_t_sdo_queue_item *i,
+		napi_value jsbuf, void *jsdata, size_t jslen) {
+	i->data = (uint8_t *)jsdata;
+	i->size = jslen;
+	return napi_create_reference(env, jsbuf, 1, &i->data_ref);
+}
+
+napi_value co_sdo_download(napi_env env, napi_callback_info info) {
+	napi_status status;
+	size_t argc = 4;
+	napi_value argv[4];
+	uint32_t index, subindex;
+	void *jsdata;
+	size_t jslen;
+	co_t_node *con;
+	co_t_sdo_queue_item *i;
+
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
+	napi_assert(env, status);
+
+	/* 1. Parameter is the index */
+	status = napi_get_value_uint32(env, argv[0], &index);
+	napi_assert(env, status);
+
+	/* 2. Parameter is the subindex */
+	status = napi_get_value_uint32(env, argv[1], &subindex);
+	napi_assert(env, status);
+
+	/* 3. Parameter is the data */
+	status = napi_get_arraybuffer_info(env, argv[2], &jsdata, &jslen);
+	napi_assert(env, status);
+	napi_assert_other(env, jslen > UINT32_MAX, "SDO request too long");
+
+	/* 4. Parameter is the callback */
+	i = co_sdo_request(env, con, argv[3], index, subindex);
+	if(i == NULL) return g_napi_null;
+
+	/* Fill the CANopen data */
+	co_sdo_init_download(i, jsdata, jslen);
+	if(i->transfer == CO_SDO_SEGMENTED){
+		status = co_sdo_request_data(env, i, argv[2], jsdata, jslen);
+		if(status != napi_ok){
+			co_sdo_request_drop(env, con, i);
+			return g_napi_null;
+		}
+	}
+
+	/* Send if a channel is free */
+	co_sdo_dispatch(con);
+
+	return g_napi_null;
+}
+
+napi_value co_sdo_upload(napi_env env, napi_callback_info info) {
+	napi_status status;
+	size_t argc = 3;
+	napi_value argv[3];
+	co_t_node *con;
+	uint32_t index, subindex;
+	co_t_sdo_queue_item *i;
+
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
+	napi_assert(env, status);
+
+	/* 1. Parameter is the index */
+	status = napi_get_value_uint32(env, argv[0], &index);
+	napi_assert(env, status);
+
+	/* 2. Parameter is the subindex */
+	status = napi_get_value_uint32(env, argv[1], &subindex);
+	napi_assert(env, status);
+
+	/* 3. Parameter is the callback */
+	i = co_sdo_request(env, con, argv[2], index, subindex);
+	if(i == NULL) return g_napi_null;
+
+	/* Fill the CANopen data */
+	co_sdo_init_upload(i);
+
+	/* Send if a channel is free */
+	co_sdo_dispatch(con);
+
+	return g_napi_null;
+}
+
+napi_value co_sdo_block_download(napi_env env, napi_callback_info info) {
+	napi_status status;
+	size_t argc = 4;
+	napi_value argv[4];
+	uint32_t index, subindex, size;
+	void *jsdata;
+	size_t jslen;
+	co_t_node *con;
+	co_t_sdo_block *b;
+	co_t_sdo_queue_item *i;
+
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
+	napi_assert(env, status);
+
+	/* 1. Parameter is the index */
+	status = napi_get_value_uint32(env, argv[0], &index);
+	napi_assert(env, status);
+
+	/* 2. Parameter is the subindex */
+	status = napi_get_value_uint32(env, argv[1], &subindex);
+	napi_assert(env, status);
+
+	/* 3. Parameter is the data */
+	status = napi_get_arraybuffer_info(env, argv[2], &jsdata, &jslen);
+	napi_assert(env, status);
+	napi_assert_other(env, jslen > UINT32_MAX, "SDO request too long");
+
+	/* 4. Parameter is the callback */
+	i = co_sdo_request(env, con, argv[3], index, subindex);
+	if(i == NULL) return g_napi_null;
+	i->transfer = CO_SDO_BLOCK;
+	status = co_sdo_request_data(env, i, argv[2], jsdata, jslen);
+	if(status != napi_ok){
+		co_sdo_request_drop(env, con, i);
+		return g_napi_null;
+	}
+
+	/* Fill the CANopen data: CRC supported, size specified */
+	b = (co_t_sdo_block *) i->cf.data;
+	b->header.byte = (CO_CCS_BLOCK_DOWNLOAD << 5) | (1 << 2) | (1 << 1);
+	memcpy(&b->data[0], &i->index, sizeof(i->index));
+	b->data[2] = subindex;
+	size = jslen;
+	memcpy(&b->data[3], &size, sizeof(size));
+
+	/* Expected command specifier */
+	i->expected_scs = CO_SCS_BLOCK_DOWNLOAD;
+
+	/* Send if a channel is free */
+	co_sdo_dispatch(con);
+
+	return g_napi_null;
+}
+
+napi_value co_sdo_block_upload(napi_env env, napi_callback_info info) {
+	napi_status status;
+	size_t argc = 3;
+	napi_value argv[3];
+	co_t_node *con;
+	uint32_t index, subindex;
+	co_t_sdo_block *b;
+	co_t_sdo_queue_item *i;
+
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
+	napi_assert(env, status);
+
+	/* 1. Parameter is the index */
+	status = napi_get_value_uint32(env, argv[0], &index);
+	napi_assert(env, status);
+
+	/* 2. Parameter is the subindex */
+	status = napi_get_value_uint32(env, argv[1], &subindex);
+	napi_assert(env, status);
+
+	/* 3. Parameter is the callback */
+	i = co_sdo_request(env, con, argv[2], index, subindex);
+	if(i == NULL) return g_napi_null;
+	i->transfer = CO_SDO_BLOCK;
+	i->upload = 1;
+	i->blksize = con->sdo_block_size;
+
+	/* Fill the CANopen data: CRC supported, no protocol switch */
+	b = (co_t_sdo_block *) i->cf.data;
+	b->header.byte = (CO_CCS_BLOCK_UPLOAD << 5) | (1 << 2);
+	memcpy(&b->data[0], &i->index, sizeof(i->index));
+	b->data[2] = subindex;
+	b->data[3] = i->blksize;
+
+	/* Expected command specifier */
+	i->expected_scs = CO_SCS_BLOCK_UPLOAD;
+
+	/* Send if a channel is free */
+	co_sdo_dispatch(con);
+
+	return g_napi_null;
+}
+
+napi_value co_sdo_read(napi_env env, napi_callback_info info) {
+	napi_status status;
+	size_t argc = 4;
+	napi_value argv[4], promise;
+	napi_valuetype vt = napi_undefined;
+	uint32_t index, subindex, type;
+	void *jsdata = NULL;
+	size_t jslen = 0;
+	co_t_node *con;
+	co_t_sdo_queue_item *i;
+
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
+	napi_assert(env, status);
+
+	/* 1. Parameter is the index */
+	status = napi_get_value_uint32(env, argv[0], &index);
+	napi_assert(env, status);
+
+	/* 2. Parameter is the subindex */
+	status = napi_get_value_uint32(env, argv[1], &subindex);
+	napi_assert(env, status);
+
+	/* 3. Parameter is the type */
+	status = napi_get_value_uint32(env, argv[2], &type);
+	napi_assert(env, status);
+	napi_assert_other(env, type >= CO_SDO_TYPE_COUNT, "Invalid SDO type");
+
+	/* Optional 4. Parameter is the buffer to upload into */
+	if(argc >= 4){
+		status = napi_typeof(env, argv[3], &vt);
+		napi_assert(env, status);
+	}
+	if(vt != napi_undefined){
+		napi_assert_other(env, type != CO_SDO_TYPE_ARRAY, "Invalid SDO type");
+		status = co_get_buffer_info(env, argv[3], &jsdata, &jslen);
+		napi_assert(env, status);
+	}
+
+	i = co_sdo_request_promise(env, con, index, subindex, &promise);
+	if(i == NULL) return g_napi_null;
+	i->type = type;
+	if(vt != napi_undefined){
+		/* Resolved with the number of bytes */
+		status = co_sdo_request_data(env, i, argv[3], jsdata, jslen);
+		if(status != napi_ok){
+			co_sdo_request_drop(env, con, i);
+			return g_napi_null;
+		}
+		i->borrowed = 1;
+	}else if(type != CO_SDO_TYPE_ARRAY){
+		/* Resolved with the value */
+		i->data = i->value;
+		i->size = sizeof(i->value);
+		i->borrowed = 1;
+	}
+
+	/* Fill the CANopen data */
+	co_sdo_init_upload(i);
+
+	/* Send if a channel is free */
+	co_sdo_dispatch(con);
+
+	return promise;
+}
+
+napi_value co_sdo_write(napi_env env, napi_callback_info info) {
+	napi_status status;
+	size_t argc = 4;
+	napi_value argv[4], promise;
+	uint32_t index, subindex, type;
+	uint8_t value[8];
+	void *jsdata;
+	size_t jslen;
+	co_t_node *con;
+	co_t_sdo_queue_item *i;
+
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
+	napi_assert(env, status);
+
+	/* 1. Parameter is the index */
+	status = napi_get_value_uint32(env, argv[0], &index);
+	napi_assert(env, status);
+
+	/* 2. Parameter is the subindex */
+	status = napi_get_value_uint32(env, argv[1], &subindex);
+	napi_assert(env, status);
+
+	/* 3. Parameter is the type */
+	status = napi_get_value_uint32(env, argv[2], &type);
+	napi_assert(env, status);
+	napi_assert_other(env, type >= CO_SDO_TYPE_COUNT, "Invalid SDO type");
+
+	/* 4. Parameter is the value (or the buffer) */
+	if(type == CO_SDO_TYPE_ARRAY){
+		status = co_get_buffer_info(env, argv[3], &jsdata, &jslen);
+		napi_assert(env, status);
+		napi_assert_other(env, jslen > UINT32_MAX, "SDO request too long");
+	}else{
+		status = co_sdo_encode(env, type, argv[3], value);
+		napi_assert(env, status);
+		jsdata = value;
+		jslen = co_sdo_type_size[type];
+	}
+
+	i = co_sdo_request_promise(env, con, index, subindex, &promise);
+	if(i == NULL) return g_napi_null;
+	i->type = type;
+
+	/* Fill the CANopen data */
+	co_sdo_init_download(i, jsdata, jslen);
+	if(i->transfer == CO_SDO_SEGMENTED && type == CO_SDO_TYPE_ARRAY){
+		status = co_sdo_request_data(env, i, argv[3], jsdata, jslen);
+		if(status != napi_ok){
+			co_sdo_request_drop(env, con, i);
+			return g_napi_null;
+		}
+	}else if(i->transfer == CO_SDO_SEGMENTED){
+		/* 64 bits, kept in the item */
+		memcpy(i->value, value, jslen);
+		i->data = i->value;
+		i->size = jslen;
+	}
+
+	/* Send if a channel is free */
+	co_sdo_dispatch(con);
+
+	return promise;
+}
+
+napi_value co_sdo_execute(napi_env env, napi_callback_info info) {
+	napi_status status;
+	size_t argc = 2;
+	napi_value argv[2], promise, results, error;
+	napi_valuetype vt = napi_undefined;
+	co_t_sdo_script_entry *e;
+	co_t_sdo_script *sc;
+	void *jsdata;
+	size_t jslen;
+	uint32_t n, flags = 0;
+	co_t_node *con;
+
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
+	napi_assert(env, status);
+
+	/* 1. Parameter is the packed script */
+	status = co_get_buffer_info(env, argv[0], &jsdata, &jslen);
+	napi_assert(env, status);
+	napi_assert_other(env, jslen % sizeof(co_t_sdo_script_entry) != 0 ||
+		jslen / sizeof(co_t_sdo_script_entry) > UINT32_MAX, "Invalid SDO script");
+	e = (co_t_sdo_script_entry *)jsdata;
+	for(n = 0; n < jslen / sizeof(co_t_sdo_script_entry); ++n)
+		napi_assert_other(env, e[n].type == CO_SDO_TYPE_ARRAY ||
+			e[n].type >= CO_SDO_TYPE_COUNT || e[n].op > CO_SDO_OP_READ,
+			"Invalid SDO script entry");
+
+	/* Optional 2. Parameter is the flags */
+	if(argc >= 2){
+		status = napi_typeof(env, argv[1], &vt);
+		napi_assert(env, status);
+	}
+	if(vt != napi_undefined){
+		status = napi_get_value_uint32(env, argv[1], &flags);
+		napi_assert(env, status);
+	}
+
+	/* Copy the script, javascript may modify it meanwhile */
+	sc = (co_t_sdo_script *)calloc(1, sizeof(co_t_sdo_script));
+	napi_assert_other(env, sc == NULL, "Cannot allocate SDO script");
+	sc->count = jslen / sizeof(co_t_sdo_script_entry);
+	sc->flags = flags;
+	sc->entries = (co_t_sdo_script_entry *)malloc(jslen ? jslen : 1);
+	if(sc->entries == NULL){
+		co_sdo_script_free(env, sc);
+		napi_throw_error(env, NULL, "Cannot allocate SDO script");
+		return g_napi_null;
+	}
+	memcpy(sc->entries, jsdata, jslen);
+
+	/* The results are written directly into the resolved buffer */
+	status = napi_create_arraybuffer(env, sc->count * sizeof(co_t_sdo_script_result),
+		(void **)&sc->results, &results);
+	if(status == napi_ok)
+		status = napi_create_reference(env, results, 1, &sc->results_ref);
+	if(status == napi_ok)
+		status = napi_create_promise(env, &sc->deferred, &promise);
+	if(status != napi_ok){
+		co_sdo_script_free(env, sc);
+		napi_throw_last_error(env);
+		return g_napi_null;
+	}
+	for(n = 0; n < sc->count; ++n){
+		sc->results[n].status = CO_SDO_NOT_EXECUTED;
+		sc->results[n].length = 0;
+		memset(sc->results[n].value, 0, sizeof(sc->results[n].value));
+	}
+
+	/* Empty script, or no memory for the queue */
+	if(sc->count == 0 || co_sdo_script_push(con, sc) < 0){
+		if(sc->count == 0){
+			status = napi_resolve_deferred(env, sc->deferred, results);
+		}else{
+			status = napi_create_error_utf8(env, "Cannot allocate SDO queue", &error);
+			if(status == napi_ok)
+				status = napi_reject_deferred(env, sc->deferred, error);
+		}
+		co_sdo_script_free(env, sc);
+		napi_assert(env, status);
+		return promise;
+	}
+
+	/* Send if a channel is free */
+	co_sdo_dispatch(con);
+
+	return promise;
+}
+
+napi_value co_sdo_add_channel(napi_env env, napi_callback_info info) {
+	napi_status status;
+	size_t argc = 2;
+	napi_value argv[2], result;
+	uint32_t cob_tx, cob_rx;
+	uv_loop_t *loop;
+	co_t_node *con;
+	co_t_sdo_channel *ch;
+	unsigned int c;
+
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
+	napi_assert(env, status);
+
+	/* 1. Parameter is the COB-ID master to node (0x1200+n sub 1) */
+	status = napi_get_value_uint32(env, argv[0], &cob_tx);
+	napi_assert(env, status);
+
+	/* 2. Parameter is the COB-ID node to master (0x1200+n sub 2) */
+	status = napi_get_value_uint32(env, argv[1], &cob_rx);
+	napi_assert(env, status);
+	napi_assert_other(env, cob_tx > CAN_SFF_MASK || cob_rx > CAN_SFF_MASK, "Invalid COB-ID");
+	for(c = 0; c < con->sdo_nchannels; ++c)
+		napi_assert_other(env, con->sdo_channels[c]->cob_tx == cob_tx ||
+			con->sdo_channels[c]->cob_rx == cob_rx, "SDO channel already exists");
+	napi_assert_other(env, con->sdo_nchannels >= CO_MAX_SDO_CHANNELS, "Too many SDO channels");
+	napi_assert_other(env, co_bus_cob_reserved(con->bus, cob_rx),
+		"COB-ID reserved for the nodes of the bus");
+
+	status = napi_get_uv_event_loop(env, &loop);
+	napi_assert(env, status);
+
+	/* Create the channel */
+	ch = (co_t_sdo_channel *)calloc(1, sizeof(co_t_sdo_channel));
+	napi_assert_other(env, ch == NULL, "Cannot allocate SDO channel");
+	ch->con = con;
+	ch->cob_tx = cob_tx;
+	ch->cob_rx = cob_rx;
+	if(co_bus_add_route(con->bus, ch) < 0){
+		free(ch);
+		napi_throw_error(env, NULL, "Cannot route the SDO channel");
+		return g_napi_null;
+	}
+	uv_timer_init(loop, &ch->uvt);
+	ch->uvt.data = ch;
+	con->sdo_channels[con->sdo_nchannels++] = ch;
+
+	/* Maybe some requests are waiting */
+	co_sdo_dispatch(con);
+
+	/* Return the channel number */
+	status = napi_create_uint32(env, con->sdo_nchannels - 1, &result);
+	napi_assert(env, status);
+	return result;
+}
+
+/* Requests not finished yet (queued and in flight), to throttle bursts */
+napi_value co_sdo_pending(napi_env env, napi_callback_info info) {
+	napi_status status;
+	size_t argc = 0;
+	napi_value argv[0], result;
+	co_t_node *con;
+	unsigned int c, pending;
+
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
+	napi_assert(env, status);
+
+	pending = co_sdo_queue_size(&con->sdo_queue);
+	for(c = 0; c < con->sdo_nchannels; ++c)
+		pending += con->sdo_channels[c]->busy;
+	status = napi_create_uint32(env, pending, &result);
+	napi_assert(env, status);
+	return result;
+}
+
+//// PDO Functions /////////////////////////////////////////////////////////////
+napi_value co_pdo_send(napi_env env, napi_callback_info info) {
+	napi_status status;
+	size_t argc = 2;
+	napi_value argv[2];
+	napi_valuetype vt = napi_undefined;
+	uint32_t pdoid;
+	size_t jslen;
+	void *jsdata;
+	uint8_t data[CANFD_MAX_DLEN];
+	co_t_node *con;
+	struct canfd_frame frame;
+
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);	
+	napi_assert(env, status);
+
+	/* 1. Parameter is the PDO Id */
+	status = napi_get_value_uint32(env, argv[0], &pdoid);
+	napi_assert(env, status);
+	napi_assert_other(env, pdoid > CO_PDO_ID3, "Invalid PDO id");
+
+	/* 2. Parameter is the data, or nothing to encode the mapped table */
+	if(argc >= 2){
+		status = napi_typeof(env, argv[1], &vt);
+		napi_assert(env, status);
+	}
+	if(vt == napi_undefined){
+		napi_assert_other(env, con->pdo_maps[CO_PDO_MAP_RX][pdoid] == NULL, "PDO not mapped");
+		jslen = co_pdo_map_encode(con->pdo_maps[CO_PDO_MAP_RX][pdoid], data);
+		jsdata = data;
+	}else{
+		status = napi_get_arraybuffer_info(env, argv[1], &jsdata, &jslen);
+		napi_assert(env, status);
+		napi_assert_other(env, jslen > co_pdo_max_len(con->bus), "PDO too long for the bus");
+	}
+
+	/* Fill the CANopen data */
+	co_pdo_frame(con->bus, &frame, ((0x100*pdoid)+0x200) | con->node_id, jsdata, jslen);
+
+	if(co_bus_send(con->bus, &frame) < 0)
+		napi_throw_error(con->env, NULL, "Cannot write socket");
+
+	return g_napi_null;
+}
+
+napi_value co_pdo_send_many(napi_env env, napi_callback_info info) {
+	napi_status status;
+	size_t argc = 1;
+	napi_value argv[1];
+	size_t jslen, pos;
+	uint8_t *jsdata;
+	co_t_node *con;
+	struct canfd_frame frames[CO_TX_BATCH];
+	unsigned int count = 0;
+	uint8_t pdoid, len;
+
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
+	napi_assert(env, status);
+
+	/* 1. Parameter is the packed PDOs: [PDO Id, length, data...]... */
+	status = napi_get_arraybuffer_info(env, argv[0], (void **)&jsdata, &jslen);
+	napi_assert(env, status);
+
+	for(pos = 0; pos < jslen; pos += 2 + len){
+		napi_assert_other(env, jslen - pos < 2, "Truncated PDO list");
+		pdoid = jsdata[pos];
+		len = jsdata[pos+1];
+		napi_assert_other(env, pdoid > CO_PDO_ID3, "Invalid PDO id");
+		napi_assert_other(env, len > co_pdo_max_len(con->bus), "PDO too long for the bus");
+		napi_assert_other(env, jslen - pos - 2 < len, "Truncated PDO list");
+
+		/* Fill the CANopen data */
+		co_pdo_frame(con->bus, &frames[count], ((0x100*pdoid)+0x200) | con->node_id,
+			&jsdata[pos+2], len);
+
+		/* Flush, if the batch is full */
+		if(++count == CO_TX_BATCH){
+			napi_assert_other(env, co_bus_send_many(con->bus, frames, count) != (int)count,
+				"Cannot write socket");
+			count = 0;
+		}
+	}
+	if(count > 0)
+		napi_assert_other(env, co_bus_send_many(con->bus, frames, count) != (int)count,
+			"Cannot write socket");
+
+	return g_napi_null;
+}
+
+napi_value co_pdo_map(napi_env env, napi_callback_info info) {
+	napi_status status;
+	size_t argc = 5;
+	napi_value argv[5], arraybuffer;
+	napi_valuetype vt;
+	napi_typedarray_type type, table_type;
+	uint32_t pdoid, dir, *mapping, object, index, bits = 0;
+	uint8_t *flags = NULL;
+	size_t count, table_len, flags_len = 0, offset;
+	void *table;
+	co_t_pdo_map *m;
+	co_t_node *con;
+	unsigned int n;
+
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
+	napi_assert(env, status);
+
+	/* 1. Parameter is the PDO Id */
+	status = napi_get_value_uint32(env, argv[0], &pdoid);
+	napi_assert(env, status);
+	napi_assert_other(env, pdoid > CO_PDO_ID3, "Invalid PDO id");
+
+	/* 2. Parameter is the direction: PDO_MAP_TX (received) or PDO_MAP_RX (sent) */
+	status = napi_get_value_uint32(env, argv[1], &dir);
+	napi_assert(env, status);
+	napi_assert_other(env, dir > CO_PDO_MAP_RX, "Invalid PDO direction");
+
+	/* 3. Parameter is the mapping (Uint32Array of 0x1A00/0x1600 sub 1..n),
+	      undefined removes the mapping */
+	status = napi_typeof(env, argv[2], &vt);
+	napi_assert(env, status);
+	if(vt == napi_undefined || vt == napi_null){
+		co_pdo_map_release(con, dir, pdoid);
+		return g_napi_null;
+	}
+	status = napi_get_typedarray_info(env, argv[2], &type, &count, (void **)&mapping,
+		&arraybuffer, &offset);
+	napi_assert(env, status);
+	napi_assert_other(env, type != napi_uint32_array || count > CO_PDO_MAP_MAX,
+		"Invalid PDO mapping");
+
+	/* 4. Parameter is the table (Float64Array, Float32Array, Int32Array or Uint32Array) */
+	status = napi_get_typedarray_info(env, argv[3], &table_type, &table_len, &table,
+		&arraybuffer, &offset);
+	napi_assert(env, status);
+	napi_assert_other(env, table_type != napi_float64_array &&
+		table_type != napi_float32_array && table_type != napi_int32_array &&
+		table_type != napi_uint32_array, "Invalid PDO table");
+	napi_assert_other(env, table_len < count, "PDO table too small");
+
+	/* Optional 5. Parameter is the flags of each entry (Uint8Array) */
+	if(argc >= 5){
+		status = napi_typeof(env, argv[4], &vt);
+		napi_assert(env, status);
+		if(vt != napi_undefined){
+			status = napi_get_typedarray_info(env, argv[4], &type, &flags_len,
+				(void **)&flags, &arraybuffer, &offset);
+			napi_assert(env, status);
+			napi_assert_other(env, type != napi_uint8_array, "Invalid PDO flags");
+		}
+	}
+
+	/* Compile the mapping */
+	m = (co_t_pdo_map *)calloc(1, sizeof(co_t_pdo_map));
+	napi_assert_other(env, m == NULL, "Cannot allocate PDO map");
+	for(n = 0; n < count; ++n){
+		object = mapping[n];
+		index = object >> 16;
+		m->entries[n].offset = bits;
+		m->entries[n].length = object & 0xFF;
+		m->entries[n].flags = n < flags_len ? flags[n] & (CO_PDO_MAP_SIGNED|CO_PDO_MAP_FLOAT) : 0;
+		/* Dummy mapping, the index is the data type */
+		if(index >= 0x0001 && index <= 0x0007)
+			m->entries[n].flags = CO_PDO_MAP_SKIP;
+		bits += m->entries[n].length;
+		if(m->entries[n].length == 0 || m->entries[n].length > 64 ||
+				bits > co_pdo_max_len(con->bus) * 8 ||
+				(m->entries[n].flags & CO_PDO_MAP_FLOAT &&
+				m->entries[n].length != 32 && m->entries[n].length != 64)){
+			free(m);
+			napi_throw_error(env, NULL, "Invalid PDO mapping");
+			return g_napi_null;
+		}
+	}
+	m->count = count;
+	m->size = (bits + 7) / 8;
+	m->table = table;
+	m->table_type = table_type;
+	status = napi_create_reference(env, argv[3], 1, &m->table_ref);
+	if(status != napi_ok){
+		free(m);
+		napi_throw_last_error(env);
+		return g_napi_null;
+	}
+	co_pdo_map_release(con, dir, pdoid);
+	con->pdo_maps[dir][pdoid] = m;
+
+	return g_napi_null;
+}
+
+napi_value co_pdo_recv(napi_env env, napi_callback_info info) {
+	napi_status status;
+	size_t argc = 1;
+	napi_value argv[1], tmp;
+	napi_valuetype vt;
+	co_t_node *con;
+
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
+	napi_assert(env, status);
+
+	/* 1. Parameter is the callback */
+	status = napi_typeof(env, argv[0], &vt);
+	napi_assert(env, status);
+	napi_assert_other(env, vt != napi_function, "Invalid callback");
+	status = napi_create_string_utf8(env, "PDO Callback Context", NAPI_AUTO_LENGTH, &tmp);
+	napi_assert(env, status);
+	/* Delete the previous callback, if there is already one. */
+	if(con->pdo_cb_ref != NULL){
+		status = napi_async_destroy(con->env, con->pdo_cb_ctx);
+		napi_assert(env, status);
+		status = napi_delete_reference(con->env, con->pdo_cb_ref);
+		napi_assert(env, status);
+	}
+	status = napi_async_init(env, NULL, tmp, &con->pdo_cb_ctx);
+	napi_assert(env, status);
+	status = napi_create_reference(env, argv[0], 1, &con->pdo_cb_ref);
+	napi_assert(env, status);
+
+	return g_napi_null;
+}
+
+napi_value co_pdo_recv_batch(napi_env env, napi_callback_info info) {
+	napi_status status;
+	size_t argc = 1;
+	napi_value argv[1], tmp;
+	napi_valuetype vt;
+	co_t_node *con;
+
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
+	napi_assert(env, status);
+
+	/* 1. Parameter is the callback, undefined goes back to pdo_recv */
+	status = napi_typeof(env, argv[0], &vt);
+	napi_assert(env, status);
+	napi_assert_other(env, vt != napi_function && vt != napi_undefined, "Invalid callback");
+	/* Delete the previous callback, if there is already one. */
+	if(con->batch_cb_ref != NULL){
+		status = napi_async_destroy(con->env, con->batch_cb_ctx);
+		napi_assert(env, status);
+		status = napi_delete_reference(con->env, con->batch_cb_ref);
+		napi_assert(env, status);
+		con->batch_cb_ref = NULL;
+	}
+	if(vt == napi_undefined) return g_napi_null;
+	status = napi_create_string_utf8(env, "PDO Batch Callback Context", NAPI_AUTO_LENGTH, &tmp);
+	napi_assert(env, status);
+	status = napi_async_init(env, NULL, tmp, &con->batch_cb_ctx);
+	napi_assert(env, status);
+	status = napi_create_reference(env, argv[0], 1, &con->batch_cb_ref);
+	napi_assert(env, status);
+
+	return g_napi_null;
+}
+
+napi_value co_pdo_ring(napi_env env, napi_callback_info info) {
+	napi_status status;
+	size_t argc = 2;
+	napi_value argv[2], tmp, result;
+	napi_valuetype vt;
+	uint32_t slots;
+	co_t_node *con;
+	co_t_pdo_ring *r;
+	size_t size;
+
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
+	napi_assert(env, status);
+
+	/* 1. Parameter is the number of slots, 0 goes back to pdo_recv */
+	status = napi_get_value_uint32(env, argv[0], &slots);
+	napi_assert(env, status);
+	napi_assert_other(env, slots > 0x100000, "Too many slots");
+	napi_assert_other(env, (slots & (slots - 1)) != 0, "Slots must be a power of 2");
+
+	/* 2. Parameter is the callback (optional), called once per loop */
+	status = napi_typeof(env, argv[1], &vt);
+	napi_assert(env, status);
+	napi_assert_other(env, vt != napi_function && vt != napi_undefined, "Invalid callback");
+
+	/* Delete the previous ring, if there is already one. */
+	co_pdo_ring_release(con);
+	if(slots == 0) return g_napi_null;
+
+	/* Allocate the ring, javascript owns the memory */
+	size = sizeof(co_t_pdo_ring) + slots * sizeof(co_t_pdo_ring_slot);
+	r = (co_t_pdo_ring *)calloc(1, size);
+	napi_assert_other(env, r == NULL, "Cannot allocate ring");
+	r->slots = slots;
+	status = napi_create_external_arraybuffer(env, r, size, co_free_arraybuffer, NULL, &result);
+	if(status != napi_ok){
+		free(r);
+		napi_throw_last_error(env);
+		return g_napi_null;
+	}
+	status = napi_create_reference(env, result, 1, &con->ring_ref);
+	napi_assert(env, status);
+
+	if(vt == napi_function){
+		status = napi_create_string_utf8(env, "PDO Ring Callback Context", NAPI_AUTO_LENGTH, &tmp);
+		napi_assert(env, status);
+		status = napi_async_init(env, NULL, tmp, &con->ring_cb_ctx);
+		napi_assert(env, status);
+		status = napi_create_reference(env, argv[1], 1, &con->ring_cb_ref);
+		napi_assert(env, status);
+	}
+	con->ring = r;
+	con->ring_notified = r->head;
+
+	return result;
+}
+
+napi_value co_pdo_cyclic(napi_env env, napi_callback_info info) {
+	napi_status status;
+	size_t argc = 3;
+	napi_value argv[3];
+	napi_valuetype vt = napi_undefined;
+	uint32_t pdoid, period = 0;
+	co_t_cyclic *e;
+	co_t_node *con;
+	void *jsdata;
+	size_t jslen;
+
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
+	napi_assert(env, status);
+
+	/* 1. Parameter is the PDO Id */
+	status = napi_get_value_uint32(env, argv[0], &pdoid);
+	napi_assert(env, status);
+	napi_assert_other(env, pdoid > CO_PDO_ID3, "Invalid PDO id");
+
+	/* 2. Parameter is the data (ArrayBuffer or TypedArray), read at each period,
+	      undefined stops sending */
+	if(argc >= 2){
+		status = napi_typeof(env, argv[1], &vt);
+		napi_assert(env, status);
+	}
+
+	/* 3. Parameter is the period in microseconds */
+	if(argc >= 3){
+		status = napi_get_value_uint32(env, argv[2], &period);
+		napi_assert(env, status);
+	}
+
+	/* Replace the previous one */
+	co_cyclic_remove(con, pdoid);
+	if(vt == napi_undefined || vt == napi_null || period == 0) return g_napi_null;
+	napi_assert_other(env, period < 100, "PDO period < 100 us");
+	status = co_get_buffer_info(env, argv[1], &jsdata, &jslen);
+	napi_assert(env, status);
+	napi_assert_other(env, jslen > co_pdo_max_len(con->bus), "PDO too long for the bus");
+
+	e = (co_t_cyclic *)calloc(1, sizeof(co_t_cyclic));
+	napi_assert_other(env, e == NULL, "Cannot allocate cyclic PDO");
+	e->con = con;
+	e->pdo_id = pdoid;
+	e->cob_id = ((0x100*pdoid)+0x200) | con->node_id;
+	e->data = (uint8_t *)jsdata;
+	e->len = jslen;
+	e->period = (uint64_t)period * 1000;
+	status = napi_create_reference(env, argv[1], 1, &e->data_ref);
+	if(status != napi_ok){
+		free(e);
+		napi_throw_last_error(env);
+		return g_napi_null;
+	}
+	if(co_cyclic_add(con->bus, e) < 0){
+		napi_delete_reference(env, e->data_ref);
+		free(e);
+		napi_throw_error(env, NULL, "Cannot start cyclic PDO thread");
+	}
+
+	return g_napi_null;
+}
+
+napi_value co_pdo_cyclic_stats(napi_env env, napi_callback_info info) {
+	napi_status status;
+	napi_value result, entry, tmp;
+	co_t_cyclic_sched *s;
+	co_t_node *con;
+	unsigned int i, n = 0;
+
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, NULL, NULL, NULL, (void **)&con);
+	napi_assert(env, status);
+	s = &con->bus->cyclic;
+
+	/* [{pdo_id, period, sent, missed}] of this node */
+	status = napi_create_array(env, &result);
+	napi_assert(env, status);
+	pthread_mutex_lock(&s->lock);
+	for(i = 0; i < s->count && status == napi_ok; ++i){
+		if(s->entries[i]->con != con) continue;
+		status = napi_create_object(env, &entry);
+		if(status == napi_ok)
+			status = napi_create_uint32(env, s->entries[i]->pdo_id, &tmp);
+		if(status == napi_ok)
+			status = napi_set_named_property(env, entry, "pdo_id", tmp);
+		if(status == napi_ok)
+			status = napi_create_uint32(env, s->entries[i]->period / 1000, &tmp);
+		if(status == napi_ok)
+			status = napi_set_named_property(env, entry, "period", tmp);
+		if(status == napi_ok)
+			status = napi_create_int64(env, s->entries[i]->sent, &tmp);
+		if(status == napi_ok)
+			status = napi_set_named_property(env, entry, "sent", tmp);
+		if(status == napi_ok)
+			status = napi_create_int64(env, s->entries[i]->missed, &tmp);
+		if(status == napi_ok)
+			status = napi_set_named_property(env, entry, "missed", tmp);
+		if(status == napi_ok)
+			status = napi_set_element(env, result, n++, entry);
+	}
+	pthread_mutex_unlock(&s->lock);
+	napi_assert(env, status);
+
+	return result;
+}
+
+napi_value co_process_image(napi_env env, napi_callback_info info) {
+	napi_status status;
+	size_t argc = 2;
+	napi_value argv[2], tmp;
+	napi_valuetype vt = napi_undefined;
+	co_t_image *img;
+	co_t_node *con;
+	size_t len;
+
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
+	napi_assert(env, status);
+
+	/* 1. Parameter is the image, a TypedArray on a SharedArrayBuffer
+	      of PROCESS_IMAGE_SIZE bytes, undefined stops updating it */
+	if(argc >= 1){
+		status = napi_typeof(env, argv[0], &vt);
+		napi_assert(env, status);
+	}
+	if(vt == napi_undefined || vt == napi_null){
+		co_image_release(con);
+		return g_napi_null;
+	}
+	status = co_get_buffer_info(env, argv[0], (void **)&img, &len);
+	napi_assert(env, status);
+	napi_assert_other(env, len < CO_IMAGE_SIZE, "Process image too small");
+	napi_assert_other(env, (uintptr_t)img & 7, "Process image not aligned");
+
+	/* Optional 2. Parameter is the callback, called once per loop */
+	vt = napi_undefined;
+	if(argc >= 2){
+		status = napi_typeof(env, argv[1], &vt);
+		napi_assert(env, status);
+		napi_assert_other(env, vt != napi_function && vt != napi_undefined, "Invalid callback");
+	}
+
+	/* Replace the previous image */
+	co_image_release(con);
+	status = napi_create_reference(env, argv[0], 1, &con->image_ref);
+	napi_assert(env, status);
+	if(vt == napi_function){
+		status = napi_create_string_utf8(env, "Process Image Callback Context", NAPI_AUTO_LENGTH, &tmp);
+		napi_assert(env, status);
+		status = napi_async_init(env, NULL, tmp, &con->image_cb_ctx);
+		napi_assert(env, status);
+		status = napi_create_reference(env, argv[1], 1, &con->image_cb_ref);
+		napi_assert(env, status);
+	}
+
+	/* Nothing received yet */
+	memset(img, 0, CO_IMAGE_SIZE);
+	img->hb_state = CO_IMAGE_NONE;
+	con->image = img;
+
+	return g_napi_null;
+}
+
+//// Latency Functions /////////////////////////////////////////////////////////
+napi_value co_latency(napi_env env, napi_callback_info info) {
+	napi_status status;
+	size_t argc = 1;
+	napi_value argv[1], result, tmp;
+	napi_valuetype vt;
+	bool reset = false;
+	co_t_node *con;
+
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
+	napi_assert(env, status);
+
+	/* Optional 1. Parameter resets the histograms */
+	if(argc >= 1){
+		status = napi_typeof(env, argv[0], &vt);
+		napi_assert(env, status);
+		if(vt != napi_undefined){
+			status = napi_get_value_bool(env, argv[0], &reset);
+			napi_assert(env, status);
+		}
+	}
+
+	/* Summary of both histograms */
+	status = napi_create_object(env, &result);
+	napi_assert(env, status);
+	status = co_hist_summary(env, &con->rx_latency, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, result, "rx", tmp);
+	napi_assert(env, status);
+	status = co_hist_summary(env, &con->sdo_latency, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, result, "sdo", tmp);
+	napi_assert(env, status);
+
+	if(reset){
+		memset(&con->rx_latency, 0, sizeof(co_t_hist));
+		memset(&con->sdo_latency, 0, sizeof(co_t_hist));
+	}
+	return result;
+}
+
+//// Metrics Functions /////////////////////////////////////////////////////////
+napi_value co_metrics(napi_env env, napi_callback_info info) {
+	napi_status status;
+	size_t argc = 1, jslen;
+	napi_value argv[1], result;
+	napi_valuetype vt = napi_undefined;
+	co_t_bus_metrics *m;
+	co_t_node *con;
+	void *jsdata;
+
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
+	napi_assert(env, status);
+
+	/* Optional 1. Parameter is the buffer to fill, to read without allocating */
+	if(argc >= 1){
+		status = napi_typeof(env, argv[0], &vt);
+		napi_assert(env, status);
+	}
+	if(vt == napi_undefined){
+		status = napi_create_arraybuffer(env, CO_METRICS_SIZE, &jsdata, &result);
+		napi_assert(env, status);
+	}else{
+		status = co_get_buffer_info(env, argv[0], &jsdata, &jslen);
+		napi_assert(env, status);
+		napi_assert_other(env, jslen < CO_METRICS_SIZE, "Buffer too small");
+		result = argv[0];
+	}
+
+	/* Snapshot: the bus, then the node */
+	m = (co_t_bus_metrics *)jsdata;
+	memcpy(m, &con->bus->metrics, sizeof(co_t_bus_metrics));
+	m->rx_ring_full = __atomic_load_n(&con->bus->rx_ring.dropped, __ATOMIC_RELAXED);
+	memcpy(&m[1], &con->metrics, sizeof(co_t_node_metrics));
+	return result;
+}
+
+//// Heartbeat Consumer Functions //////////////////////////////////////////////
+napi_value co_hb_consumer(napi_env env, napi_callback_info info) {
+	napi_status status;
+	size_t argc = 1;
+	napi_value argv[1], tmp;
+	napi_valuetype vt = napi_undefined;
+	co_t_node *con;
+	co_t_bus *bus;
+	unsigned int i;
+
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
+	napi_assert(env, status);
+	bus = con->bus;
+
+	/* 1. Parameter is the callback (node id, state or Error, timestamp)
+	      for the whole bus, undefined stops consuming */
+	if(argc >= 1){
+		status = napi_typeof(env, argv[0], &vt);
+		napi_assert(env, status);
+		napi_assert_other(env, vt != napi_function && vt != napi_undefined &&
+			vt != napi_null, "Invalid callback");
+	}
+	co_hb_consumer_release(bus);
+	if(vt != napi_function) return g_napi_null;
+
+	status = napi_create_string_utf8(env, "HB Consumer Callback Context", NAPI_AUTO_LENGTH, &tmp);
+	napi_assert(env, status);
+	status = napi_async_init(env, NULL, tmp, &bus->hb.cb_ctx);
+	napi_assert(env, status);
+	status = napi_create_reference(env, argv[0], 1, &bus->hb.cb_ref);
+	napi_assert(env, status);
+	bus->hb.enabled = true;
+
+	/* Start the wheel, the watched nodes get their first deadline */
+	uv_update_time(bus->hb.uvt.loop);
+	bus->hb.tick = uv_now(bus->hb.uvt.loop) / CO_HB_TICK;
+	for(i = 0; i < CO_MAX_NODES; ++i)
+		co_hb_schedule(bus, &bus->hb.entries[i]);
+	uv_timer_start(&bus->hb.uvt, co_hb_tick_cb, CO_HB_TICK, CO_HB_TICK);
+
+	return g_napi_null;
+}
+
+napi_value co_hb_watch(napi_env env, napi_callback_info info) {
+	napi_status status;
+	size_t argc = 2;
+	napi_value argv[2];
+	uint32_t node_id, timeout;
+	co_t_hb_entry *e;
+	co_t_node *con;
+
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
+	napi_assert(env, status);
+
+	/* 1. Parameter is the node id */
+	status = napi_get_value_uint32(env, argv[0], &node_id);
+	napi_assert(env, status);
+	napi_assert_other(env, node_id < 1 || node_id >= CO_MAX_NODES, "Invalid node id");
+
+	/* 2. Parameter is the consumer time in ms (0x1016), 0 stops watching */
+	status = napi_get_value_uint32(env, argv[1], &timeout);
+	napi_assert(env, status);
+	napi_assert_other(env, timeout > 0xFFFF, "Invalid heartbeat time");
+
+	uv_update_time(con->bus->hb.uvt.loop);
+	e = &con->bus->hb.entries[node_id];
+	e->timeout = timeout;
+	e->expired = false;
+	co_hb_schedule(con->bus, e);
+
+	return g_napi_null;
+}
+
+//// EMCY Functions ////////////////////////////////////////////////////////////
+napi_value co_emcy(napi_env env, napi_callback_info info) {
+	napi_status status;
+	size_t argc = 1;
+	napi_value argv[1], tmp;
+	napi_valuetype vt;
+	co_t_node *con;
+
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
+	napi_assert(env, status);
+
+	/* 1. Parameter is the callback (code, register, data, timestamp) */
+	status = napi_typeof(env, argv[0], &vt);
+	napi_assert(env, status);
+	napi_assert_other(env, vt != napi_function, "Invalid callback");
+
+	/* Delete the previous callback, if there is already one. */
+	if(con->emcy_cb_ref != NULL){
+		status = napi_async_destroy(con->env, con->emcy_cb_ctx);
+		napi_assert(env, status);
+		status = napi_delete_reference(con->env, con->emcy_cb_ref);
+		napi_assert(env, status);
+	}
+	status = napi_create_string_utf8(env, "EMCY Callback Context", NAPI_AUTO_LENGTH, &tmp);
+	napi_assert(env, status);
+	status = napi_async_init(env, NULL, tmp, &con->emcy_cb_ctx);
+	napi_assert(env, status);
+	status = napi_create_reference(env, argv[0], 1, &con->emcy_cb_ref);
+	napi_assert(env, status);
+
+	return g_napi_null;
+}
+
+//// Reflex Functions //////////////////////////////////////////////////////////
+napi_value co_reflex_load(napi_env env, napi_callback_info info) {
+	napi_status status;
+	size_t argc = 2;
+	napi_value argv[2], tmp;
+	napi_valuetype vt = napi_undefined;
+	co_t_reflex_rule *rules, *new_rules, *r;
+	co_t_reflex_output (*outputs)[4];
+	co_t_reflex *x;
+	co_t_node *con;
+	uint8_t *last;
+	void *jsdata;
+	size_t jslen, count, i;
+
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
+	napi_assert(env, status);
+	x = &con->bus->reflex;
+
+	/* 1. Parameter is the rules, REFLEX_RULE bytes each, undefined removes them */
+	if(argc >= 1){
+		status = napi_typeof(env, argv[0], &vt);
+		napi_assert(env, status);
+	}
+	if(vt == napi_undefined || vt == napi_null){
+		co_reflex_release(con->bus);
+		return g_napi_null;
+	}
+	status = co_get_buffer_info(env, argv[0], &jsdata, &jslen);
+	napi_assert(env, status);
+	count = jslen / sizeof(co_t_reflex_rule);
+	napi_assert_other(env, jslen % sizeof(co_t_reflex_rule) != 0 ||
+		count > CO_REFLEX_MAX_RULES, "Invalid reflex rules");
+
+	/* Optional 2. Parameter is the callback (reports, lost), once per loop */
+	vt = napi_undefined;
+	if(argc >= 2){
+		status = napi_typeof(env, argv[1], &vt);
+		napi_assert(env, status);
+		napi_assert_other(env, vt != napi_function && vt != napi_undefined, "Invalid callback");
+	}
+
+	/* Check all the rules, the receive path trusts them */
+	rules = (co_t_reflex_rule *)jsdata;
+	for(i = 0; i < count; ++i){
+		r = &rules[i];
+		if(r->src_node >= CO_MAX_NODES || r->dst_node >= CO_MAX_NODES ||
+				r->src_pdo > CO_PDO_ID3 || r->dst_pdo > CO_PDO_ID3 || r->len > 8 ||
+				(r->type == CO_REFLEX_PDO_BIT && (r->src_node == 0 ||
+					r->dst_node == 0 || r->src_bit > 63 || r->dst_bit > 63)) ||
+				(r->type == CO_REFLEX_EMCY && (r->actions & CO_REFLEX_SEND) &&
+					r->dst_node == 0) ||
+				(r->type != CO_REFLEX_PDO_BIT && r->type != CO_REFLEX_EMCY)){
+			napi_throw_error(env, NULL, "Invalid reflex rule");
+			return g_napi_null;
+		}
+	}
+
+	if(count == 0){
+		co_reflex_release(con->bus);
+		return g_napi_null;
+	}
 
-	napi_close_handle_scope(con->env, nhs);
-}
+	/* Build the new tables, the previous rules stay until these are accepted */
+	new_rules = (co_t_reflex_rule *)malloc(count * sizeof(co_t_reflex_rule));
+	last = (uint8_t *)malloc(count);
+	outputs = (co_t_reflex_output (*)[4])calloc(CO_MAX_NODES, sizeof(*outputs));
+	if(new_rules == NULL || last == NULL || outputs == NULL){
+		free(new_rules);
+		free(last);
+		free(outputs);
+		napi_throw_error(env, NULL, "Cannot allocate reflex rules");
+		return g_napi_null;
+	}
+	memcpy(new_rules, rules, count * sizeof(co_t_reflex_rule));
+	memset(last, 0xFF, count);
+
+	/* The first rule writing a RPDO gives its length and initial data */
+	for(i = 0; i < count; ++i){
+		r = &new_rules[i];
+		if(r->type != CO_REFLEX_PDO_BIT || outputs[r->dst_node][r->dst_pdo].len) continue;
+		outputs[r->dst_node][r->dst_pdo].len = r->len;
+		memcpy(outputs[r->dst_node][r->dst_pdo].data, r->data, r->len);
+	}
+	for(i = 0; i < count; ++i){
+		r = &new_rules[i];
+		if(r->type == CO_REFLEX_PDO_BIT &&
+				r->dst_bit >= outputs[r->dst_node][r->dst_pdo].len * 8){
+			free(new_rules);
+			free(last);
+			free(outputs);
+			napi_throw_error(env, NULL, "Reflex rule bit out of the RPDO");
+			return g_napi_null;
+		}
+	}
 
-void co_can_recv_cb(uv_poll_t* handle, int status, int events) {
-	co_t_node *con = (co_t_node *)handle->data;
-	struct can_frame frame;
-	int err;
+	/* Replace the previous rules */
+	co_reflex_release(con->bus);
+	x->rules = new_rules;
+	x->last = last;
+	x->outputs = outputs;
+	if(vt == napi_function){
+		status = napi_create_string_utf8(env, "Reflex Callback Context", NAPI_AUTO_LENGTH, &tmp);
+		napi_assert(env, status);
+		status = napi_async_init(env, NULL, tmp, &x->cb_ctx);
+		napi_assert(env, status);
+		status = napi_create_reference(env, argv[1], 1, &x->cb_ref);
+		napi_assert(env, status);
+	}
+	x->count = count;
 
-	err = read(con->canfd, &frame, sizeof(struct can_frame));
-	if(err != sizeof(struct can_frame))
-		return; /* Ignore invalid can frame */
+	return g_napi_null;
+}
 
-	/* The node ID is encoded on the low 7 bits, we can safely ignore them
-	   because CAN-Filter is set to receive only messages from one node . */
-	frame.can_id >>= 7;
+//// LSS Functions /////////////////////////////////////////////////////////////
+/* Start a LSS operation of the bus, NULL if one is already running */
+napi_value co_lss_begin(napi_env env, co_t_bus *bus, co_t_lss_op op,
+		unsigned int timeout) {
+	napi_status status;
+	napi_value promise, tmp;
 
-	/* Receive an SDO */
-	if(frame.can_id == 0xB)
-		co_sdo_recv_cb(con, (co_t_sdo *)frame.data);
-	/* PDO 0-3 */
-	else if(frame.can_id == 0x3)
-		co_pdo_recv_cb(con, CO_PDO_ID0, (co_t_pdo *)frame.data, frame.can_dlc);
-	else if(frame.can_id == 0x5)
-		co_pdo_recv_cb(con, CO_PDO_ID1, (co_t_pdo *)frame.data, frame.can_dlc);
-	else if(frame.can_id == 0x7)
-		co_pdo_recv_cb(con, CO_PDO_ID2, (co_t_pdo *)frame.data, frame.can_dlc);
-	else if(frame.can_id == 0x9)
-		co_pdo_recv_cb(con, CO_PDO_ID3, (co_t_pdo *)frame.data, frame.can_dlc);
-	/* Heartbeat */
-	else if(frame.can_id == 0xE)
-		co_hb_recv_cb(con, (co_t_hb *)frame.data);
+	if(bus->lss.op != CO_LSS_IDLE){
+		napi_throw_error(env, NULL, "LSS operation in progress");
+		return NULL;
+	}
+	if(bus->lss.ctx == NULL){
+		status = napi_create_string_utf8(env, "LSS Promise Context", NAPI_AUTO_LENGTH, &tmp);
+		if(status == napi_ok)
+			status = napi_async_init(env, NULL, tmp, &bus->lss.ctx);
+		if(status != napi_ok){
+			napi_throw_last_error(env);
+			return NULL;
+		}
+	}
+	status = napi_create_promise(env, &bus->lss.deferred, &promise);
+	if(status != napi_ok){
+		napi_throw_last_error(env);
+		return NULL;
+	}
+	bus->lss.op = op;
+	bus->lss.timeout = timeout;
+	if(op != CO_LSS_OP_FASTSCAN){
+		uv_update_time(bus->lss.uvt.loop);
+		uv_timer_start(&bus->lss.uvt, co_lss_timeout_cb, timeout, 0);
+	}
+	return promise;
 }
 
-//// NMT Functions /////////////////////////////////////////////////////////////
-napi_value co_nmt_send(napi_env env, napi_callback_info info) {
+napi_value co_lss_switch_global(napi_env env, napi_callback_info info) {
 	napi_status status;
 	size_t argc = 1;
 	napi_value argv[1];
+	uint32_t mode;
+	uint8_t data[1];
 	co_t_node *con;
-	uint32_t state; /* Use uint32_t and not enum co_e_nmt_state */
-	struct can_frame frame;
-	co_t_nmt *n = (co_t_nmt *)frame.data;
 
 	/* Get arguments */
 	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
 	napi_assert(env, status);
 
-	/* 1. Parameter is the state to send */
-	status = napi_get_value_uint32(env, argv[0], &state);
+	/* 1. Parameter is the mode: 0 waiting, 1 configuration */
+	status = napi_get_value_uint32(env, argv[0], &mode);
 	napi_assert(env, status);
+	napi_assert_other(env, mode > 1, "Invalid LSS mode");
 
-	/* Send the NMT command */
-	frame.can_id = 0x000;
-	n->state = state;
-	n->node_id = con->node_id;
-	frame.can_dlc = sizeof(co_t_nmt);
-	if(write(con->canfd, &frame, sizeof(struct can_frame)) < 0)
-		napi_throw_error(con->env, NULL, "Cannot write socket");
+	/* No answer to this one */
+	data[0] = mode;
+	if(co_lss_send(con->bus, CO_LSS_SWITCH_GLOBAL, data, sizeof(data)) < 0)
+		napi_throw_error(env, NULL, "Cannot write socket");
 
 	return g_napi_null;
 }
 
-//// Heartbeat Functions ///////////////////////////////////////////////////////
-napi_value co_heartbeat(napi_env env, napi_callback_info info) {
+napi_value co_lss_switch_selective(napi_env env, napi_callback_info info) {
 	napi_status status;
-	size_t argc = 1;
-	napi_value argv[1], tmp;
-	napi_valuetype vt;
+	size_t argc = 4;
+	napi_value argv[4], promise;
+	uint32_t address[4];
 	co_t_node *con;
-	struct can_frame frame;
-	co_t_hb *d = (co_t_hb *)frame.data;
+	unsigned int i;
 
 	/* Get arguments */
 	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
 	napi_assert(env, status);
 
-	/* 1. Parameter is the callback, mandatory only the first time */
-	if(argc >= 1 || con->hb_cb_ref == NULL) {
-		status = napi_typeof(env, argv[0], &vt);
-		napi_assert(env, status);
-		napi_assert_other(env, vt != napi_function, "Invalid callback");
-		status = napi_create_string_utf8(env, "HB Callback Context", NAPI_AUTO_LENGTH, &tmp);
-		napi_assert(env, status);
-		/* Delete the previous callback, if there is already one. */
-		if(con->hb_cb_ref != NULL){
-			status = napi_async_destroy(con->env, con->hb_cb_ctx);
-			napi_assert(env, status);
-			status = napi_delete_reference(con->env, con->hb_cb_ref);
-			napi_assert(env, status);
-		}
-		status = napi_async_init(env, NULL, tmp, &con->hb_cb_ctx);
-		napi_assert(env, status);
-		status = napi_create_reference(env, argv[0], 1, &con->hb_cb_ref);
+	/* 1-4. Parameters are the vendor, product, revision and serial number */
+	napi_assert_other(env, argc < 4, "Missing LSS address");
+	for(i = 0; i < 4; ++i){
+		status = napi_get_value_uint32(env, argv[i], &address[i]);
 		napi_assert(env, status);
 	}
 
-	/* Send a heartbeat */
-	frame.can_id = (0x700+con->node_id) | CAN_RTR_FLAG;
-	d->byte = 0;
-	frame.can_dlc = sizeof(co_t_hb);
-	if(write(con->canfd, &frame, sizeof(struct can_frame)) < 0)
-		napi_throw_error(con->env, NULL, "Cannot write socket");
-	uv_timer_start(&con->hb_uvt, co_hb_timeout_cb, con->hb_wait_time, 0);
+	promise = co_lss_begin(env, con->bus, CO_LSS_OP_SELECTIVE, CO_LSS_TIMEOUT);
+	if(promise == NULL) return g_napi_null;
+	for(i = 0; i < 4; ++i)
+		co_lss_send(con->bus, CO_LSS_SWITCH_VENDOR + i, (uint8_t *)&address[i], 4);
 
-	return g_napi_null;
+	return promise;
 }
 
-//// SDO Functions /////////////////////////////////////////////////////////////
-napi_value co_sdo_download(napi_env env, napi_callback_info info) {
+napi_value co_lss_configure_node_id(napi_env env, napi_callback_info info) {
 	napi_status status;
-	size_t argc = 4;
-	napi_value argv[4], tmp;
-	uint32_t index, subindex;
-	void *jsdata;
-	size_t jslen;
-	napi_valuetype vt;
+	size_t argc = 1;
+	napi_value argv[1], promise;
+	uint32_t node_id;
+	uint8_t data[1];
 	co_t_node *con;
-	struct can_frame *frame;
-	co_t_sdo *s;
-	co_t_sdo_queue_item *i;
-	uint8_t unused_bytes;
 
 	/* Get arguments */
 	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
 	napi_assert(env, status);
 
-	/* 1. Parameter is the index */
-	status = napi_get_value_uint32(env, argv[0], &index);
+	/* 1. Parameter is the node id, 255 for unconfigured */
+	status = napi_get_value_uint32(env, argv[0], &node_id);
 	napi_assert(env, status);
+	napi_assert_other(env, (node_id < 1 || node_id >= CO_MAX_NODES) && node_id != 255,
+		"Invalid node id");
 
-	/* 2. Parameter is the subindex */
-	status = napi_get_value_uint32(env, argv[1], &subindex);
-	napi_assert(env, status);
+	promise = co_lss_begin(env, con->bus, CO_LSS_OP_CONFIGURE, CO_LSS_TIMEOUT);
+	if(promise == NULL) return g_napi_null;
+	data[0] = node_id;
+	co_lss_send(con->bus, CO_LSS_CONFIGURE_NODE_ID, data, sizeof(data));
 
-	/* 3. Parameter is the data */
-	status = napi_get_arraybuffer_info(env, argv[2], &jsdata, &jslen);
-	napi_assert(env, status);
-	napi_assert_other(env, jslen > 4, "Unimplemented SDO request (length >4)");
+	return promise;
+}
 
-	/* 4. Parameter is the callback */
-	status = napi_typeof(env, argv[3], &vt);
+napi_value co_lss_store(napi_env env, napi_callback_info info) {
+	napi_status status;
+	napi_value promise;
+	co_t_node *con;
+
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, NULL, NULL, NULL, (void **)&con);
 	napi_assert(env, status);
-	napi_assert_other(env, vt != napi_function, "Invalid callback");
 
-	/* Get a free queue item */
-	i = co_sdo_queue_push(&con->sdo_queue);
-	napi_assert_other(env, i == NULL, "SDO queue full!")
+	promise = co_lss_begin(env, con->bus, CO_LSS_OP_STORE, CO_LSS_TIMEOUT);
+	if(promise == NULL) return g_napi_null;
+	co_lss_send(con->bus, CO_LSS_STORE, NULL, 0);
 
-	/* Save the callback */
-	status = napi_create_string_utf8(env, "SDO Callback Context", NAPI_AUTO_LENGTH, &tmp);
-	napi_assert(env, status);
-	status = napi_async_init(env, NULL, tmp, &i->cb_ctx);
-	napi_assert(env, status);
-	status = napi_create_reference(env, argv[3], 1, &i->cb_ref);
-	napi_assert(env, status);
+	return promise;
+}
 
-	/* Fill the CANopen data */
-	frame = &i->cf;
-	s = (co_t_sdo *) frame->data;
-	frame->can_id = 0x600+con->node_id;
-	unused_bytes = 4 - jslen;
-	s->header.bits.cs = CO_CCS_DOWNLOAD_INIT;
-	s->header.bits.r = 0;
-	s->header.bits.n = unused_bytes;
-	s->header.bits.e = 1;
-	s->header.bits.s = 1;
-	s->index = index;
-	s->subindex = subindex;
-	memcpy(s->data, jsdata, jslen);
-	memset(&s->data[jslen], 0, unused_bytes);
-	frame->can_dlc = sizeof(co_t_sdo);
+napi_value co_lss_fastscan(napi_env env, napi_callback_info info) {
+	static const char *names[] = { "vendor", "product", "revision", "serial" };
+	napi_status status;
+	size_t argc = 1;
+	napi_value argv[1], promise;
+	uint32_t timeout = CO_LSS_SCAN_TIMEOUT, id[4] = { 0 };
+	uint8_t known = 0;
+	co_t_node *con;
+	co_t_lss *l;
+	unsigned int i;
+	bool has;
 
-	/* Expected command specifier */
-	i->expected_scs = CO_SCS_DOWNLOAD_INIT_RESPONSE;
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
+	napi_assert(env, status);
+	l = &con->bus->lss;
+
+	/* Optional 1. Parameter is the options: timeout of each step (ms) and
+	   the parts of the address already known, not scanned */
+	if(argc >= 1){
+		status = napi_get_named_uint32(env, argv[0], "timeout", &timeout);
+		napi_assert(env, status);
+		for(i = 0; i < 4; ++i){
+			status = napi_get_named_uint32(env, argv[0], names[i], &id[i]);
+			napi_assert(env, status);
+			status = napi_has_named_property(env, argv[0], names[i], &has);
+			if(status == napi_ok && has) known |= 1 << i;
+		}
+	}
+	napi_assert_other(env, timeout < 1 || timeout > 1000, "Invalid LSS timeout");
 
-	/* Send if needed */
-	if(co_sdo_queue_size(&con->sdo_queue) == 1)
-		co_sdo_emit(con);
+	promise = co_lss_begin(env, con->bus, CO_LSS_OP_FASTSCAN, timeout);
+	if(promise == NULL) return g_napi_null;
+	memcpy(l->id, id, sizeof(id));
+	l->known = known;
+	l->sub = 0;
+	l->bit = CO_LSS_FASTSCAN_RESET;
+	co_lss_fastscan_step(con->bus);
 
-	return g_napi_null;
+	return promise;
 }
 
-napi_value co_sdo_upload(napi_env env, napi_callback_info info) {
+//// Trace Functions ///////////////////////////////////////////////////////////
+napi_value co_trace_start(napi_env env, napi_callback_info info) {
 	napi_status status;
-	size_t argc = 3;
-	napi_value argv[3], tmp;
-	napi_valuetype vt;
+	size_t argc = 2;
+	napi_value argv[2];
+	char path[PATH_MAX];
+	uint32_t size = CO_TRACE_SIZE;
 	co_t_node *con;
-	uint32_t index, subindex;
-	struct can_frame *frame;
-	co_t_sdo *s;
-	co_t_sdo_queue_item *i;
 
 	/* Get arguments */
 	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
 	napi_assert(env, status);
 
-	/* 1. Parameter is the index */
-	status = napi_get_value_uint32(env, argv[0], &index);
+	/* 1. Parameter is the path of the file, truncated */
+	status = napi_get_value_string_utf8(env, argv[0], path, sizeof(path), NULL);
 	napi_assert(env, status);
 
-	/* 2. Parameter is the subindex */
-	status = napi_get_value_uint32(env, argv[1], &subindex);
-	napi_assert(env, status);
+	/* Optional 2. Parameter is the options: size of the file in bytes */
+	if(argc >= 2){
+		status = napi_get_named_uint32(env, argv[1], "size", &size);
+		napi_assert(env, status);
+	}
+	napi_assert_other(env, size < sizeof(co_t_trace_header) +
+		sizeof(co_t_trace_record) + CANFD_MAX_DLEN, "Invalid trace size");
 
-	/* 3. Parameter is the callback */
-	status = napi_typeof(env, argv[2], &vt);
-	napi_assert(env, status);
-	napi_assert_other(env, vt != napi_function, "Invalid callback");
+	/* A new file replaces the recording in progress */
+	co_trace_end(&con->bus->trace);
+	napi_assert_other(env, co_trace_begin(&con->bus->trace, path, size,
+		con->bus->fd, con->bus->device) < 0, "Cannot create trace file");
 
-	/* Get a free queue item */
-	i = co_sdo_queue_push(&con->sdo_queue);
-	napi_assert_other(env, i == NULL, "SDO queue full!");
+	return g_napi_null;
+}
 
-	/* Save the callback */
-	status = napi_create_string_utf8(env, "SDO Callback Context", NAPI_AUTO_LENGTH, &tmp);
+napi_value co_trace_stop(napi_env env, napi_callback_info info) {
+	napi_status status;
+	co_t_node *con;
+
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, NULL, NULL, NULL, (void **)&con);
 	napi_assert(env, status);
-	status = napi_async_init(env, NULL, tmp, &i->cb_ctx);
+
+	co_trace_end(&con->bus->trace);
+	return g_napi_null;
+}
+
+napi_value co_trace_replay(napi_env env, napi_callback_info info) {
+	napi_status status;
+	size_t argc = 2;
+	napi_value argv[2], promise, tmp;
+	char path[PATH_MAX];
+	double speed = 1;
+	co_t_node *con;
+	co_t_replay *rp;
+	co_t_trace_header *h;
+	co_t_trace_record *r;
+	uint64_t n;
+
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
 	napi_assert(env, status);
-	status = napi_create_reference(env, argv[2], 1, &i->cb_ref);
+	rp = &con->bus->replay;
+	napi_assert_other(env, rp->running, "Replay in progress");
+
+	/* 1. Parameter is the path of the recording */
+	status = napi_get_value_string_utf8(env, argv[0], path, sizeof(path), NULL);
 	napi_assert(env, status);
 
-	/* Fill the CANopen data */
-	frame = &i->cf;
-	s = (co_t_sdo *) frame->data;
-	frame->can_id = 0x600+con->node_id;
-	s->header.bits.cs = CO_CCS_UPLOAD_INIT;
-	s->header.bits.r = 0;
-	s->header.bits.n = 0;
-	s->header.bits.e = 0;
-	s->header.bits.s = 0;
-	s->index = index;
-	s->subindex = subindex;
-	memset(s->data, 0, sizeof(s->data));
-	frame->can_dlc = sizeof(co_t_sdo);
+	/* Optional 2. Parameter is the options: speed (2: twice as fast, 0: no wait) */
+	if(argc >= 2){
+		status = napi_get_named_double(env, argv[1], "speed", &speed);
+		napi_assert(env, status);
+	}
+	napi_assert_other(env, !(speed >= 0), "Invalid speed");
+
+	h = co_trace_open(path, &rp->size);
+	napi_assert_other(env, h == NULL, "Invalid trace file");
+	if(rp->ctx == NULL){
+		status = napi_create_string_utf8(env, "Replay Promise Context", NAPI_AUTO_LENGTH, &tmp);
+		if(status == napi_ok)
+			status = napi_async_init(env, NULL, tmp, &rp->ctx);
+	}
+	if(status == napi_ok)
+		status = napi_create_promise(env, &rp->deferred, &promise);
+	if(status != napi_ok){
+		munmap(h, rp->size);
+		napi_throw_last_error(env);
+		return g_napi_null;
+	}
 
-	/* Expected command specifier */
-	i->expected_scs = CO_SCS_UPLOAD_INIT_RESPONSE;
+	/* Oldest record first, the file may have wrapped */
+	rp->header = h;
+	rp->end = h->head;
+	rp->pos = h->head > h->capacity ? h->head - h->capacity : 0;
+	/* The records are not in timestamp order (kernel stamps of the received
+	   frames, several writer threads): the timing starts at the earliest */
+	rp->first = UINT64_MAX;
+	for(n = rp->pos; n < rp->end; ++n){
+		r = co_trace_record(h, n);
+		if(!(r->flags & CO_TRACE_TX) && r->timestamp < rp->first)
+			rp->first = r->timestamp;
+	}
+	rp->start = co_now();
+	rp->speed = speed;
+	rp->count = 0;
+	rp->running = true;
+	uv_timer_start(&rp->uvt, co_replay_timer_cb, 0, 0);
 
-	/* Send if needed */
-	if(co_sdo_queue_size(&con->sdo_queue) == 1)
-		co_sdo_emit(con);
+	return promise;
+}
 
-	return g_napi_null;
+//// Scan Functions ////////////////////////////////////////////////////////////
+napi_value co_scan(napi_env env, napi_callback_info info) {
+	napi_status status;
+	size_t argc = 1;
+	napi_value argv[1], promise, tmp;
+	uint32_t parallel = 16, timeout = 50, retries = 1, nmt = 0;
+	co_t_node *con;
+	co_t_scan *sc;
+
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
+	napi_assert(env, status);
+	sc = &con->bus->scan;
+	napi_assert_other(env, sc->running, "Scan in progress");
+
+	/* Optional 1. Parameter is the options: parallel, timeout (ms), retries, nmt */
+	if(argc >= 1){
+		status = napi_get_named_uint32(env, argv[0], "parallel", &parallel);
+		if(status == napi_ok)
+			status = napi_get_named_uint32(env, argv[0], "timeout", &timeout);
+		if(status == napi_ok)
+			status = napi_get_named_uint32(env, argv[0], "retries", &retries);
+		if(status == napi_ok)
+			status = napi_get_named_uint32(env, argv[0], "nmt", &nmt);
+		napi_assert(env, status);
+	}
+	napi_assert_other(env, parallel < 1 || parallel >= CO_MAX_NODES, "Invalid parallel");
+	napi_assert_other(env, timeout < 1 || timeout > 10000, "Invalid timeout");
+	napi_assert_other(env, retries > 10, "Invalid retries");
+	napi_assert_other(env, nmt > 0xFF, "Invalid NMT command");
+
+	if(sc->ctx == NULL){
+		status = napi_create_string_utf8(env, "Scan Promise Context", NAPI_AUTO_LENGTH, &tmp);
+		napi_assert(env, status);
+		status = napi_async_init(env, NULL, tmp, &sc->ctx);
+		napi_assert(env, status);
+	}
+	status = napi_create_promise(env, &sc->deferred, &promise);
+	napi_assert(env, status);
+
+	/* Node ids 1..127, a window of parallel requests */
+	memset(sc->nodes, 0, sizeof(sc->nodes));
+	sc->parallel = parallel;
+	sc->timeout = timeout;
+	sc->retries = retries;
+	sc->nmt = nmt;
+	sc->inflight = 0;
+	sc->found = 0;
+	sc->next_id = 1;
+	sc->running = true;
+	uv_update_time(sc->uvt.loop);
+	uv_timer_start(&sc->uvt, co_scan_timer_cb, CO_SCAN_TICK, CO_SCAN_TICK);
+	co_scan_fill(con->bus);
+	if(sc->inflight == 0) co_scan_done(con->bus);
+
+	return promise;
 }
 
-//// PDO Functions /////////////////////////////////////////////////////////////
-napi_value co_pdo_send(napi_env env, napi_callback_info info) {
+//// SYNC Functions ////////////////////////////////////////////////////////////
+napi_value co_sync_start(napi_env env, napi_callback_info info) {
 	napi_status status;
 	size_t argc = 2;
 	napi_value argv[2];
-	uint32_t pdoid;
-	size_t jslen;
-	void *jsdata;
+	uint32_t period, counter = 0, cpu = UINT32_MAX, priority = 0;
 	co_t_node *con;
-	struct can_frame frame;
 
 	/* Get arguments */
-	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);	
+	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
 	napi_assert(env, status);
 
-	/* 1. Parameter is the PDO Id */
-	status = napi_get_value_uint32(env, argv[0], &pdoid);
+	/* 1. Parameter is the period in microseconds */
+	status = napi_get_value_uint32(env, argv[0], &period);
 	napi_assert(env, status);
+	napi_assert_other(env, period < 100, "SYNC period < 100 us");
+
+	/* Optional 2. Parameter is the options: counter, cpu, priority */
+	if(argc >= 2){
+		status = napi_get_named_uint32(env, argv[1], "counter", &counter);
+		if(status == napi_ok)
+			status = napi_get_named_uint32(env, argv[1], "cpu", &cpu);
+		if(status == napi_ok)
+			status = napi_get_named_uint32(env, argv[1], "priority", &priority);
+		napi_assert(env, status);
+	}
+	napi_assert_other(env, counter == 1 || counter > 240, "Invalid SYNC counter");
+	napi_assert_other(env, priority > 99, "Invalid priority");
 
-	/* 2. Parameter is the data */
-	status = napi_get_arraybuffer_info(env, argv[1], &jsdata, &jslen);
-	napi_assert(env, status);
-	napi_assert_other(env, jslen > 8, "PDO length > 8 bytes");
+	/* The SYNC belongs to the bus, restart it with the new period */
+	co_sync_thread_stop(con->bus);
+	napi_assert_other(env, co_sync_thread_start(con->bus, (uint64_t)period * 1000, counter,
+		cpu == UINT32_MAX ? -1 : (int)cpu, priority) < 0, "Cannot start SYNC thread");
 
-	/* Fill the CANopen data */
-	frame.can_id = ((0x100*pdoid)+0x200) | con->node_id;
-	memcpy(frame.data, jsdata, jslen);
-	frame.can_dlc = jslen;
+	return g_napi_null;
+}
 
-	if(write(con->canfd, &frame, sizeof(struct can_frame)) < 0)
-		napi_throw_error(con->env, NULL, "Cannot write socket");
+napi_value co_sync_stop(napi_env env, napi_callback_info info) {
+	napi_status status;
+	co_t_node *con;
 
+	/* Get arguments */
+	status = napi_get_cb_info(env, info, NULL, NULL, NULL, (void **)&con);
+	napi_assert(env, status);
+
+	co_sync_thread_stop(con->bus);
 	return g_napi_null;
 }
 
-napi_value co_pdo_recv(napi_env env, napi_callback_info info) {
+napi_value co_sync_stats(napi_env env, napi_callback_info info) {
 	napi_status status;
 	size_t argc = 1;
-	napi_value argv[1], tmp;
+	napi_value argv[1], result, tmp;
 	napi_valuetype vt;
+	bool reset = false;
 	co_t_node *con;
+	co_t_sync *s;
+	co_t_hist jitter;
+	uint64_t overruns, errors;
 
 	/* Get arguments */
 	status = napi_get_cb_info(env, info, &argc, argv, NULL, (void **)&con);
 	napi_assert(env, status);
+	s = &con->bus->sync;
 
-	/* 1. Parameter is the callback */
-	status = napi_typeof(env, argv[0], &vt);
-	napi_assert(env, status);
-	napi_assert_other(env, vt != napi_function, "Invalid callback");
-	status = napi_create_string_utf8(env, "PDO Callback Context", NAPI_AUTO_LENGTH, &tmp);
-	napi_assert(env, status);
-	/* Delete the previous callback, if there is already one. */
-	if(con->pdo_cb_ref != NULL){
-		status = napi_async_destroy(con->env, con->pdo_cb_ctx);
-		napi_assert(env, status);
-		status = napi_delete_reference(con->env, con->pdo_cb_ref);
+	/* Optional 1. Parameter resets the statistics */
+	if(argc >= 1){
+		status = napi_typeof(env, argv[0], &vt);
 		napi_assert(env, status);
+		if(vt != napi_undefined){
+			status = napi_get_value_bool(env, argv[0], &reset);
+			napi_assert(env, status);
+		}
 	}
-	status = napi_async_init(env, NULL, tmp, &con->pdo_cb_ctx);
+
+	/* Copy under the lock, the thread keeps running */
+	pthread_mutex_lock(&s->lock);
+	jitter = s->jitter;
+	overruns = s->overruns;
+	errors = s->errors;
+	if(reset){
+		memset(&s->jitter, 0, sizeof(co_t_hist));
+		s->overruns = 0;
+		s->errors = 0;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	status = co_hist_summary(env, &jitter, &result);
 	napi_assert(env, status);
-	status = napi_create_reference(env, argv[0], 1, &con->pdo_cb_ref);
+	status = napi_get_boolean(env, s->running, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, result, "running", tmp);
+	napi_assert(env, status);
+	status = napi_create_uint32(env, __atomic_load_n(&s->cycle, __ATOMIC_ACQUIRE), &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, result, "cycle", tmp);
+	napi_assert(env, status);
+	status = napi_create_int64(env, overruns, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, result, "overruns", tmp);
+	napi_assert(env, status);
+	status = napi_create_int64(env, errors, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, result, "errors", tmp);
 	napi_assert(env, status);
 
-	return g_napi_null;
+	return result;
 }
 
 //// Create Node Function //////////////////////////////////////////////////////
+void co_node_free(co_t_node *con) {
+	co_sdo_queue_free(&con->sdo_queue);
+	free(con->batch);
+	free(con);
+}
+
+void co_node_close_cb(uv_handle_t* handle) {
+	co_t_node *con = (co_t_node *)handle->data;
+	if(--con->closing == 0) co_node_free(con);
+}
+
+void co_sdo_channel_close_cb(uv_handle_t* handle) {
+	co_t_sdo_channel *ch = (co_t_sdo_channel *)handle->data;
+	co_t_node *con = ch->con;
+	free(ch);
+	if(--con->closing == 0) co_node_free(con);
+}
+
 void co_delete_node(napi_env env, void* finalize_data, void* finalize_hint){
 	co_t_node *con = (co_t_node *)finalize_data;
-	uv_poll_stop(&con->can_uvp);
+	co_t_node **p;
+	unsigned int c;
+	if(con->sdo_promise_ctx != NULL)
+		napi_async_destroy(env, con->sdo_promise_ctx);
+	/* Incompletely created node */
+	if(con->bus == NULL){
+		co_node_free(con);
+		return;
+	}
 	co_stop_all_cb(con);
-	uv_close((uv_handle_t *)&con->can_uvp, NULL);
-	uv_close((uv_handle_t *)&con->hb_uvt, NULL);
-	uv_close((uv_handle_t *)&con->sdo_uvt, NULL);
-	close(con->canfd);
-	free(con);
+	con->bus->nodes[con->node_id] = NULL;
+	for(p = &con->bus->flush_list; *p != NULL; p = &(*p)->flush_next){
+		if(*p == con){
+			*p = con->flush_next;
+			break;
+		}
+	}
+	for(c = 1; c < con->sdo_nchannels; ++c)
+		co_bus_remove_route(con->bus, con->sdo_channels[c]);
+	co_bus_release(con->bus);
+	con->closing = 1 + con->sdo_nchannels;
+	uv_close((uv_handle_t *)&con->hb_uvt, co_node_close_cb);
+	for(c = 0; c < con->sdo_nchannels; ++c)
+		uv_close((uv_handle_t *)&con->sdo_channels[c]->uvt, co_sdo_channel_close_cb);
 }
 
 napi_value co_stop(napi_env env, napi_callback_info info) {
@@ -780,6 +6801,7 @@ napi_value co_stop(napi_env env, napi_callback_info info) {
 	napi_assert(env, status);
 
 	/* Stop the callback */
+	co_sdo_cancel(con);
 	co_stop_all_cb(con);
 
 	return g_napi_null;
@@ -789,19 +6811,17 @@ napi_value co_create_node(napi_env env, napi_callback_info info) {
 	napi_status status;
 	uv_loop_t *loop;
 
-	size_t argc = 2;
-	napi_value argv[2];
+	size_t argc = 3;
+	napi_value argv[3];
 
 	co_t_node * con;
+	co_t_sdo_channel *ch;
 	char device[16];
 	uint32_t node_id;
+	uint32_t sdo_block_size = 127;
+	uint32_t sdo_queue_size = 128;
 
 	napi_value object, tmp;
-	int err;
-	
-	struct can_filter rfilter[8];
-	struct ifreq ifr;
-	struct sockaddr_can addr;
 
 	/* Get arguments */
 	status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
@@ -814,18 +6834,39 @@ napi_value co_create_node(napi_env env, napi_callback_info info) {
 	/* 2. Paramater is the can id to talk with */
 	status = napi_get_value_uint32(env, argv[1], &node_id);
 	napi_assert(env, status);
+	napi_assert_other(env, node_id < 1 || node_id >= CO_MAX_NODES, "Invalid node id");
+
+	/* 3. Parameter is the options (optional) */
+	status = napi_get_named_uint32(env, argv[2], "sdo_block_size", &sdo_block_size);
+	napi_assert(env, status);
+	napi_assert_other(env, sdo_block_size < 1 || sdo_block_size > 127, "Invalid sdo_block_size");
+	status = napi_get_named_uint32(env, argv[2], "sdo_queue_size", &sdo_queue_size);
+	napi_assert(env, status);
+	napi_assert_other(env, sdo_queue_size < 1 || sdo_queue_size > 0x100000, "Invalid sdo_queue_size");
+
+	status = napi_get_uv_event_loop(env, &loop);
+	napi_assert(env, status);
 
 	/* Create a new object */
 	status = napi_create_object(env, &object);
 	napi_assert(env, status);
 
 	/* ._co_t_node hold owner private data */
-	con = (co_t_node *)malloc(sizeof(co_t_node));
+	con = (co_t_node *)calloc(1, sizeof(co_t_node));
+	napi_assert_other(env, con == NULL, "Cannot allocate node");
 	status = napi_create_external(env, con, co_delete_node, NULL, &tmp);
 	napi_assert(env, status);
 	status = napi_set_named_property(env, object, "_co_t_node", tmp);
 	napi_assert(env, status);
 
+	/* Init the SDO queue, it grows when full */
+	napi_assert_other(env, co_sdo_queue_init(&con->sdo_queue, sdo_queue_size) < 0,
+		"Cannot allocate SDO queue");
+	status = napi_create_string_utf8(env, "SDO Promise Context", NAPI_AUTO_LENGTH, &tmp);
+	napi_assert(env, status);
+	status = napi_async_init(env, NULL, tmp, &con->sdo_promise_ctx);
+	napi_assert(env, status);
+
 	/* .nmt_send Function*/
 	status = napi_create_function(env, NULL, 0, co_nmt_send, (void *)con, &tmp);
 	napi_assert(env, status);
@@ -850,18 +6891,210 @@ napi_value co_create_node(napi_env env, napi_callback_info info) {
 	status = napi_set_named_property(env, object, "sdo_upload", tmp);
 	napi_assert(env, status);
 
+	/* .sdo_block_download Function*/
+	status = napi_create_function(env, NULL, 0, co_sdo_block_download, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "sdo_block_download", tmp);
+	napi_assert(env, status);
+
+	/* .sdo_block_upload Function*/
+	status = napi_create_function(env, NULL, 0, co_sdo_block_upload, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "sdo_block_upload", tmp);
+	napi_assert(env, status);
+
+	/* .sdo_read Function*/
+	status = napi_create_function(env, NULL, 0, co_sdo_read, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "sdo_read", tmp);
+	napi_assert(env, status);
+
+	/* .sdo_write Function*/
+	status = napi_create_function(env, NULL, 0, co_sdo_write, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "sdo_write", tmp);
+	napi_assert(env, status);
+
+	/* .sdo_execute Function*/
+	status = napi_create_function(env, NULL, 0, co_sdo_execute, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "sdo_execute", tmp);
+	napi_assert(env, status);
+
+	/* .sdo_add_channel Function*/
+	status = napi_create_function(env, NULL, 0, co_sdo_add_channel, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "sdo_add_channel", tmp);
+	napi_assert(env, status);
+
+	/* .sdo_pending Function*/
+	status = napi_create_function(env, NULL, 0, co_sdo_pending, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "sdo_pending", tmp);
+	napi_assert(env, status);
+
 	/* .pdo_send Function*/
 	status = napi_create_function(env, NULL, 0, co_pdo_send, (void *)con, &tmp);
 	napi_assert(env, status);
 	status = napi_set_named_property(env, object, "pdo_send", tmp);
 	napi_assert(env, status);
 
+	/* .pdo_send_many Function*/
+	status = napi_create_function(env, NULL, 0, co_pdo_send_many, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "pdo_send_many", tmp);
+	napi_assert(env, status);
+
+	/* .hb_consumer Function*/
+	status = napi_create_function(env, NULL, 0, co_hb_consumer, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "hb_consumer", tmp);
+	napi_assert(env, status);
+
+	/* .hb_watch Function*/
+	status = napi_create_function(env, NULL, 0, co_hb_watch, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "hb_watch", tmp);
+	napi_assert(env, status);
+
+	/* .emcy Function*/
+	status = napi_create_function(env, NULL, 0, co_emcy, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "emcy", tmp);
+	napi_assert(env, status);
+
+	/* .reflex_load Function*/
+	status = napi_create_function(env, NULL, 0, co_reflex_load, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "reflex_load", tmp);
+	napi_assert(env, status);
+
+	/* .lss_switch_global Function*/
+	status = napi_create_function(env, NULL, 0, co_lss_switch_global, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "lss_switch_global", tmp);
+	napi_assert(env, status);
+
+	/* .lss_switch_selective Function*/
+	status = napi_create_function(env, NULL, 0, co_lss_switch_selective, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "lss_switch_selective", tmp);
+	napi_assert(env, status);
+
+	/* .lss_configure_node_id Function*/
+	status = napi_create_function(env, NULL, 0, co_lss_configure_node_id, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "lss_configure_node_id", tmp);
+	napi_assert(env, status);
+
+	/* .lss_store Function*/
+	status = napi_create_function(env, NULL, 0, co_lss_store, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "lss_store", tmp);
+	napi_assert(env, status);
+
+	/* .lss_fastscan Function*/
+	status = napi_create_function(env, NULL, 0, co_lss_fastscan, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "lss_fastscan", tmp);
+	napi_assert(env, status);
+
+	/* .trace_start Function*/
+	status = napi_create_function(env, NULL, 0, co_trace_start, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "trace_start", tmp);
+	napi_assert(env, status);
+
+	/* .trace_stop Function*/
+	status = napi_create_function(env, NULL, 0, co_trace_stop, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "trace_stop", tmp);
+	napi_assert(env, status);
+
+	/* .trace_replay Function*/
+	status = napi_create_function(env, NULL, 0, co_trace_replay, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "trace_replay", tmp);
+	napi_assert(env, status);
+
+	/* .scan Function*/
+	status = napi_create_function(env, NULL, 0, co_scan, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "scan", tmp);
+	napi_assert(env, status);
+
+	/* .sync_start Function*/
+	status = napi_create_function(env, NULL, 0, co_sync_start, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "sync_start", tmp);
+	napi_assert(env, status);
+
+	/* .sync_stop Function*/
+	status = napi_create_function(env, NULL, 0, co_sync_stop, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "sync_stop", tmp);
+	napi_assert(env, status);
+
+	/* .sync_stats Function*/
+	status = napi_create_function(env, NULL, 0, co_sync_stats, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "sync_stats", tmp);
+	napi_assert(env, status);
+
+	/* .pdo_cyclic Function*/
+	status = napi_create_function(env, NULL, 0, co_pdo_cyclic, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "pdo_cyclic", tmp);
+	napi_assert(env, status);
+
+	/* .pdo_cyclic_stats Function*/
+	status = napi_create_function(env, NULL, 0, co_pdo_cyclic_stats, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "pdo_cyclic_stats", tmp);
+	napi_assert(env, status);
+
+	/* .process_image Function*/
+	status = napi_create_function(env, NULL, 0, co_process_image, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "process_image", tmp);
+	napi_assert(env, status);
+
+	/* .pdo_map Function*/
+	status = napi_create_function(env, NULL, 0, co_pdo_map, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "pdo_map", tmp);
+	napi_assert(env, status);
+
 	/* .pdo_recv Function*/
 	status = napi_create_function(env, NULL, 0, co_pdo_recv, (void *)con, &tmp);
 	napi_assert(env, status);
 	status = napi_set_named_property(env, object, "pdo_recv", tmp);
 	napi_assert(env, status);
 
+	/* .pdo_recv_batch Function*/
+	status = napi_create_function(env, NULL, 0, co_pdo_recv_batch, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "pdo_recv_batch", tmp);
+	napi_assert(env, status);
+
+	/* .pdo_ring Function*/
+	status = napi_create_function(env, NULL, 0, co_pdo_ring, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "pdo_ring", tmp);
+	napi_assert(env, status);
+
+	/* .latency Function*/
+	status = napi_create_function(env, NULL, 0, co_latency, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "latency", tmp);
+	napi_assert(env, status);
+
+	/* .metrics Function*/
+	status = napi_create_function(env, NULL, 0, co_metrics, (void *)con, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, object, "metrics", tmp);
+	napi_assert(env, status);
+
 	/* .stop Function*/
 	status = napi_create_function(env, NULL, 0, co_stop, (void *)con, &tmp);
 	napi_assert(env, status);
@@ -878,56 +7111,31 @@ napi_value co_create_node(napi_env env, napi_callback_info info) {
 	con->env = env;
 	con->node_id = (uint8_t) node_id;
 
-	/* Prepare filter */
-	/* Emergency */
-	rfilter[0].can_id   = 0x080+node_id;
-	rfilter[0].can_mask = 0x7FF; //0x780;
-	/* PDO 0 */
-	rfilter[1].can_id   = 0x180+node_id;
-	rfilter[1].can_mask = 0x7FF; //0x780;
-	/* PDO 1 */
-	rfilter[2].can_id   = 0x280+node_id;
-	rfilter[2].can_mask = 0x7FF; //0x780;
-	/* PDO 2 */
-	rfilter[3].can_id   = 0x380+node_id;
-	rfilter[3].can_mask = 0x7FF; //0x780;
-	/* PDO 3 */
-	rfilter[4].can_id   = 0x480+node_id;
-	rfilter[4].can_mask = 0x7FF; //0x780;
-	/* SDO */
-	rfilter[5].can_id   = 0x580+node_id;
-	rfilter[5].can_mask = 0x7FF; //0x780;
-	/* NMT */
-	rfilter[6].can_id   = 0x700+node_id;;
-	rfilter[6].can_mask = 0x7FF; //0x780;
-	/* LSS */
-	rfilter[7].can_id   = 0x7E4;
-	rfilter[7].can_mask = 0x7FF;
+	/* Default SDO channel */
+	ch = (co_t_sdo_channel *)calloc(1, sizeof(co_t_sdo_channel));
+	napi_assert_other(env, ch == NULL, "Cannot allocate node");
 
-	/* Create Socket */
-	con->canfd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
-	napi_assert_other(env, con->canfd < 0, "Cannot create socket");
-	setsockopt(con->canfd, SOL_CAN_RAW, CAN_RAW_FILTER, rfilter, sizeof(rfilter));
-	strcpy(ifr.ifr_name, device);
-	ioctl(con->canfd, SIOCGIFINDEX, &ifr); /* ifr.ifr_ifindex gets filled */
-	addr.can_family = AF_CAN;
-	addr.can_ifindex = ifr.ifr_ifindex;
-	err = bind(con->canfd, (struct sockaddr*)&addr, sizeof(addr));
-	if (err < 0){
-		napi_throw_error(env, NULL, "Cannot bind socket");
-		close(con->canfd);
+	/* Open the bus, or share it with the other nodes */
+	con->bus = co_bus_open(env, device, argv[2]);
+	if(con->bus == NULL){
+		free(ch);
 		return g_napi_null;
 	}
-
-	/* Init the SDO queue */	
-	co_sdo_queue_reset(&con->sdo_queue);
-
-	/* Handle data for SDO and PDO */
-	status = napi_get_uv_event_loop(env, &loop);
-	napi_assert(env, status);
-	uv_poll_init(loop, &con->can_uvp, con->canfd);
-	con->can_uvp.data = con;
-	uv_poll_start(&con->can_uvp, UV_READABLE, co_can_recv_cb);
+	if(con->bus->nodes[node_id] != NULL){
+		co_bus_release(con->bus);
+		con->bus = NULL;
+		free(ch);
+		napi_throw_error(env, NULL, "Node already exists on this bus");
+		return g_napi_null;
+	}
+	if(co_bus_find_route(con->bus, 0x580+node_id) != NULL){
+		co_bus_release(con->bus);
+		con->bus = NULL;
+		free(ch);
+		napi_throw_error(env, NULL, "SDO response COB-ID of the node used by a SDO channel");
+		return g_napi_null;
+	}
+	con->bus->nodes[node_id] = con;
 
 	/* Handle timeout for HB */
 	uv_timer_init(loop, &con->hb_uvt);
@@ -940,14 +7148,23 @@ napi_value co_create_node(napi_env env, napi_callback_info info) {
 	/* Something else than 0 or 1... */
 	con->hb_last_toggle_bit = 255;
 
-	/* Handle timeout for SDO */
-	uv_timer_init(loop, &con->sdo_uvt);
-	con->sdo_uvt.data = con;
+	/* Default SDO channel, its timer handles the timeout */
+	uv_timer_init(loop, &ch->uvt);
+	ch->uvt.data = ch;
+	ch->con = con;
+	ch->cob_tx = 0x600+node_id;
+	ch->cob_rx = 0x580+node_id;
+	con->sdo_channels[0] = ch;
+	con->sdo_nchannels = 1;
 	con->sdo_wait_time = 500; /* Set to 500 ms */
+	con->sdo_block_size = sdo_block_size;
 
 	/* No callback for PDO yet */
 	con->pdo_cb_ref = NULL;
 
+	/* No callback for EMCY yet */
+	con->emcy_cb_ref = NULL;
+
 	return object;
 }
 
@@ -993,6 +7210,211 @@ napi_value Init(napi_env env, napi_value exports) {
 	status = napi_set_named_property(env, exports, "NMT_RESET_COMMUNICATION", tmp);
 	napi_assert(env, status);
 
+	status = napi_create_uint32(env, sizeof(co_t_pdo_ring), &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "PDO_RING_HEADER", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, sizeof(co_t_pdo_ring_slot), &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "PDO_RING_SLOT", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, sizeof(co_t_pdo_batch_entry), &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "PDO_BATCH_ENTRY", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, CO_SDO_TYPE_ARRAY, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "SDO_ARRAY", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, CO_SDO_TYPE_UINT8, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "SDO_UINT8", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, CO_SDO_TYPE_INT8, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "SDO_INT8", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, CO_SDO_TYPE_UINT16, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "SDO_UINT16", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, CO_SDO_TYPE_INT16, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "SDO_INT16", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, CO_SDO_TYPE_UINT32, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "SDO_UINT32", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, CO_SDO_TYPE_INT32, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "SDO_INT32", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, CO_SDO_TYPE_UINT64, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "SDO_UINT64", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, CO_SDO_TYPE_INT64, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "SDO_INT64", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, CO_SDO_TYPE_FLOAT32, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "SDO_FLOAT32", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, CO_SDO_TYPE_FLOAT64, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "SDO_FLOAT64", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, CO_SDO_OP_WRITE, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "SDO_WRITE", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, CO_SDO_OP_READ, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "SDO_READ", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, CO_SDO_CONTINUE, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "SDO_CONTINUE", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, CO_SDO_NOT_EXECUTED, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "SDO_NOT_EXECUTED", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, sizeof(co_t_sdo_script_entry), &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "SDO_SCRIPT_ENTRY", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, sizeof(co_t_sdo_script_result), &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "SDO_SCRIPT_RESULT", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, CO_PDO_MAP_TX, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "PDO_MAP_TX", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, CO_PDO_MAP_RX, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "PDO_MAP_RX", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, CO_PDO_MAP_SIGNED, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "PDO_MAP_SIGNED", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, CO_PDO_MAP_FLOAT, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "PDO_MAP_FLOAT", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, CO_IMAGE_SIZE, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "PROCESS_IMAGE_SIZE", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, sizeof(co_t_image), &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "PROCESS_IMAGE_HEADER", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, sizeof(co_t_image_pdo), &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "PROCESS_IMAGE_PDO", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, CO_REFLEX_PDO_BIT, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "REFLEX_PDO_BIT", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, CO_REFLEX_EMCY, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "REFLEX_EMCY", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, CO_REFLEX_INVERT, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "REFLEX_INVERT", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, CO_REFLEX_NMT, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "REFLEX_NMT", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, CO_REFLEX_SEND, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "REFLEX_SEND", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, sizeof(co_t_reflex_rule), &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "REFLEX_RULE", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, sizeof(co_t_reflex_report), &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "REFLEX_REPORT", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, sizeof(co_t_trace_header), &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "TRACE_HEADER", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, sizeof(co_t_trace_record), &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "TRACE_RECORD", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, CO_TRACE_TX, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "TRACE_TX", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, CO_TRACE_FD, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "TRACE_FD", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, CO_TRACE_BRS, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "TRACE_BRS", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, sizeof(co_t_scan_entry), &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "SCAN_ENTRY", tmp);
+	napi_assert(env, status);
+
+	status = napi_create_uint32(env, CO_METRICS_SIZE, &tmp);
+	napi_assert(env, status);
+	status = napi_set_named_property(env, exports, "METRICS_SIZE", tmp);
+	napi_assert(env, status);
+
 	status = napi_create_uint32(env, CO_HB_BOOT, &tmp);
 	napi_assert(env, status);
 	status = napi_set_named_property(env, exports, "HB_BOOT", tmp);
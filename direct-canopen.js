@@ -1,7 +1,130 @@
 dco = require('./build/Release/dcanopen');
+var fs = require('fs');
 
-function create_node(device, node_id){
-	var obj = dco.create_node(device, node_id);
+/* Typed value of a packed SDO script, little endian */
+function sdo_set_value(view, offset, type, value){
+	switch(type){
+		case dco.SDO_UINT8:   view.setUint8(offset, value); break;
+		case dco.SDO_INT8:    view.setInt8(offset, value); break;
+		case dco.SDO_UINT16:  view.setUint16(offset, value, true); break;
+		case dco.SDO_INT16:   view.setInt16(offset, value, true); break;
+		case dco.SDO_UINT32:  view.setUint32(offset, value, true); break;
+		case dco.SDO_INT32:   view.setInt32(offset, value, true); break;
+		case dco.SDO_UINT64:  view.setBigUint64(offset, BigInt(value), true); break;
+		case dco.SDO_INT64:   view.setBigInt64(offset, BigInt(value), true); break;
+		case dco.SDO_FLOAT32: view.setFloat32(offset, value, true); break;
+		case dco.SDO_FLOAT64: view.setFloat64(offset, value, true); break;
+	}
+}
+
+function sdo_get_value(view, offset, type){
+	switch(type){
+		case dco.SDO_UINT8:   return view.getUint8(offset);
+		case dco.SDO_INT8:    return view.getInt8(offset);
+		case dco.SDO_UINT16:  return view.getUint16(offset, true);
+		case dco.SDO_INT16:   return view.getInt16(offset, true);
+		case dco.SDO_UINT32:  return view.getUint32(offset, true);
+		case dco.SDO_INT32:   return view.getInt32(offset, true);
+		case dco.SDO_UINT64:  return view.getBigUint64(offset, true);
+		case dco.SDO_INT64:   return view.getBigInt64(offset, true);
+		case dco.SDO_FLOAT32: return view.getFloat32(offset, true);
+		case dco.SDO_FLOAT64: return view.getFloat64(offset, true);
+	}
+}
+
+/* Consistent copy of a process image, usable from any worker */
+function process_image_read(image){
+	var words = new Uint32Array(image);
+	var view = new DataView(image);
+	var seq, res, offset, n;
+	do {
+		while((seq = Atomics.load(words, 1)) & 1);
+		res = {
+			notify: view.getInt32(0, true),
+			hb_state: view.getUint32(8, true),
+			hb_count: view.getUint32(12, true),
+			hb_timestamp: view.getBigUint64(16, true),
+			pdo_count: view.getUint32(24, true),
+			pdo: []
+		};
+		for(n = 0; n < 4; ++n){
+			offset = dco.PROCESS_IMAGE_HEADER + n * dco.PROCESS_IMAGE_PDO;
+			res.pdo.push({
+				timestamp: view.getBigUint64(offset, true),
+				count: view.getUint32(offset+8, true),
+				data: new Uint8Array(image.slice(offset+16, offset+16+view.getUint8(offset+12)))
+			});
+		}
+	} while(Atomics.load(words, 1) != seq);
+	return res;
+}
+
+/* Counters of a metrics() snapshot, BigInt. rx/tx are indexed by the
+   function code (COB-ID >> 7): 0 NMT, 1 SYNC/EMCY, 3..10 PDO, 11/12 SDO, 14 NMT EC */
+var METRICS_BUS = ["rx_short", "tx_errors", "rx_overflow", "rx_ring_full",
+	"error_frames", "bus_off"];
+var METRICS_NODE = ["sdo_requests", "sdo_timeouts", "sdo_aborts", "sdo_unexpected",
+	"sdo_queue_high", "hb_toggle", "hb_timeouts", "emcy"];
+
+function metrics_read(snapshot){
+	var v = new BigUint64Array(snapshot.buffer || snapshot, snapshot.byteOffset || 0,
+		dco.METRICS_SIZE / 8);
+	var res = { rx: Array.from(v.subarray(0, 16)), tx: Array.from(v.subarray(16, 32)) };
+	METRICS_BUS.forEach((name, i) => res[name] = v[32 + i]);
+	METRICS_NODE.forEach((name, i) => res[name] = v[32 + METRICS_BUS.length + i]);
+	return res;
+}
+
+/* Frames of a trace file, oldest first:
+   [{timestamp, can_id, flags, data}], flags is TRACE_TX|TRACE_FD|TRACE_BRS */
+function trace_read(path){
+	return trace_parse(fs.readFileSync(path));
+}
+
+function trace_parse(file){
+	var view = new DataView(file.buffer, file.byteOffset, file.byteLength);
+	var record_size = view.getUint32(12, true);
+	var capacity = view.getBigUint64(16, true);
+	var head = view.getBigUint64(24, true);
+	var frames = [];
+	var n, offset;
+	if(file.toString('latin1', 0, 8) != "DCOTRACE")
+		throw new Error("Invalid trace file");
+	for(n = head > capacity ? head - capacity : 0n; n < head; ++n){
+		offset = dco.TRACE_HEADER + Number(n % capacity) * record_size;
+		frames.push({
+			timestamp: view.getBigUint64(offset, true),
+			can_id: view.getUint32(offset+8, true),
+			flags: view.getUint8(offset+13),
+			data: new Uint8Array(file.subarray(offset + dco.TRACE_RECORD,
+				offset + dco.TRACE_RECORD + view.getUint8(offset+12)))
+		});
+	}
+	return frames;
+}
+
+/* Trace file to the candump log format (candump -l, canplayer) */
+function trace_candump(path, device){
+	var file = fs.readFileSync(path);
+	var hex = (v, n) => v.toString(16).toUpperCase().padStart(n, "0");
+	device = device || file.toString('latin1', 32, 48).replace(/\0.*$/, "");
+	return trace_parse(file).map(function(f){
+		var line = "(" + (f.timestamp / 1000000000n) + "." +
+			String(f.timestamp % 1000000000n / 1000n).padStart(6, "0") + ") " + device + " ";
+		if(f.can_id & 0x80000000) line += hex(f.can_id & 0x1FFFFFFF, 8);
+		else line += hex(f.can_id & 0x7FF, 3);
+		if(f.flags & dco.TRACE_FD)
+			line += "##" + (f.flags & dco.TRACE_BRS ? "1" : "0");
+		else if(f.can_id & 0x40000000)
+			return line + "#R";
+		else
+			line += "#";
+		return line + Array.from(f.data, (b) => hex(b, 2)).join("");
+	}).join("\n") + "\n";
+}
+
+function create_node(device, node_id, options){
+	var obj = dco.create_node(device, node_id, options);
 	obj.sdo_download_array = function (index, subindex, array){
 			return new Promise(function(resolve, reject) {
 				obj.sdo_download(index, subindex, array, res =>{
@@ -11,37 +134,13 @@ function create_node(device, node_id){
 			});
 		}
 	obj.sdo_download_uint8 = function (index, subindex, number){
-			var data = new ArrayBuffer(1);
-			var v8 = new Uint8Array(data);
-			v8[0] = number;
-			return new Promise(function(resolve, reject) {
-				obj.sdo_download(index, subindex, data, res =>{
-					if(res instanceof Error) reject(res);
-					else resolve(res);
-				});
-			});
+			return obj.sdo_write(index, subindex, dco.SDO_UINT8, number);
 		}
 	obj.sdo_download_uint16 = function (index, subindex, number){
-			var data = new ArrayBuffer(2);
-			var v16 = new Uint16Array(data);
-			v16[0] = number;
-			return new Promise(function(resolve, reject) {
-				obj.sdo_download(index, subindex, data, res =>{
-					if(res instanceof Error) reject(res);
-					else resolve(res);
-				});
-			});
+			return obj.sdo_write(index, subindex, dco.SDO_UINT16, number);
 		}
 	obj.sdo_download_uint32 = function (index, subindex, number){
-			var data = new ArrayBuffer(4);
-			var v32 = new Uint32Array(data);
-			v32[0] = number;
-			return new Promise(function(resolve, reject) {
-				obj.sdo_download(index, subindex, data, res =>{
-					if(res instanceof Error) reject(res);
-					else resolve(res);
-				});
-			});
+			return obj.sdo_write(index, subindex, dco.SDO_UINT32, number);
 		}
 	obj.sdo_upload_array = function (index, subindex){
 			return new Promise(function(resolve, reject) {
@@ -52,47 +151,168 @@ function create_node(device, node_id){
 			});
 		}
 	obj.sdo_upload_uint8 = function (index, subindex){
-			return new Promise(function(resolve, reject) {
-				obj.sdo_upload(index, subindex, res =>{
-					if(res instanceof Error) reject(res);
-					else resolve(new Uint8Array(res)[0]);
+			return obj.sdo_read(index, subindex, dco.SDO_UINT8);
+		}
+	obj.sdo_upload_uint16 = function (index, subindex){
+			return obj.sdo_read(index, subindex, dco.SDO_UINT16);
+		}
+	obj.sdo_upload_uint32 = function (index, subindex){
+			return obj.sdo_read(index, subindex, dco.SDO_UINT32);
+		}
+	/* list: [{index, subindex, type, read, value}], resolves [{status, value}] */
+	obj.sdo_execute_list = function (list, flags){
+			var script = new DataView(new ArrayBuffer(list.length * dco.SDO_SCRIPT_ENTRY));
+			list.forEach(function(e, n){
+				var offset = n * dco.SDO_SCRIPT_ENTRY;
+				script.setUint16(offset, e.index, true);
+				script.setUint8(offset+2, e.subindex);
+				script.setUint8(offset+3, e.type);
+				script.setUint8(offset+4, e.read ? dco.SDO_READ : dco.SDO_WRITE);
+				if(!e.read) sdo_set_value(script, offset+8, e.type, e.value);
+			});
+			return obj.sdo_execute(script.buffer, flags).then(function(results){
+				var view = new DataView(results);
+				return list.map(function(e, n){
+					var offset = n * dco.SDO_SCRIPT_RESULT;
+					var status = view.getUint32(offset, true);
+					return {
+						status: status,
+						value: e.read && status == 0 ? sdo_get_value(view, offset+8, e.type) : undefined
+					};
+				});
+			});
+		}
+	/* Reads 0x1A00+n (PDO_MAP_TX) or 0x1600+n (PDO_MAP_RX) and compiles it into pdo_map */
+	obj.pdo_map_read = function (pdoid, dir, table, flags){
+			var index = (dir == dco.PDO_MAP_TX ? 0x1A00 : 0x1600) + pdoid;
+			return obj.sdo_read(index, 0, dco.SDO_UINT8).then(function(count){
+				var list = [];
+				for(var n = 1; n <= count; ++n)
+					list.push({index: index, subindex: n, type: dco.SDO_UINT32, read: true});
+				return obj.sdo_execute_list(list);
+			}).then(function(results){
+				var mapping = new Uint32Array(results.length);
+				results.forEach(function(r, n){
+					if(r.status != 0) throw new Error("PDO mapping read failed: 0x" + r.status.toString(16));
+					mapping[n] = r.value;
 				});
+				obj.pdo_map(pdoid, dir, mapping, table, flags);
+				return mapping;
 			});
 		}
-	obj.sdo_upload_uint16 = function (index, subindex, cb){
+	obj.sdo_block_download_array = function (index, subindex, array){
 			return new Promise(function(resolve, reject) {
-				obj.sdo_upload(index, subindex, res =>{
+				obj.sdo_block_download(index, subindex, array, res =>{
 					if(res instanceof Error) reject(res);
-					else resolve(new Uint16Array(res)[0]);
+					else resolve(res);
 				});
 			});
 		}
-	obj.sdo_upload_uint32 = function (index, subindex, cb){
+	obj.sdo_block_upload_array = function (index, subindex){
 			return new Promise(function(resolve, reject) {
-				obj.sdo_upload(index, subindex, res =>{
+				obj.sdo_block_upload(index, subindex, res =>{
 					if(res instanceof Error) reject(res);
-					else resolve(new Uint32Array(res)[0]);
+					else resolve(res);
 				});
 			});
 		}
+	obj.pdo_ring_read = function (ring, cb){
+			/* Header: head, tail, slots, dropped */
+			var header = new Uint32Array(ring, 0, 4);
+			var view = new DataView(ring);
+			var offset;
+			while(header[1] != header[0]){
+				offset = dco.PDO_RING_HEADER + (header[1] & (header[2] - 1)) * dco.PDO_RING_SLOT;
+				cb(view.getUint8(offset+13),
+					new Uint8Array(ring, offset+16, view.getUint8(offset+12)),
+					view.getBigUint64(offset, true),
+					view.getUint16(offset+14, true));
+				header[1]++;
+			}
+		}
+	/* SharedArrayBuffer updated in place, workers wait on word 0 with Atomics.wait */
+	obj.process_image_create = function (){
+			var image = new SharedArrayBuffer(dco.PROCESS_IMAGE_SIZE);
+			var words = new Int32Array(image);
+			obj.process_image(words, function(){
+				Atomics.notify(words, 0);
+			});
+			return image;
+		}
+	/* rules: [{type, src_node, src_pdo, src_bit, dst_node, dst_pdo, dst_bit, actions, nmt, data}],
+	   cb([{rule, type, node, timestamp}], lost) after the rules fired */
+	obj.reflex_load_list = function (rules, cb){
+			var packed = new Uint8Array(rules.length * dco.REFLEX_RULE);
+			rules.forEach(function(r, n){
+				var offset = n * dco.REFLEX_RULE;
+				var data = r.data || [];
+				packed.set([r.type, r.src_node || 0, r.src_pdo || 0, r.src_bit || 0,
+					r.dst_node || 0, r.dst_pdo || 0, r.dst_bit || 0, r.actions || 0,
+					r.nmt || 0, data.length], offset);
+				packed.set(data, offset + 16);
+			});
+			obj.reflex_load(packed, cb && function(reports, lost){
+				var view = new DataView(reports);
+				var list = [];
+				for(var offset = 0; offset < reports.byteLength; offset += dco.REFLEX_REPORT)
+					list.push({
+						rule: view.getUint32(offset, true),
+						type: view.getUint8(offset+4),
+						node: view.getUint8(offset+5),
+						timestamp: view.getBigUint64(offset+8, true)
+					});
+				cb(list, lost);
+			});
+		}
+	/* Fastscan the unconfigured slaves one by one, give them node ids from first_id,
+	   resolves [{vendor, product, revision, serial, node_id}] */
+	obj.lss_assign_all = async function (first_id, store, options){
+			var found = [], slave;
+			obj.lss_switch_global(0);
+			while((slave = await obj.lss_fastscan(options)) != null){
+				slave.node_id = first_id + found.length;
+				await obj.lss_configure_node_id(slave.node_id);
+				if(store) await obj.lss_store();
+				obj.lss_switch_global(0);
+				found.push(slave);
+			}
+			return found;
+		}
+	/* Scan the node ids of the bus, resolves [{node_id, device_type, vendor,
+	   product, revision, serial, identity}], identity has one bit per 0x1018 sub read */
+	obj.scan_list = async function (options){
+			var view = new DataView(await obj.scan(options));
+			var list = [];
+			for(var offset = 0; offset < view.byteLength; offset += dco.SCAN_ENTRY)
+				list.push({
+					node_id: view.getUint8(offset),
+					identity: view.getUint8(offset+1),
+					device_type: view.getUint32(offset+4, true),
+					vendor: view.getUint32(offset+8, true),
+					product: view.getUint32(offset+12, true),
+					revision: view.getUint32(offset+16, true),
+					serial: view.getUint32(offset+20, true)
+				});
+			return list;
+		}
 	obj.heartbeat_str = function (cb){
-			obj.heartbeat(function(state){
-				if(state instanceof Error) cb(state);
+			obj.heartbeat(function(state, ts){
+				if(state instanceof Error) cb(state, ts);
 				else switch(state){
 					case dco.HB_BOOT:
-						cb("BOOT");
+						cb("BOOT", ts);
 						break;
 					case dco.HB_STOPPED:
-						cb("STOPPED");
+						cb("STOPPED", ts);
 						break;
 					case dco.HB_OPERATIONAL:
-						cb("OPERATIONAL");
+						cb("OPERATIONAL", ts);
 						break;
 					case dco.HB_PRE_OPERATIONAL:
-						cb("PRE_OPERATIONAL");
+						cb("PRE_OPERATIONAL", ts);
 						break;
 					default:
-						cb(state);
+						cb(state, ts);
 				}
 			});
 		}
@@ -101,14 +321,59 @@ function create_node(device, node_id){
 
 module.exports = {
 	"create_node": create_node,
+	"process_image_read": process_image_read,
+	"metrics_read": metrics_read,
+	"trace_read": trace_read,
+	"trace_candump": trace_candump,
 	"NMT_OPERATIONAL": dco.NMT_OPERATIONAL,
 	"NMT_STOP": dco.NMT_STOP,
 	"NMT_PRE_OPERATIONAL": dco.NMT_PRE_OPERATIONAL,
 	"NMT_RESET_NODE": dco.NMT_RESET_NODE,
 	"NMT_RESET_COMMUNICATION": dco.NMT_RESET_COMMUNICATION,
+	"SDO_ARRAY": dco.SDO_ARRAY,
+	"SDO_UINT8": dco.SDO_UINT8,
+	"SDO_INT8": dco.SDO_INT8,
+	"SDO_UINT16": dco.SDO_UINT16,
+	"SDO_INT16": dco.SDO_INT16,
+	"SDO_UINT32": dco.SDO_UINT32,
+	"SDO_INT32": dco.SDO_INT32,
+	"SDO_UINT64": dco.SDO_UINT64,
+	"SDO_INT64": dco.SDO_INT64,
+	"SDO_FLOAT32": dco.SDO_FLOAT32,
+	"SDO_FLOAT64": dco.SDO_FLOAT64,
+	"SDO_WRITE": dco.SDO_WRITE,
+	"SDO_READ": dco.SDO_READ,
+	"SDO_CONTINUE": dco.SDO_CONTINUE,
+	"SDO_NOT_EXECUTED": dco.SDO_NOT_EXECUTED,
+	"SDO_SCRIPT_ENTRY": dco.SDO_SCRIPT_ENTRY,
+	"SDO_SCRIPT_RESULT": dco.SDO_SCRIPT_RESULT,
 	"HB_BOOT": dco.HB_BOOT,
 	"HB_STOPPED": dco.HB_STOPPED,
 	"HB_OPERATIONAL": dco.HB_OPERATIONAL,
-	"HB_PRE_OPERATIONAL": dco.HB_PRE_OPERATIONAL
+	"HB_PRE_OPERATIONAL": dco.HB_PRE_OPERATIONAL,
+	"PDO_RING_HEADER": dco.PDO_RING_HEADER,
+	"PDO_RING_SLOT": dco.PDO_RING_SLOT,
+	"PROCESS_IMAGE_SIZE": dco.PROCESS_IMAGE_SIZE,
+	"PROCESS_IMAGE_HEADER": dco.PROCESS_IMAGE_HEADER,
+	"PROCESS_IMAGE_PDO": dco.PROCESS_IMAGE_PDO,
+	"REFLEX_PDO_BIT": dco.REFLEX_PDO_BIT,
+	"REFLEX_EMCY": dco.REFLEX_EMCY,
+	"REFLEX_INVERT": dco.REFLEX_INVERT,
+	"REFLEX_NMT": dco.REFLEX_NMT,
+	"REFLEX_SEND": dco.REFLEX_SEND,
+	"REFLEX_RULE": dco.REFLEX_RULE,
+	"REFLEX_REPORT": dco.REFLEX_REPORT,
+	"SCAN_ENTRY": dco.SCAN_ENTRY,
+	"METRICS_SIZE": dco.METRICS_SIZE,
+	"TRACE_HEADER": dco.TRACE_HEADER,
+	"TRACE_RECORD": dco.TRACE_RECORD,
+	"TRACE_TX": dco.TRACE_TX,
+	"TRACE_FD": dco.TRACE_FD,
+	"TRACE_BRS": dco.TRACE_BRS,
+	"PDO_MAP_TX": dco.PDO_MAP_TX,
+	"PDO_MAP_RX": dco.PDO_MAP_RX,
+	"PDO_MAP_SIGNED": dco.PDO_MAP_SIGNED,
+	"PDO_MAP_FLOAT": dco.PDO_MAP_FLOAT,
+	"PDO_BATCH_ENTRY": dco.PDO_BATCH_ENTRY
 };
 
@@ -84,10 +84,11 @@ function randomOutputs(con, nb_bl_out){
 	/* Test to switch the digital output */
 	t = new ArrayBuffer(nb_bl_out);
 	v = new Uint8Array(t);
+	/* Sent every 100ms by the native scheduler, javascript only updates t */
+	node.pdo_cyclic(0, t, 100000);
 	setInterval(function() {
 		for(var i=0; i<nb_bl_out; ++i)
 			v[i] = 1 << Math.floor(Math.random()*8);
-		node.pdo_send(0, t);
 	}, 100);
 }
 
@@ -0,0 +1,26 @@
+/* One socket per interface: the nodes of a device share its bus */
+var c = require("./common.js");
+var co = c.co, assert = c.assert;
+
+c.run(async function(){
+	var nodes = c.open("test_bus", [1, 2, 3], {sim_nodes: 3});
+
+	/* Each answer goes to the node it belongs to, the serial number of the
+	   simulated identity is the node id */
+	var serials = await Promise.all(nodes.map(
+		(node) => node.sdo_upload_uint32(0x1018, 4)));
+	assert.deepStrictEqual(serials, [1, 2, 3]);
+
+	/* A write to one node stays in its own dictionary */
+	await nodes[0].sdo_download_uint16(0x2003, 0, 0x1111);
+	await nodes[1].sdo_download_uint16(0x2003, 0, 0x2222);
+	assert.strictEqual(await nodes[0].sdo_upload_uint16(0x2003, 0), 0x1111);
+	assert.strictEqual(await nodes[1].sdo_upload_uint16(0x2003, 0), 0x2222);
+
+	assert.throws(() => co.create_node("test_bus", 2, {transport: "loopback"}),
+		/Node already exists on this bus/);
+
+	/* The seven SDO requests went through the one bus */
+	var m = co.metrics_read(nodes[0].metrics());
+	assert.strictEqual(m.tx[0x600 >> 7], 7n);
+});
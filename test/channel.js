@@ -0,0 +1,24 @@
+/* Additional SDO channels may not receive the COB-ID of another node */
+var c = require("./common.js");
+var co = c.co, assert = c.assert;
+
+c.run(async function(){
+	var nodes = c.open("test_channel", [1, 2], {sim_nodes: 2});
+	var node = nodes[0];
+
+	assert.strictEqual(node.sdo_add_channel(0x641, 0x5C1), 1);
+	assert.throws(() => node.sdo_add_channel(0x642, 0x5C1), /already exists/);
+
+	/* Default SDO response of node 2, TPDO, EMCY, heartbeat, LSS */
+	[0x582, 0x181, 0x081, 0x4FF, 0x702, 0x7E4].forEach(function(cob_rx){
+		assert.throws(() => node.sdo_add_channel(0x642, cob_rx), /reserved/,
+			cob_rx.toString(16));
+	});
+
+	/* Node 0x41 would lose its SDO responses to the channel */
+	assert.throws(() => co.create_node("test_channel", 0x41, {transport: "loopback"}),
+		/used by a SDO channel/);
+
+	/* The node 2 still gets its own answers */
+	assert.strictEqual(await nodes[1].sdo_upload_uint32(0x1018, 4), 2);
+});
@@ -0,0 +1,61 @@
+/* Helpers shared by the tests */
+var assert = require("assert");
+var fs = require("fs");
+var os = require("os");
+var path = require("path");
+var co = require("../direct-canopen.js");
+
+function wait(ms){
+	return new Promise((resolve) => setTimeout(resolve, ms));
+}
+
+/* Temporary file removed by the caller */
+function tmpfile(name){
+	return path.join(os.tmpdir(), "dcanopen-" + process.pid + "-" + name);
+}
+
+/* Nodes on a loopback bus of their own, the device name only identifies the
+   bus in the process */
+function open(device, node_ids, sim){
+	var options = Object.assign({transport: "loopback", sim_heartbeat: 0}, sim);
+	return node_ids.map((id) => co.create_node(device, id, options));
+}
+
+/* Recording of received frames [[can_id, data], ...] 1 ms apart, the header
+   taken from the recording `model` */
+function trace_write(model, path, frames){
+	var header = fs.readFileSync(model).subarray(0, co.TRACE_HEADER);
+	var size = header.readUInt32LE(12);
+	var file = Buffer.alloc(co.TRACE_HEADER + frames.length * size);
+	var offset;
+	header.copy(file);
+	file.writeBigUInt64LE(BigInt(frames.length), 16); /* Capacity */
+	file.writeBigUInt64LE(BigInt(frames.length), 24); /* Head */
+	frames.forEach(function(f, i){
+		offset = co.TRACE_HEADER + i * size;
+		file.writeBigUInt64LE(BigInt(i + 1) * 1000000n, offset);
+		file.writeUInt32LE(f[0], offset + 8);
+		file.writeUInt8(f[1].length, offset + 12);
+		Buffer.from(f[1]).copy(file, offset + co.TRACE_RECORD);
+	});
+	fs.writeFileSync(path, file);
+}
+
+/* Run the async test, exit with its status: the bus threads keep the process
+   alive otherwise */
+function run(test){
+	test().then(() => process.exit(0), function(e){
+		console.error(e.stack || e);
+		process.exit(1);
+	});
+}
+
+module.exports = {
+	"co": co,
+	"assert": assert,
+	"wait": wait,
+	"tmpfile": tmpfile,
+	"open": open,
+	"trace_write": trace_write,
+	"run": run
+};
@@ -0,0 +1,50 @@
+/* CAN FD: PDO above 8 bytes and the safe state RPDO of the reflex rules are
+   sent as FD frames, with the bit rate switch of the bus */
+var c = require("./common.js");
+var co = c.co, assert = c.assert;
+var fs = require("fs");
+
+var FD_FLAGS = co.TRACE_TX | co.TRACE_FD | co.TRACE_BRS;
+
+c.run(async function(){
+	var path = c.tmpfile("fd.bin"), emcy = c.tmpfile("emcy.bin");
+	var node = c.open("test_fd", [1], {sim_nodes: 1, fd: true, brs: true})[0];
+	var payload = Uint8Array.from({length: 46}, (_, i) => i + 1);
+	var safe = [0xA5, 1, 2, 3, 4, 5, 6, 7];
+
+	try {
+		/* PDO of 46 bytes, padded to the next FD length */
+		node.trace_start(path);
+		node.pdo_send(0, payload.buffer);
+		await c.wait(10);
+		node.trace_stop();
+		var sent = co.trace_read(path).filter((f) => f.can_id == 0x201);
+		assert.strictEqual(sent.length, 1);
+		assert.strictEqual(sent[0].flags, FD_FLAGS);
+		assert.strictEqual(sent[0].data.length, 48);
+		assert.deepStrictEqual(Array.from(sent[0].data.subarray(0, 46)), Array.from(payload));
+		assert.deepStrictEqual(Array.from(sent[0].data.subarray(46)), [0, 0]);
+
+		/* EMCY of node 1 replayed into the bus: the rule sends the safe state */
+		var reported = new Promise(function(resolve){
+			node.reflex_load_list([{type: co.REFLEX_EMCY, src_node: 1, dst_node: 2,
+				dst_pdo: 1, actions: co.REFLEX_SEND, data: safe}], resolve);
+		});
+		c.trace_write(path, emcy, [[0x081, [0x30, 0x81, 0x11, 0, 0, 0, 0, 0]]]);
+		node.trace_start(path);
+		assert.strictEqual(await node.trace_replay(emcy, {speed: 0}), 1);
+		var reports = await reported;
+		node.trace_stop();
+		node.reflex_load();
+		assert.strictEqual(reports.length, 1);
+		assert.strictEqual(reports[0].node, 1);
+
+		sent = co.trace_read(path).filter((f) => f.can_id == 0x302);
+		assert.strictEqual(sent.length, 1);
+		assert.strictEqual(sent[0].flags, FD_FLAGS);
+		assert.deepStrictEqual(Array.from(sent[0].data), safe);
+	} finally {
+		fs.rmSync(path, {force: true});
+		fs.rmSync(emcy, {force: true});
+	}
+});
@@ -0,0 +1,33 @@
+/* Regression tests against the simulated slaves of the loopback transport, no
+   hardware needed
+
+   node test [name ...]
+
+   Each test runs in its own process: the buses keep native threads and the
+   tests exit with their status. */
+var child_process = require("child_process");
+var fs = require("fs");
+var path = require("path");
+
+var TIMEOUT = 30000;
+
+function list(){
+	return fs.readdirSync(__dirname)
+		.filter((f) => f.endsWith(".js") && f != "index.js" && f != "common.js")
+		.map((f) => f.slice(0, -3));
+}
+
+var tests = process.argv.length > 2 ? process.argv.slice(2) : list();
+var failed = [];
+
+tests.forEach(function(name){
+	var start = Date.now();
+	var r = child_process.spawnSync(process.execPath,
+		[path.join(__dirname, name + ".js")], {stdio: "inherit", timeout: TIMEOUT});
+	var ok = r.status === 0;
+	console.log((ok ? "ok" : "FAIL") + " " + name + " (" + (Date.now() - start) + " ms)");
+	if(!ok) failed.push(name);
+});
+
+console.log(tests.length - failed.length + "/" + tests.length + " passed");
+process.exit(failed.length ? 1 : 0);
@@ -0,0 +1,78 @@
+/* Reflex rules: a TPDO bit drives a RPDO bit on its changes only */
+var c = require("./common.js");
+var co = c.co, assert = c.assert;
+var fs = require("fs");
+
+var path = c.tmpfile("reflex.bin"), input = c.tmpfile("input.bin");
+
+/* Rule copying bit 0 of the TPDO of node 1 into bit `dst_bit` of the RPDO of
+   node `dst_node` */
+function rule(dst_node, dst_bit, data){
+	return {type: co.REFLEX_PDO_BIT, src_node: 1, src_pdo: 0, src_bit: 0,
+		dst_node: dst_node, dst_pdo: 0, dst_bit: dst_bit || 0, data: data || [0]};
+}
+
+/* Replay TPDO of node 1 with the bits 0 given, the frames sent meanwhile */
+async function replay(node, bits){
+	c.trace_write(path, input, bits.map((v) => [0x181, [v]]));
+	node.trace_start(path);
+	assert.strictEqual(await node.trace_replay(input, {speed: 0}), bits.length);
+	await c.wait(10);
+	node.trace_stop();
+	return co.trace_read(path).filter((f) => f.flags & co.TRACE_TX);
+}
+
+c.run(async function(){
+	var nodes = c.open("test_reflex", [1, 2], {sim_nodes: 1});
+	var node = nodes[0];
+	var reports = [], lost = 0, sent;
+	var collect = function(list, n){ reports = reports.concat(list); lost += n; };
+
+	try {
+		/* The model of the recordings */
+		node.trace_start(path);
+		node.trace_stop();
+
+		/* The first TPDO only gives the state, then two edges */
+		node.reflex_load_list([rule(2)], collect);
+		sent = await replay(node, [1, 1, 0, 1]);
+		node.reflex_load();
+		assert.strictEqual(reports.length, 2);
+		assert.deepStrictEqual(sent.filter((f) => f.can_id == 0x202).map((f) => f.data[0]), [0, 1]);
+
+		/* A rejected reload keeps the rules in place */
+		reports = [];
+		node.reflex_load_list([rule(3)], collect);
+		assert.throws(() => node.reflex_load_list([rule(3, 9)]), /out of the RPDO/);
+		sent = await replay(node, [0, 1]);
+		node.reflex_load();
+		assert.strictEqual(reports.length, 1);
+		assert.deepStrictEqual(sent.map((f) => f.can_id), [0x203]);
+
+		/* More rules firing than frames in one batch: all sent, all reported
+		   or counted as lost */
+		reports = [];
+		var many = Array.from({length: 100}, (_, i) => rule(10 + i));
+		node.reflex_load_list(many, collect);
+		sent = await replay(node, [0, 1]);
+		node.reflex_load();
+		assert.strictEqual(reports.length + lost, 100);
+		assert.deepStrictEqual(sent.map((f) => f.can_id).sort((a, b) => a - b),
+			many.map((r) => 0x200 + r.dst_node));
+
+		/* The bit goes into the buffer of a cyclic RPDO, the other bits are the
+		   ones javascript wrote there */
+		var output = new Uint8Array([0xF0]);
+		nodes[1].pdo_cyclic(0, output.buffer, 10000000);
+		node.reflex_load_list([rule(2, 0, [0x0E])]);
+		sent = await replay(node, [0, 1]);
+		node.reflex_load();
+		nodes[1].pdo_cyclic(0);
+		assert.strictEqual(output[0], 0xF1);
+		/* The first period may be in the recording, the reflex frame is last */
+		assert.strictEqual(sent.filter((f) => f.can_id == 0x202).pop().data[0], 0xF1);
+	} finally {
+		fs.rmSync(path, {force: true});
+		fs.rmSync(input, {force: true});
+	}
+});
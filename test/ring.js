@@ -0,0 +1,36 @@
+/* PDO ring: the free running indexes wrap at 2^32 without losing frames */
+var c = require("./common.js");
+var co = c.co, assert = c.assert;
+
+var SLOTS = 8;
+var FRAMES = 64;
+
+c.run(async function(){
+	var node = c.open("test_ring", [1], {sim_nodes: 1, sim_tpdo: 1000})[0];
+	var last, received = 0, gaps = 0, done;
+	var finished = new Promise((resolve) => done = resolve);
+
+	assert.throws(() => node.pdo_ring(6, () => 0));
+
+	var ring = node.pdo_ring(SLOTS, function(){
+		node.pdo_ring_read(ring, function(pdoid, data){
+			/* The simulated TPDO carries a 32 bits counter */
+			var counter = new DataView(data.buffer, data.byteOffset).getUint32(0, true);
+			if(last !== undefined && counter != last + 1) ++gaps;
+			last = counter;
+			if(++received == FRAMES) done();
+		});
+	});
+	/* Header: head, tail, slots, dropped. Start close to the wrap. */
+	var header = new Uint32Array(ring, 0, 4);
+	header[0] = header[1] = 0xFFFFFFF0;
+
+	node.nmt_send(co.NMT_OPERATIONAL);
+	await finished;
+	node.nmt_send(co.NMT_PRE_OPERATIONAL);
+
+	assert.strictEqual(gaps, 0);
+	assert.strictEqual(header[3], 0);
+	assert.ok(header[0] < 0xFFFFFFF0, "head did not wrap");
+	node.pdo_ring(0);
+});
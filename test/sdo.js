@@ -0,0 +1,54 @@
+/* Typed SDO requests queued far beyond the initial capacity of the queue */
+var c = require("./common.js");
+var co = c.co, assert = c.assert;
+
+var COUNT = 300;
+var TYPES = [
+	[co.SDO_UINT8,   (i) => i & 0xFF],
+	[co.SDO_INT8,    (i) => -(i & 0x7F)],
+	[co.SDO_UINT16,  (i) => i * 199],
+	[co.SDO_INT16,   (i) => -i * 97],
+	[co.SDO_UINT32,  (i) => i * 0x01010101 >>> 0],
+	[co.SDO_INT32,   (i) => -i * 100003],
+	[co.SDO_UINT64,  (i) => BigInt(i) << 40n],
+	[co.SDO_INT64,   (i) => -BigInt(i) << 36n],
+	[co.SDO_FLOAT32, (i) => i + 0.5],
+	[co.SDO_FLOAT64, (i) => i / 3]
+];
+
+/* One object per type, one subindex per request */
+function request(i){
+	var t = TYPES[i % TYPES.length];
+	return { index: 0x2100 + i % TYPES.length, subindex: 1 + Math.floor(i / TYPES.length),
+		type: t[0], value: t[1](i) };
+}
+
+c.run(async function(){
+	var node = c.open("test_sdo", [1], {sim_nodes: 1, sdo_queue_size: 4})[0];
+	var writes = [], reads = [], i, r;
+
+	for(i = 0; i < COUNT; ++i){
+		r = request(i);
+		writes.push(node.sdo_write(r.index, r.subindex, r.type, r.value));
+	}
+	/* A failing request in the middle gives its slot back */
+	var missing = node.sdo_read(0x3000, 0, co.SDO_UINT32);
+	assert.strictEqual(node.sdo_pending(), COUNT + 1);
+	await Promise.all(writes);
+	await assert.rejects(missing, /SDO abort/);
+
+	for(i = 0; i < COUNT; ++i){
+		r = request(i);
+		reads.push(node.sdo_read(r.index, r.subindex, r.type));
+	}
+	var values = await Promise.all(reads);
+	for(i = 0; i < COUNT; ++i)
+		assert.strictEqual(values[i], request(i).value, "request " + i);
+	/* The last channel is handed back after its promise settles */
+	await c.wait(10);
+	assert.strictEqual(node.sdo_pending(), 0);
+
+	var m = co.metrics_read(node.metrics());
+	assert.strictEqual(m.sdo_requests, BigInt(2 * COUNT + 1));
+	assert.ok(m.sdo_queue_high >= BigInt(COUNT));
+});
@@ -0,0 +1,64 @@
+/* Trace recorder and replay of the received frames */
+var c = require("./common.js");
+var co = c.co, assert = c.assert;
+var fs = require("fs");
+
+var TPDO = 0x181;
+
+c.run(async function(){
+	var path = c.tmpfile("trace.bin"), shuffled = c.tmpfile("shuffled.bin");
+	var node = c.open("test_trace", [1], {sim_nodes: 1, sim_tpdo: 2000})[0];
+	var live = 0;
+
+	try {
+		/* Record SDO both ways and a few TPDO */
+		node.trace_start(path);
+		node.pdo_recv(() => ++live);
+		assert.strictEqual(await node.sdo_upload_uint32(0x1018, 4), 1);
+		node.nmt_send(co.NMT_OPERATIONAL);
+		await c.wait(100);
+		node.nmt_send(co.NMT_PRE_OPERATIONAL);
+		await c.wait(10);
+		node.trace_stop();
+
+		var frames = co.trace_read(path);
+		var rx = frames.filter((f) => !(f.flags & co.TRACE_TX));
+		var tpdo = rx.filter((f) => f.can_id == TPDO);
+		assert.ok(frames.some((f) => (f.flags & co.TRACE_TX) && f.can_id == 0x601));
+		assert.ok(rx.some((f) => f.can_id == 0x581));
+		assert.strictEqual(tpdo.length, live);
+		/* The sent frames are stamped after the write, an answer may come first */
+		for(var i = 1; i < rx.length; ++i)
+			assert.ok(rx[i].timestamp >= rx[i-1].timestamp, "record " + i);
+		assert.ok(/ 601#40181004/.test(co.trace_candump(path)));
+
+		/* Replay the received frames into the bus, the sender stays silent */
+		var replayed = 0;
+		node.pdo_recv(() => ++replayed);
+		assert.strictEqual(await node.trace_replay(path, {speed: 0}), rx.length);
+		assert.strictEqual(replayed, live);
+
+		/* Records out of timestamp order: the answer of the SDO is older than
+		   the request before it, swap the first and last TPDO as well. The
+		   replay times from the oldest record and does not wait for ages. */
+		var file = fs.readFileSync(path);
+		var view = new DataView(file.buffer, file.byteOffset, file.byteLength);
+		var size = view.getUint32(12, true);
+		var first = co.TRACE_HEADER + frames.indexOf(tpdo[0]) * size;
+		var last = co.TRACE_HEADER + frames.indexOf(tpdo[tpdo.length - 1]) * size;
+		var ts = view.getBigUint64(first, true);
+		view.setBigUint64(first, view.getBigUint64(last, true), true);
+		view.setBigUint64(last, ts, true);
+		fs.writeFileSync(shuffled, file);
+		replayed = 0;
+		var start = Date.now();
+		assert.strictEqual(await node.trace_replay(shuffled, {speed: 2}), rx.length);
+		assert.strictEqual(replayed, live);
+		assert.ok(Date.now() - start < 2000, "replay waited " + (Date.now() - start) + " ms");
+
+		assert.throws(() => node.trace_replay(__filename), /Invalid trace file/);
+	} finally {
+		fs.rmSync(path, {force: true});
+		fs.rmSync(shuffled, {force: true});
+	}
+});